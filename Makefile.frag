@@ -0,0 +1,22 @@
+SOAK_ARGS =
+PYTHON_SUPP =
+BENCH_ARGS =
+
+soak: all
+	PYTHONTRACEMALLOC=1 $(PHP_EXECUTABLE) -n -d extension=$(phplibdir)/pygments.so \
+		$(srcdir)/tests/soak.php $(SOAK_ARGS)
+
+soak-valgrind: all
+	supp="$(PYTHON_SUPP)"; \
+	USE_ZEND_ALLOC=0 ZEND_DONT_UNLOAD_MODULES=1 PYTHONMALLOC=malloc \
+		valgrind --error-exitcode=1 --leak-check=full $${supp:+--suppressions=$$supp} \
+		$(PHP_EXECUTABLE) -n -d extension=$(phplibdir)/pygments.so \
+		$(srcdir)/tests/soak.php --calls=20000 --warmup=2000 --interval=1000 \
+		--max-drift=0 --quiet $(SOAK_ARGS)
+
+# The parallel extension is loaded from php.ini, so -n is not passed here.
+bench-threads: all
+	$(PHP_EXECUTABLE) -d extension=$(phplibdir)/pygments.so \
+		$(srcdir)/tests/bench_threads.php $(BENCH_ARGS)
+
+.PHONY: soak soak-valgrind bench-threads
@@ -0,0 +1,467 @@
+/*
+ * cache.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "cache.h"
+#include <ext/standard/md5.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TOKEN_ENTRY_CAPSULE "pygments.token_entry"
+
+/* How far past its expected position a token's value is searched for in the
+ * code. Lexers only drop or rewrite a few characters of their input (e.g.
+ * leading newlines or carriage returns), so a token that is not found nearby
+ * is stored as a separate string instead.
+ */
+#define TOKEN_SEARCH_WINDOW 64
+
+/* An estimate of the memory held by an entry in addition to its records and
+ * strings (i.e. the dict slot, key and capsule).
+ */
+#define TOKEN_ENTRY_OVERHEAD 160
+
+struct token_record
+{
+    uint32_t type;
+
+    /* The offset of the value in the code. If negative, then the value is
+     * element -(offset + 1) of the entry's literals list.
+     */
+    int32_t offset;
+    int32_t length;
+};
+
+struct token_entry
+{
+    int truncated;
+    long size;
+
+    /* Values that do not appear in the code. This is NULL if there are none. */
+    PyObject* literals;
+
+    Py_ssize_t count;
+    struct token_record records[1];
+};
+
+static void free_entry(PyObject* capsule)
+{
+    struct token_entry* entry = PyCapsule_GetPointer(capsule,TOKEN_ENTRY_CAPSULE);
+
+    if (entry != NULL) {
+        Py_XDECREF(entry->literals);
+        free(entry);
+    }
+}
+
+int token_cache_init(struct token_cache* cache)
+{
+    memset(cache,0,sizeof(struct token_cache));
+
+    cache->entries = PyDict_New();
+    cache->types = PyList_New(0);
+    cache->type_ids = PyDict_New();
+    if (cache->entries == NULL || cache->types == NULL || cache->type_ids == NULL) {
+        PyErr_Clear();
+        token_cache_free(cache);
+        return -1;
+    }
+
+    return 0;
+}
+
+void token_cache_free(struct token_cache* cache)
+{
+    Py_CLEAR(cache->entries);
+    Py_CLEAR(cache->types);
+    Py_CLEAR(cache->type_ids);
+    cache->size = 0;
+    cache->max_size = 0;
+}
+
+int token_cache_enabled(const struct token_cache* cache)
+{
+    return cache->max_size > 0 && cache->entries != NULL;
+}
+
+void token_cache_key(unsigned char* key,const char* code,const struct lexer_options* opts,
+    const struct preview_options* preview)
+{
+    PHP_MD5_CTX md5;
+    char buf[64];
+    const char* strings[] = {
+        opts != NULL ? opts->preferred_lexer : NULL,
+        opts != NULL ? opts->filename : NULL
+    };
+    size_t i;
+
+    PHP_MD5Init(&md5);
+    PHP_MD5Update(&md5,code,strlen(code));
+
+    /* Each string is prefixed with a flag so that NULL and empty strings are
+     * distinguished.
+     */
+    for (i = 0;i < sizeof(strings) / sizeof(strings[0]);++i) {
+        if (strings[i] != NULL) {
+            PHP_MD5Update(&md5,"\0\1",2);
+            PHP_MD5Update(&md5,strings[i],strlen(strings[i]));
+        }
+        else {
+            PHP_MD5Update(&md5,"\0\0",2);
+        }
+    }
+
+    snprintf(buf,sizeof(buf),"\n%ld %ld",preview->max_lines,preview->max_bytes);
+    PHP_MD5Update(&md5,buf,strlen(buf));
+    PHP_MD5Final(key,&md5);
+}
+
+/* Removes the least recently used entry. */
+static int evict_entry(struct token_cache* cache)
+{
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* capsule;
+    struct token_entry* entry;
+
+    if (!PyDict_Next(cache->entries,&pos,&key,&capsule)) {
+        return -1;
+    }
+
+    entry = PyCapsule_GetPointer(capsule,TOKEN_ENTRY_CAPSULE);
+    if (entry != NULL) {
+        cache->size -= entry->size;
+    }
+    PyErr_Clear();
+
+    if (PyDict_DelItem(cache->entries,key) == -1) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    cache->evictions += 1;
+    return 0;
+}
+
+PyObject* token_cache_get(struct token_cache* cache,const unsigned char* key,PyObject* code,
+    int* truncated)
+{
+    Py_ssize_t i;
+    PyObject* pykey;
+    PyObject* capsule;
+    PyObject* tokens;
+    struct token_entry* entry;
+
+    if (!token_cache_enabled(cache)) {
+        return NULL;
+    }
+
+    pykey = PyBytes_FromStringAndSize((const char*)key,16);
+    if (pykey == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    capsule = PyDict_GetItemWithError(cache->entries,pykey);
+    if (capsule == NULL) {
+        PyErr_Clear();
+        Py_DECREF(pykey);
+        cache->misses += 1;
+        return NULL;
+    }
+
+    /* Move the entry to the end of the dict to mark it as most recently
+     * used.
+     */
+    Py_INCREF(capsule);
+    if (PyDict_DelItem(cache->entries,pykey) == -1
+        || PyDict_SetItem(cache->entries,pykey,capsule) == -1)
+    {
+        PyErr_Clear();
+    }
+    Py_DECREF(pykey);
+
+    entry = PyCapsule_GetPointer(capsule,TOKEN_ENTRY_CAPSULE);
+    if (entry == NULL) {
+        PyErr_Clear();
+        Py_DECREF(capsule);
+        cache->misses += 1;
+        return NULL;
+    }
+
+    /* Rebuild the token stream. */
+    tokens = PyList_New(entry->count);
+    if (tokens == NULL) {
+        PyErr_Clear();
+        Py_DECREF(capsule);
+        return NULL;
+    }
+
+    for (i = 0;i < entry->count;++i) {
+        PyObject* value;
+        PyObject* token;
+        const struct token_record* record = entry->records + i;
+
+        if (record->offset >= 0) {
+            value = PyUnicode_Substring(code,record->offset,
+                (Py_ssize_t)record->offset + record->length);
+        }
+        else {
+            value = PyList_GET_ITEM(entry->literals,-(record->offset + 1));
+            Py_INCREF(value);
+        }
+        if (value == NULL) {
+            break;
+        }
+
+        token = PyTuple_Pack(2,PyList_GET_ITEM(cache->types,record->type),value);
+        Py_DECREF(value);
+        if (token == NULL) {
+            break;
+        }
+
+        PyList_SET_ITEM(tokens,i,token);
+    }
+
+    if (i < entry->count) {
+        PyErr_Clear();
+        Py_DECREF(tokens);
+        Py_DECREF(capsule);
+        return NULL;
+    }
+
+    if (truncated != NULL) {
+        *truncated = entry->truncated;
+    }
+
+    Py_DECREF(capsule);
+    cache->hits += 1;
+
+    return tokens;
+}
+
+/* Gets the id of the token type, assigning a new id if needed. Returns -1 on
+ * failure.
+ */
+static long type_id(struct token_cache* cache,PyObject* ttype)
+{
+    long id;
+    PyObject* pyid;
+
+    pyid = PyDict_GetItemWithError(cache->type_ids,ttype);
+    if (pyid != NULL) {
+        return PyLong_AsLong(pyid);
+    }
+    if (PyErr_Occurred()) {
+        return -1;
+    }
+
+    id = (long)PyList_GET_SIZE(cache->types);
+    pyid = PyLong_FromLong(id);
+    if (pyid == NULL) {
+        return -1;
+    }
+
+    if (PyDict_SetItem(cache->type_ids,ttype,pyid) == -1) {
+        Py_DECREF(pyid);
+        return -1;
+    }
+    Py_DECREF(pyid);
+
+    if (PyList_Append(cache->types,ttype) == -1) {
+        PyDict_DelItem(cache->type_ids,ttype);
+        return -1;
+    }
+
+    return id;
+}
+
+/* Converts the tokens into an entry. Returns NULL if the tokens cannot be
+ * stored.
+ */
+static struct token_entry* make_entry(struct token_cache* cache,PyObject* code,
+    PyObject* tokens)
+{
+    Py_ssize_t i;
+    Py_ssize_t count;
+    Py_ssize_t cursor = 0;
+    Py_ssize_t code_len;
+    struct token_entry* entry;
+
+    count = PyList_GET_SIZE(tokens);
+    code_len = PyUnicode_GET_LENGTH(code);
+    if (code_len > INT32_MAX) {
+        return NULL;
+    }
+
+    entry = calloc(1,sizeof(struct token_entry) + count * sizeof(struct token_record));
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    entry->count = count;
+    entry->size = sizeof(struct token_entry) + count * sizeof(struct token_record)
+        + TOKEN_ENTRY_OVERHEAD;
+
+    for (i = 0;i < count;++i) {
+        long id;
+        Py_ssize_t len;
+        Py_ssize_t offset;
+        Py_ssize_t end;
+        PyObject* token = PyList_GET_ITEM(tokens,i);
+        PyObject* value;
+        struct token_record* record = entry->records + i;
+
+        if (!PyTuple_Check(token) || PyTuple_GET_SIZE(token) != 2
+            || !PyUnicode_Check(PyTuple_GET_ITEM(token,1)))
+        {
+            break;
+        }
+
+        id = type_id(cache,PyTuple_GET_ITEM(token,0));
+        if (id < 0 || id > (long)UINT32_MAX) {
+            break;
+        }
+
+        value = PyTuple_GET_ITEM(token,1);
+        len = PyUnicode_GET_LENGTH(value);
+
+        /* Find the value in the code, which is usually at the cursor. */
+        if (cursor + len <= code_len && PyUnicode_Tailmatch(code,value,cursor,cursor + len,-1) == 1) {
+            offset = cursor;
+        }
+        else {
+            end = cursor + len + TOKEN_SEARCH_WINDOW;
+            offset = PyUnicode_Find(code,value,cursor,end < code_len ? end : code_len,1);
+            if (offset == -2) {
+                break;
+            }
+        }
+
+        record->type = (uint32_t)id;
+        record->length = (int32_t)len;
+
+        if (offset >= 0) {
+            record->offset = (int32_t)offset;
+            cursor = offset + len;
+            continue;
+        }
+
+        /* Otherwise store the value separately. */
+        if (entry->literals == NULL) {
+            entry->literals = PyList_New(0);
+            if (entry->literals == NULL) {
+                break;
+            }
+        }
+
+        if (PyList_Append(entry->literals,value) == -1) {
+            break;
+        }
+
+        record->offset = -(int32_t)PyList_GET_SIZE(entry->literals);
+        entry->size += sizeof(PyObject*) + sizeof(PyUnicodeObject)
+            + (len + 1) * PyUnicode_KIND(value);
+    }
+
+    if (i < count) {
+        PyErr_Clear();
+        Py_XDECREF(entry->literals);
+        free(entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+void token_cache_put(struct token_cache* cache,const unsigned char* key,PyObject* code,
+    PyObject* tokens,int truncated)
+{
+    PyObject* pykey;
+    PyObject* capsule;
+    struct token_entry* entry;
+
+    if (!token_cache_enabled(cache) || !PyList_Check(tokens)) {
+        return;
+    }
+
+    entry = make_entry(cache,code,tokens);
+    if (entry == NULL) {
+        return;
+    }
+    entry->truncated = truncated;
+
+    /* An entry that would not fit even in an empty cache is not stored. */
+    if (entry->size > cache->max_size) {
+        Py_XDECREF(entry->literals);
+        free(entry);
+        return;
+    }
+
+    capsule = PyCapsule_New(entry,TOKEN_ENTRY_CAPSULE,free_entry);
+    if (capsule == NULL) {
+        PyErr_Clear();
+        Py_XDECREF(entry->literals);
+        free(entry);
+        return;
+    }
+
+    pykey = PyBytes_FromStringAndSize((const char*)key,16);
+    if (pykey == NULL) {
+        PyErr_Clear();
+        Py_DECREF(capsule);
+        return;
+    }
+
+    /* Replace any existing entry for the key. */
+    if (PyDict_Contains(cache->entries,pykey) == 1) {
+        PyObject* old = PyDict_GetItem(cache->entries,pykey);
+        struct token_entry* prev = PyCapsule_GetPointer(old,TOKEN_ENTRY_CAPSULE);
+
+        if (prev != NULL) {
+            cache->size -= prev->size;
+        }
+        PyDict_DelItem(cache->entries,pykey);
+    }
+    PyErr_Clear();
+
+    while (cache->size + entry->size > cache->max_size) {
+        if (evict_entry(cache) == -1) {
+            break;
+        }
+    }
+
+    if (PyDict_SetItem(cache->entries,pykey,capsule) == -1) {
+        PyErr_Clear();
+    }
+    else {
+        cache->size += entry->size;
+    }
+
+    Py_DECREF(pykey);
+    Py_DECREF(capsule);
+}
+
+void token_cache_clear(struct token_cache* cache)
+{
+    if (cache->entries != NULL) {
+        PyDict_Clear(cache->entries);
+    }
+
+    cache->size = 0;
+}
+
+long token_cache_count(const struct token_cache* cache)
+{
+    if (cache->entries == NULL) {
+        return 0;
+    }
+
+    return (long)PyDict_GET_SIZE(cache->entries);
+}
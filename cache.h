@@ -0,0 +1,94 @@
+/*
+ * cache.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "highlight.h"
+
+/*
+ * token_cache
+ *
+ * Caches the token streams produced by lexing so that highlighting the same
+ * code again (e.g. with different formatter options) only runs the formatter.
+ * Each stream is stored natively as an array of (token type id, offset, length)
+ * records that refer to the original code. A token whose value does not appear
+ * in the code (e.g. the newline that lexers append to the input) is stored as a
+ * separate string. Entries are keyed by a digest of the code, the requested
+ * lexer name and filename, and the preview limits. The key does not identify the
+ * lexer that these resolve to, so the same code highlighted under different
+ * aliases of a lexer (or by lexer name and by filename) is cached separately;
+ * this avoids looking up the lexer on a hit. The least recently used entries are
+ * evicted to keep the cache within its size limit.
+ */
+
+struct token_cache
+{
+    /* The maximum size (in bytes) of the cached entries. The cache is disabled
+     * if this is zero.
+     */
+    long max_size;
+
+    /* The approximate size (in bytes) of the memory held by the entries. */
+    long size;
+
+    /* Maps keys to capsules that store the entries. The dict is kept in order
+     * of use so that the least recently used entry is first.
+     */
+    PyObject* entries;
+
+    /* The token types seen by the cache, indexed by id, and a dict that maps
+     * each type to its id.
+     */
+    PyObject* types;
+    PyObject* type_ids;
+
+    /* Lookup statistics */
+    long hits;
+    long misses;
+    long evictions;
+};
+
+/* Initializes the cache. The cache is initially disabled. */
+int token_cache_init(struct token_cache* cache);
+
+/* Frees the cache's members. */
+void token_cache_free(struct token_cache* cache);
+
+/* Determines if the cache is enabled. */
+int token_cache_enabled(const struct token_cache* cache);
+
+/* Computes the key that identifies the tokens for the code from the requested
+ * lexer name and filename (not the resolved lexer). The preview limits are
+ * included since they determine how much of the code is lexed.
+ */
+void token_cache_key(unsigned char* key,const char* code,const struct lexer_options* opts,
+    const struct preview_options* preview);
+
+/* Gets the tokens stored for the key as a list of (token type, value) tuples
+ * whose values are taken from 'code'. If 'truncated' is not NULL, then it is set
+ * to the truncation flag stored with the tokens. Returns a new reference or NULL
+ * if the tokens are not cached.
+ */
+PyObject* token_cache_get(struct token_cache* cache,const unsigned char* key,PyObject* code,
+    int* truncated);
+
+/* Stores a list of (token type, value) tuples produced by lexing 'code' under
+ * the key, evicting older entries as needed. Tokens that cannot be stored are
+ * simply not cached.
+ */
+void token_cache_put(struct token_cache* cache,const unsigned char* key,PyObject* code,
+    PyObject* tokens,int truncated);
+
+/* Removes every entry from the cache. The statistics are left alone. */
+void token_cache_clear(struct token_cache* cache);
+
+/* Gets the number of entries in the cache. */
+long token_cache_count(const struct token_cache* cache);
+
+#endif
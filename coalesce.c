@@ -0,0 +1,391 @@
+/*
+ * coalesce.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "coalesce.h"
+#include <ext/standard/md5.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* How often (in seconds) a waiting call checks that the process computing the
+ * result is still running.
+ */
+#define COALESCE_POLL_INTERVAL 0.25
+
+enum slot_state
+{
+    SLOT_FREE,
+    SLOT_RUNNING,
+    SLOT_DONE,
+    SLOT_FAILED
+};
+
+/*
+ * coalesce_slot
+ *
+ * An in-flight call. The result is stored in the slot's region of the data area
+ * that follows the slots.
+ */
+
+struct coalesce_slot
+{
+    int state;
+    unsigned char key[16];
+
+    /* Incremented each time the slot is claimed so that a call can tell if the
+     * slot it refers to was reused.
+     */
+    unsigned long generation;
+
+    /* The process computing the result and when it started. */
+    pid_t owner;
+    double started;
+
+    /* The number of calls waiting for the result. The slot is freed once the
+     * result is published and every waiting call has copied it.
+     */
+    long waiters;
+
+    /* The published result. */
+    size_t length;
+    int truncated;
+    double time;
+    double published;
+};
+
+struct coalesce_table
+{
+    pthread_mutex_t lock;
+
+    /* Broadcast whenever a result is published. */
+    pthread_cond_t done;
+
+    size_t size;
+    long nslots;
+    size_t capacity;
+    double timeout;
+
+    struct coalesce_stats stats;
+    struct coalesce_slot slots[1];
+};
+
+static size_t header_size(long nslots)
+{
+    size_t size;
+
+    size = sizeof(struct coalesce_table) + (nslots - 1) * sizeof(struct coalesce_slot);
+    return (size + 15) & ~(size_t)15;
+}
+
+static char* slot_data(struct coalesce_table* table,long slot)
+{
+    return (char*)table + header_size(table->nslots) + slot * table->capacity;
+}
+
+static void table_lock(struct coalesce_table* table)
+{
+    /* If a process died while holding the lock, then the table is still
+     * consistent since it is only modified in single steps.
+     */
+    if (pthread_mutex_lock(&table->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&table->lock);
+    }
+}
+
+static void table_unlock(struct coalesce_table* table)
+{
+    pthread_mutex_unlock(&table->lock);
+}
+
+/* Determines if a slot can be claimed for a new call. A result that was never
+ * collected by its waiting calls, or a call whose process has exited or that
+ * has run past the timeout, does not hold onto its slot. Waiting calls only copy
+ * a result under the lock after checking that its slot was not reclaimed.
+ */
+static int slot_available(const struct coalesce_table* table,const struct coalesce_slot* slot,
+    double now)
+{
+    switch (slot->state) {
+    case SLOT_FREE:
+        return 1;
+    case SLOT_RUNNING:
+        return now - slot->started > table->timeout
+            || (kill(slot->owner,0) == -1 && errno == ESRCH);
+    default:
+        return slot->waiters == 0 || now - slot->published > table->timeout;
+    }
+}
+
+struct coalesce_table* coalesce_create(size_t size,long slots,double timeout)
+{
+    struct coalesce_table* table;
+    pthread_mutexattr_t mattr;
+    pthread_condattr_t cattr;
+    int result = 0;
+
+    if (slots < 1 || size <= header_size(slots) + slots) {
+        return NULL;
+    }
+
+    table = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if (table == MAP_FAILED) {
+        return NULL;
+    }
+
+    table->size = size;
+    table->nslots = slots;
+    table->capacity = (size - header_size(slots)) / slots;
+    table->timeout = timeout;
+
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr,PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mattr,PTHREAD_MUTEX_ROBUST);
+    result |= pthread_mutex_init(&table->lock,&mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr,PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cattr,CLOCK_MONOTONIC);
+    result |= pthread_cond_init(&table->done,&cattr);
+    pthread_condattr_destroy(&cattr);
+
+    if (result != 0) {
+        munmap(table,size);
+        return NULL;
+    }
+
+    return table;
+}
+
+void coalesce_destroy(struct coalesce_table* table)
+{
+    munmap(table,table->size);
+}
+
+void coalesce_key(unsigned char* key,const struct pygments_context* ctx,const char* code,
+    size_t code_len,const struct lexer_options* opts)
+{
+    PHP_MD5_CTX md5;
+    const char* strings[] = {
+        opts->preferred_lexer,
+        opts->filename
+    };
+    size_t i;
+
+    PHP_MD5Init(&md5);
+    PHP_MD5Update(&md5,code,code_len);
+
+    /* Each string is prefixed with a flag so that NULL and empty strings are
+     * distinguished.
+     */
+    for (i = 0;i < sizeof(strings) / sizeof(strings[0]);++i) {
+        if (strings[i] != NULL) {
+            PHP_MD5Update(&md5,"\0\1",2);
+            PHP_MD5Update(&md5,strings[i],strlen(strings[i]));
+        }
+        else {
+            PHP_MD5Update(&md5,"\0\0",2);
+        }
+    }
+
+    PHP_MD5Update(&md5,ctx->options_digest,16);
+    PHP_MD5Final(key,&md5);
+}
+
+/* Waits for the result of the call in the slot. The lock must be held. Returns
+ * non-zero if the result was published. The wait is cut short if the process
+ * computing the result exits.
+ */
+static int wait_result(struct coalesce_table* table,struct coalesce_slot* slot,
+    unsigned long generation)
+{
+    double deadline;
+
+    deadline = monotonic_time() + table->timeout;
+
+    while (slot->state == SLOT_RUNNING && slot->generation == generation) {
+        int result;
+        double now;
+        double until;
+        struct timespec ts;
+
+        now = monotonic_time();
+        if (now >= deadline || (kill(slot->owner,0) == -1 && errno == ESRCH)) {
+            break;
+        }
+
+        until = (deadline - now > COALESCE_POLL_INTERVAL) ? now + COALESCE_POLL_INTERVAL : deadline;
+        ts.tv_sec = (time_t)until;
+        ts.tv_nsec = (long)((until - (double)ts.tv_sec) * 1e9);
+
+        result = pthread_cond_timedwait(&table->done,&table->lock,&ts);
+        if (result == EOWNERDEAD) {
+            pthread_mutex_consistent(&table->lock);
+        }
+    }
+
+    return slot->generation == generation && slot->state == SLOT_DONE;
+}
+
+enum coalesce_result coalesce_begin(struct coalesce_table* table,const unsigned char* key,
+    struct coalesce_ticket* ticket,zend_string** html,int* truncated)
+{
+    long i;
+    long available = -1;
+    size_t length;
+    unsigned long generation;
+    struct coalesce_slot* slot = NULL;
+    double now = monotonic_time();
+
+    table_lock(table);
+    table->stats.calls += 1;
+
+    for (i = 0;i < table->nslots;++i) {
+        struct coalesce_slot* cur = table->slots + i;
+
+        if (slot_available(table,cur,now)) {
+            if (available == -1) {
+                available = i;
+            }
+            continue;
+        }
+
+        if (cur->state == SLOT_RUNNING && memcmp(cur->key,key,16) == 0) {
+            slot = cur;
+            break;
+        }
+    }
+
+    /* Claim a slot and compute the result if no identical call is in
+     * progress.
+     */
+    if (slot == NULL) {
+        if (available == -1) {
+            table->stats.bypassed += 1;
+            table_unlock(table);
+            return COALESCE_BYPASS;
+        }
+
+        slot = table->slots + available;
+        slot->state = SLOT_RUNNING;
+        memcpy(slot->key,key,16);
+        slot->generation += 1;
+        slot->owner = getpid();
+        slot->started = now;
+        slot->waiters = 0;
+        table->stats.computed += 1;
+
+        ticket->slot = available;
+        ticket->generation = slot->generation;
+
+        table_unlock(table);
+        return COALESCE_OWNER;
+    }
+
+    /* Otherwise wait for the result. */
+    generation = slot->generation;
+    slot->waiters += 1;
+    if (!wait_result(table,slot,generation)) {
+        if (slot->generation == generation) {
+            slot->waiters -= 1;
+        }
+        if (slot->generation != generation || slot->state == SLOT_RUNNING) {
+            table->stats.timeouts += 1;
+        }
+        table_unlock(table);
+        return COALESCE_BYPASS;
+    }
+    length = slot->length;
+    table_unlock(table);
+
+    /* The string is allocated outside of the lock since allocation failure
+     * does not return. The result is copied under the lock since a slot whose
+     * waiters have not collected it within the timeout can be reclaimed (in
+     * case a waiting process exited), so the slot must be checked again.
+     */
+    *html = zend_string_alloc(length,0);
+
+    table_lock(table);
+    if (slot->generation != generation || slot->state != SLOT_DONE) {
+        table->stats.timeouts += 1;
+        table_unlock(table);
+        zend_string_release(*html);
+        *html = NULL;
+        return COALESCE_BYPASS;
+    }
+
+    memcpy(ZSTR_VAL(*html),slot_data(table,slot - table->slots),length);
+    ZSTR_VAL(*html)[length] = 0;
+    *truncated = slot->truncated;
+
+    slot->waiters -= 1;
+    if (slot->waiters == 0) {
+        slot->state = SLOT_FREE;
+    }
+    table->stats.coalesced += 1;
+    table->stats.saved_time += slot->time;
+    table_unlock(table);
+
+    return COALESCE_HIT;
+}
+
+void coalesce_finish(struct coalesce_table* table,const struct coalesce_ticket* ticket,
+    const char* html,size_t len,int truncated)
+{
+    struct coalesce_slot* slot = table->slots + ticket->slot;
+    int fits = (html != NULL && len <= table->capacity);
+
+    table_lock(table);
+    if (slot->state == SLOT_RUNNING && slot->generation == ticket->generation) {
+        double now = monotonic_time();
+
+        if (fits) {
+            memcpy(slot_data(table,ticket->slot),html,len);
+            slot->state = SLOT_DONE;
+            slot->length = len;
+            slot->truncated = truncated;
+            slot->time = now - slot->started;
+        }
+        else {
+            slot->state = SLOT_FAILED;
+            if (html != NULL) {
+                table->stats.bypassed += slot->waiters;
+            }
+        }
+        slot->published = now;
+
+        if (slot->waiters == 0) {
+            slot->state = SLOT_FREE;
+        }
+
+        pthread_cond_broadcast(&table->done);
+    }
+    table_unlock(table);
+}
+
+void coalesce_stats(struct coalesce_table* table,struct coalesce_stats* dst,long* in_flight)
+{
+    long i;
+    double now = monotonic_time();
+
+    table_lock(table);
+    *dst = table->stats;
+    *in_flight = 0;
+    for (i = 0;i < table->nslots;++i) {
+        if (table->slots[i].state == SLOT_RUNNING
+            && !slot_available(table,table->slots + i,now))
+        {
+            *in_flight += 1;
+        }
+    }
+    table_unlock(table);
+}
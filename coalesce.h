@@ -0,0 +1,115 @@
+/*
+ * coalesce.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include "highlight.h"
+
+/*
+ * coalesce_stats
+ *
+ * Counts the calls made through a coalescing table. The counts are shared by
+ * every process that uses the table.
+ */
+
+struct coalesce_stats
+{
+    /* The total number of calls. */
+    long calls;
+
+    /* The number of calls that computed their own result and published it. */
+    long computed;
+
+    /* The number of calls that received the result of an identical call that
+     * was in progress.
+     */
+    long coalesced;
+
+    /* The number of calls that gave up waiting for an identical call. */
+    long timeouts;
+
+    /* The number of calls that were not coalesced because the table was full
+     * or the result was too large to share.
+     */
+    long bypassed;
+
+    /* The total time (in seconds) that coalesced calls would have spent
+     * computing their results.
+     */
+    double saved_time;
+};
+
+/*
+ * coalesce_table
+ *
+ * A table of in-flight highlight calls in memory that is shared with processes
+ * forked after its creation. It has a fixed number of slots, each of which can
+ * hold a result up to a fixed size.
+ */
+
+struct coalesce_table;
+
+/*
+ * coalesce_ticket
+ *
+ * Identifies the slot claimed by the call that computes a result.
+ */
+
+struct coalesce_ticket
+{
+    long slot;
+    unsigned long generation;
+};
+
+enum coalesce_result
+{
+    /* The caller must compute the result and publish it with
+     * coalesce_finish().
+     */
+    COALESCE_OWNER,
+
+    /* The result of an identical call was copied to the caller. */
+    COALESCE_HIT,
+
+    /* The caller must compute the result and not publish it. */
+    COALESCE_BYPASS
+};
+
+/* Creates a table of 'slots' entries in 'size' bytes of shared memory. Waiting
+ * calls give up after 'timeout' seconds, after which a slot whose call has not
+ * finished may also be reused. Returns NULL on failure.
+ */
+struct coalesce_table* coalesce_create(size_t size,long slots,double timeout);
+
+/* Unmaps the table. */
+void coalesce_destroy(struct coalesce_table* table);
+
+/* Computes the key that identifies a highlight call. */
+void coalesce_key(unsigned char* key,const struct pygments_context* ctx,const char* code,
+    size_t code_len,const struct lexer_options* opts);
+
+/*
+ * Begins a call with the specified key. If an identical call is in progress in
+ * any process, then this waits for its result. On COALESCE_HIT, the result is
+ * stored in 'html' and 'truncated'. On COALESCE_OWNER, 'ticket' is set to
+ * identify the slot that must be passed to coalesce_finish().
+ */
+enum coalesce_result coalesce_begin(struct coalesce_table* table,const unsigned char* key,
+    struct coalesce_ticket* ticket,zend_string** html,int* truncated);
+
+/* Publishes the result of a call. If 'html' is NULL, then the call failed and
+ * waiting calls compute their own results.
+ */
+void coalesce_finish(struct coalesce_table* table,const struct coalesce_ticket* ticket,
+    const char* html,size_t len,int truncated);
+
+/* Gets a copy of the table's statistics and the number of calls in progress. */
+void coalesce_stats(struct coalesce_table* table,struct coalesce_stats* dst,long* in_flight);
+
+#endif
@@ -0,0 +1,327 @@
+/*
+ * compact.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "compact.h"
+
+/* Style attributes that have a visible effect on whitespace. */
+static const char* WHITESPACE_ATTRIBUTES[] = {
+    "bgcolor",
+    "bgansicolor",
+    "underline",
+    "border",
+    NULL
+};
+
+/* Gets the style definition for the token type. Token types that are not known
+ * to the style inherit the definition of their nearest known parent.
+ */
+static PyObject* token_style(PyObject* style,PyObject* ttype)
+{
+    PyObject* result;
+
+    Py_INCREF(ttype);
+    while (1) {
+        PyObject* parent;
+
+        result = PyObject_CallMethod(style,"style_for_token","(O)",ttype);
+        if (result != NULL || !PyErr_ExceptionMatches(PyExc_KeyError)) {
+            break;
+        }
+        PyErr_Clear();
+
+        parent = PyObject_GetAttrString(ttype,"parent");
+        Py_DECREF(ttype);
+        if (parent == NULL) {
+            return NULL;
+        }
+
+        if (parent == Py_None) {
+            Py_DECREF(parent);
+            PyErr_SetString(PyExc_KeyError,"token type not in style");
+            return NULL;
+        }
+
+        ttype = parent;
+    }
+
+    Py_DECREF(ttype);
+    return result;
+}
+
+/* Determines if two style definitions render whitespace identically. */
+static int whitespace_equal(PyObject* a,PyObject* b)
+{
+    int i;
+
+    for (i = 0;WHITESPACE_ATTRIBUTES[i] != NULL;++i) {
+        int result;
+        PyObject* x = PyDict_GetItemString(a,WHITESPACE_ATTRIBUTES[i]);
+        PyObject* y = PyDict_GetItemString(b,WHITESPACE_ATTRIBUTES[i]);
+
+        if (x == NULL || y == NULL) {
+            if (x != y) {
+                return 0;
+            }
+            continue;
+        }
+
+        result = PyObject_RichCompareBool(x,y,Py_EQ);
+        if (result != 1) {
+            return result;
+        }
+    }
+
+    return 1;
+}
+
+/* Computes the compacted token types for a token type. The result is a tuple
+ * of the type to use in general and the type to use for whitespace.
+ */
+static PyObject* compact_type(PyObject* style,PyObject* ttype,PyObject* text_type,
+    PyObject* standard_types,PyObject* text_style)
+{
+    int result;
+    PyObject* ttype_style;
+    PyObject* rep;
+    PyObject* ws;
+    PyObject* cur;
+
+    ttype_style = token_style(style,ttype);
+    if (ttype_style == NULL) {
+        return NULL;
+    }
+
+    /* Tokens that render like plain text are not wrapped by the formatter. */
+    result = PyObject_RichCompareBool(ttype_style,text_style,Py_EQ);
+    if (result == -1) {
+        Py_DECREF(ttype_style);
+        return NULL;
+    }
+    if (result == 1) {
+        Py_DECREF(ttype_style);
+        return PyTuple_Pack(2,text_type,text_type);
+    }
+
+    /* Otherwise find the most general standard type with the same style. */
+    rep = ttype;
+    Py_INCREF(rep);
+    cur = PyObject_GetAttrString(ttype,"parent");
+    while (cur != NULL && cur != Py_None) {
+        PyObject* next;
+        PyObject* cur_style = token_style(style,cur);
+
+        if (cur_style == NULL) {
+            Py_DECREF(cur);
+            Py_DECREF(rep);
+            Py_DECREF(ttype_style);
+            return NULL;
+        }
+
+        result = PyObject_RichCompareBool(cur_style,ttype_style,Py_EQ);
+        Py_DECREF(cur_style);
+        if (result != 1) {
+            break;
+        }
+
+        if (PyDict_Contains(standard_types,cur) == 1) {
+            Py_INCREF(cur);
+            Py_DECREF(rep);
+            rep = cur;
+        }
+
+        next = PyObject_GetAttrString(cur,"parent");
+        Py_DECREF(cur);
+        cur = next;
+    }
+
+    if (cur == NULL) {
+        Py_DECREF(rep);
+        Py_DECREF(ttype_style);
+        return NULL;
+    }
+    Py_DECREF(cur);
+
+    result = whitespace_equal(ttype_style,text_style);
+    Py_DECREF(ttype_style);
+    if (result == -1) {
+        Py_DECREF(rep);
+        return NULL;
+    }
+
+    ws = PyTuple_Pack(2,rep,(result == 1) ? text_type : rep);
+    Py_DECREF(rep);
+
+    return ws;
+}
+
+static int is_whitespace(PyObject* value)
+{
+    Py_ssize_t i;
+    Py_ssize_t len = PyUnicode_GET_LENGTH(value);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    for (i = 0;i < len;++i) {
+        if (!Py_UNICODE_ISSPACE(PyUnicode_READ_CHAR(value,i))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Maps a single token. The bound 'self' is a tuple of (cache, style, Text,
+ * STANDARD_TYPES, Text style).
+ */
+static PyObject* compact_token(PyObject* self,PyObject* token)
+{
+    PyObject* cache = PyTuple_GET_ITEM(self,0);
+    PyObject* ttype;
+    PyObject* value;
+    PyObject* entry;
+    PyObject* target;
+
+    if (!PyTuple_Check(token) || PyTuple_GET_SIZE(token) != 2) {
+        Py_INCREF(token);
+        return token;
+    }
+
+    ttype = PyTuple_GET_ITEM(token,0);
+    value = PyTuple_GET_ITEM(token,1);
+
+    entry = PyDict_GetItemWithError(cache,ttype);
+    if (entry == NULL) {
+        if (PyErr_Occurred()) {
+            return NULL;
+        }
+
+        entry = compact_type(PyTuple_GET_ITEM(self,1),ttype,PyTuple_GET_ITEM(self,2),
+            PyTuple_GET_ITEM(self,3),PyTuple_GET_ITEM(self,4));
+        if (entry == NULL) {
+            /* Leave tokens we cannot reason about alone. */
+            PyErr_Clear();
+            Py_INCREF(token);
+            return token;
+        }
+
+        if (PyDict_SetItem(cache,ttype,entry) == -1) {
+            Py_DECREF(entry);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+
+    if (PyUnicode_Check(value) && is_whitespace(value)) {
+        target = PyTuple_GET_ITEM(entry,1);
+    }
+    else {
+        target = PyTuple_GET_ITEM(entry,0);
+    }
+
+    if (target == ttype) {
+        Py_INCREF(token);
+        return token;
+    }
+
+    return PyTuple_Pack(2,target,value);
+}
+
+static PyMethodDef compact_token_def = {
+    "compact_token",
+    compact_token,
+    METH_O,
+    NULL
+};
+
+PyObject* compact_token_stream(const struct pygments_context* ctx,PyObject* formatter,
+    PyObject* stream)
+{
+    PyObject* style;
+    PyObject* text_style;
+    PyObject* cache;
+    PyObject* state;
+    PyObject* func;
+    PyObject* result;
+
+    if (ctx->compact_types == NULL || ctx->token_Text == NULL || ctx->standard_types == NULL) {
+        Py_INCREF(stream);
+        return stream;
+    }
+
+    style = PyObject_GetAttrString(formatter,"style");
+    if (style == NULL) {
+        return NULL;
+    }
+
+    /* The compacted types depend on the style, so each style gets its own
+     * cache.
+     */
+    cache = PyDict_GetItemWithError(ctx->compact_types,style);
+    if (cache == NULL) {
+        if (PyErr_Occurred()) {
+            Py_DECREF(style);
+            return NULL;
+        }
+
+        cache = PyDict_New();
+        if (cache == NULL || PyDict_SetItem(ctx->compact_types,style,cache) == -1) {
+            Py_XDECREF(cache);
+            Py_DECREF(style);
+            return NULL;
+        }
+        Py_DECREF(cache);
+    }
+
+    text_style = token_style(style,ctx->token_Text);
+    if (text_style == NULL) {
+        Py_DECREF(style);
+        return NULL;
+    }
+
+    state = PyTuple_Pack(5,cache,style,ctx->token_Text,ctx->standard_types,text_style);
+    Py_DECREF(style);
+    Py_DECREF(text_style);
+    if (state == NULL) {
+        return NULL;
+    }
+
+    func = PyCFunction_New(&compact_token_def,state);
+    Py_DECREF(state);
+    if (func == NULL) {
+        return NULL;
+    }
+
+    result = PyObject_CallFunctionObjArgs((PyObject*)&PyMap_Type,func,stream,NULL);
+    Py_DECREF(func);
+
+    return result;
+}
+
+PyObject* compact_html(PyObject* html)
+{
+    PyObject* empty_span;
+    PyObject* empty;
+    PyObject* result;
+
+    /* The formatter emits an empty span at the start of each <pre> element. */
+    empty_span = PyUnicode_FromString("<span></span>");
+    empty = PyUnicode_FromString("");
+    if (empty_span == NULL || empty == NULL) {
+        Py_XDECREF(empty_span);
+        Py_XDECREF(empty);
+        return NULL;
+    }
+
+    result = PyUnicode_Replace(html,empty_span,empty,-1);
+    Py_DECREF(empty_span);
+    Py_DECREF(empty);
+
+    return result;
+}
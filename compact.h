@@ -0,0 +1,32 @@
+/*
+ * compact.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "highlight.h"
+
+/*
+ * Compact output reduces the size of the HTML produced by the formatter
+ * without changing how it renders. Each token type is replaced by the most
+ * general standard token type that the formatter's style renders identically,
+ * so that adjacent tokens share a single span and tokens rendered like plain
+ * text are not wrapped at all. Whitespace is left unwrapped whenever its style
+ * does not have a visible effect on whitespace.
+ */
+
+/* Wraps a (tokentype, value) token stream so that it yields compacted tokens
+ * for the specified formatter.
+ */
+PyObject* compact_token_stream(const struct pygments_context* ctx,PyObject* formatter,
+    PyObject* stream);
+
+/* Removes redundant markup from HTML produced by the formatter. */
+PyObject* compact_html(PyObject* html);
+
+#endif
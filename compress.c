@@ -0,0 +1,253 @@
+/*
+ * compress.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "compress.h"
+#include <string.h>
+#include <stdlib.h>
+
+#define COMPRESS_CHUNK 16384
+
+/* The formatter emits an empty span at the start of each <pre> element. It is
+ * always written as part of a single piece.
+ */
+#define EMPTY_SPAN "<span></span>"
+
+int compress_encoding_parse(enum compress_encoding* dst,const char* name)
+{
+    if (strcmp(name,"gzip") == 0) {
+        *dst = COMPRESS_GZIP;
+    }
+    else if (strcmp(name,"deflate") == 0) {
+        *dst = COMPRESS_DEFLATE;
+    }
+    else if (strcmp(name,"raw") == 0) {
+        *dst = COMPRESS_RAW;
+    }
+    else {
+        return -1;
+    }
+
+    return 0;
+}
+
+int compress_stream_init(struct compress_stream* stream,enum compress_encoding encoding)
+{
+    int bits;
+
+    memset(stream,0,sizeof(struct compress_stream));
+    stream->encoding = encoding;
+    stream->crc = crc32(0L,Z_NULL,0);
+
+    switch (encoding) {
+    case COMPRESS_GZIP:
+        bits = MAX_WBITS + 16;
+        break;
+    case COMPRESS_DEFLATE:
+        bits = MAX_WBITS;
+        break;
+    default:
+        bits = -MAX_WBITS;
+        break;
+    }
+
+    if (deflateInit2(&stream->zs,Z_DEFAULT_COMPRESSION,Z_DEFLATED,bits,8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Runs the compressor until it has consumed all input and, if flushing, has
+ * produced all pending output.
+ */
+static int compress_stream_run(struct compress_stream* stream,int flush)
+{
+    int result;
+
+    do {
+        if (stream->capacity - stream->size < COMPRESS_CHUNK) {
+            size_t capacity = stream->capacity * 2 + COMPRESS_CHUNK;
+            unsigned char* data = realloc(stream->data,capacity);
+
+            if (data == NULL) {
+                return -1;
+            }
+
+            stream->data = data;
+            stream->capacity = capacity;
+        }
+
+        stream->zs.next_out = stream->data + stream->size;
+        stream->zs.avail_out = (uInt)(stream->capacity - stream->size);
+
+        result = deflate(&stream->zs,flush);
+        stream->size = stream->capacity - stream->zs.avail_out;
+        if (result == Z_STREAM_ERROR) {
+            return -1;
+        }
+    } while (stream->zs.avail_in > 0 || stream->zs.avail_out == 0);
+
+    if (flush == Z_FINISH && result != Z_STREAM_END) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compress_stream_feed(struct compress_stream* stream,const char* data,size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    stream->crc = crc32(stream->crc,(const Bytef*)data,(uInt)size);
+    stream->length += size;
+
+    stream->zs.next_in = (Bytef*)data;
+    stream->zs.avail_in = (uInt)size;
+
+    return compress_stream_run(stream,Z_NO_FLUSH);
+}
+
+int compress_stream_write(struct compress_stream* stream,const char* data,size_t size)
+{
+    const char* end = data + size;
+    size_t n = sizeof(EMPTY_SPAN) - 1;
+
+    if (!stream->compact) {
+        return compress_stream_feed(stream,data,size);
+    }
+
+    while (data < end) {
+        const char* p = data;
+
+        while (p + n <= end && memcmp(p,EMPTY_SPAN,n) != 0) {
+            p += 1;
+        }
+
+        if (p + n > end) {
+            return compress_stream_feed(stream,data,end - data);
+        }
+
+        if (compress_stream_feed(stream,data,p - data) == -1) {
+            return -1;
+        }
+
+        data = p + n;
+    }
+
+    return 0;
+}
+
+int compress_stream_finish(struct compress_stream* stream)
+{
+    stream->zs.next_in = Z_NULL;
+    stream->zs.avail_in = 0;
+
+    /* Raw output is only flushed to a byte boundary so that the caller can
+     * append it to another stream.
+     */
+    if (stream->encoding == COMPRESS_RAW) {
+        return compress_stream_run(stream,Z_SYNC_FLUSH);
+    }
+
+    return compress_stream_run(stream,Z_FINISH);
+}
+
+void compress_stream_free(struct compress_stream* stream)
+{
+    deflateEnd(&stream->zs);
+    free(stream->data);
+    stream->data = NULL;
+    stream->size = 0;
+    stream->capacity = 0;
+}
+
+/* Writer object */
+
+typedef struct
+{
+    PyObject_HEAD
+    struct compress_stream* stream;
+} WriterObject;
+
+static PyObject* writer_write(WriterObject* self,PyObject* arg)
+{
+    const char* data;
+    Py_ssize_t size;
+
+    if (PyUnicode_Check(arg)) {
+        data = PyUnicode_AsUTF8AndSize(arg,&size);
+        if (data == NULL) {
+            return NULL;
+        }
+    }
+    else if (PyBytes_Check(arg)) {
+        data = PyBytes_AS_STRING(arg);
+        size = PyBytes_GET_SIZE(arg);
+    }
+    else {
+        PyErr_SetString(PyExc_TypeError,"write() argument must be str or bytes");
+        return NULL;
+    }
+
+    if (compress_stream_write(self->stream,data,(size_t)size) == -1) {
+        PyErr_SetString(PyExc_RuntimeError,"failed to compress output");
+        return NULL;
+    }
+
+    return PyLong_FromSsize_t(size);
+}
+
+static PyObject* writer_flush(WriterObject* self,PyObject* args)
+{
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef writer_methods[] = {
+    { "write", (PyCFunction)writer_write, METH_O, NULL },
+    { "flush", (PyCFunction)writer_flush, METH_NOARGS, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject WriterType = {
+    PyVarObject_HEAD_INIT(NULL,0)
+    .tp_name = "pygments_ext.CompressWriter",
+    .tp_basicsize = sizeof(WriterObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_methods = writer_methods
+};
+
+int compress_writer_ready(void)
+{
+    if (!(WriterType.tp_flags & Py_TPFLAGS_READY) && PyType_Ready(&WriterType) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+PyObject* compress_writer_new(struct compress_stream* stream)
+{
+    WriterObject* writer;
+
+    if (compress_writer_ready() == -1) {
+        return NULL;
+    }
+
+    writer = PyObject_New(WriterObject,&WriterType);
+    if (writer == NULL) {
+        return NULL;
+    }
+
+    writer->stream = stream;
+
+    return (PyObject*)writer;
+}
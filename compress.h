@@ -0,0 +1,91 @@
+/*
+ * compress.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <Python.h>
+#include <zlib.h>
+
+/*
+ * compress_encoding
+ *
+ * The supported compressed output formats.
+ */
+
+enum compress_encoding
+{
+    /* A complete gzip stream (RFC 1952). */
+    COMPRESS_GZIP,
+
+    /* A complete zlib stream (RFC 1950), as used by the HTTP 'deflate' content
+     * encoding.
+     */
+    COMPRESS_DEFLATE,
+
+    /* Raw deflate data (RFC 1951) that ends on a byte boundary without a final
+     * block. This can be spliced into a larger deflate or gzip stream using the
+     * CRC-32 and length of the uncompressed data.
+     */
+    COMPRESS_RAW
+};
+
+/*
+ * compress_stream
+ *
+ * Compresses output incrementally as it is written.
+ */
+
+struct compress_stream
+{
+    enum compress_encoding encoding;
+    z_stream zs;
+
+    /* The compressed output. */
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+
+    /* The CRC-32 and length of the uncompressed data. */
+    unsigned long crc;
+    size_t length;
+
+    /* If non-zero, then the empty spans removed by compact output are removed
+     * from each piece of output as it is written.
+     */
+    int compact;
+};
+
+/* Parses an encoding name ("gzip", "deflate" or "raw"). */
+int compress_encoding_parse(enum compress_encoding* dst,const char* name);
+
+/* Initializes the stream for the specified encoding. */
+int compress_stream_init(struct compress_stream* stream,enum compress_encoding encoding);
+
+/* Compresses the specified data. */
+int compress_stream_write(struct compress_stream* stream,const char* data,size_t size);
+
+/* Flushes all remaining output. After this, 'data' contains the complete
+ * compressed output.
+ */
+int compress_stream_finish(struct compress_stream* stream);
+
+/* Frees the stream's members. */
+void compress_stream_free(struct compress_stream* stream);
+
+/* Creates a Python file-like object whose write() method compresses into the
+ * stream. The stream must outlive the returned object.
+ */
+PyObject* compress_writer_new(struct compress_stream* stream);
+
+/* Prepares the writer type. This is called when a context is created so that
+ * the type is ready before any thread creates a writer.
+ */
+int compress_writer_ready(void);
+
+#endif
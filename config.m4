@@ -1,13 +1,46 @@
 PHP_ARG_ENABLE(pygments,[Whether to enable the "pygments" extension],
     [  --enable-pygments      Enable "pygments" extension support])
 
+PHP_ARG_WITH(pygments-python,[pkg-config package of the Python to embed],
+    [  --with-pygments-python=PKG
+                          pkg-config package of the Python to embed
+                          (e.g. python-3.13t-embed for a free-threaded
+                          build) [python3-embed]],[python3-embed],[no])
+
 if test $PHP_PYGMENTS != "no"; then
-    CFLAGS="$CFLAGS "`pkg-config --cflags --libs-only-L python3-embed`
-    MODVERSION="`pkg-config --modversion python3-embed`"
+    if test "$PHP_PYGMENTS_PYTHON" = "yes" || test "$PHP_PYGMENTS_PYTHON" = "no"; then
+        PHP_PYGMENTS_PYTHON=python3-embed
+    fi
+
+    CFLAGS="$CFLAGS "`pkg-config --cflags --libs-only-L $PHP_PYGMENTS_PYTHON`
+
+    # Take the library name from the package since free-threaded builds name
+    # it with an ABI suffix (e.g. libpython3.13t).
+    PYTHON_LIB="`pkg-config --libs-only-l $PHP_PYGMENTS_PYTHON | sed -e 's/^ *-l//' -e 's/ .*$//'`"
+    if test "$PYTHON_LIB" = ""; then
+        PYTHON_LIB="python`pkg-config --modversion $PHP_PYGMENTS_PYTHON`"
+    fi
 
-    AC_SEARCH_LIBS([Py_Initialize],[python$MODVERSION],[],[AC_MSG_ERROR([Aborting since libpython$MODVERSION not found],[1])])
+    AC_SEARCH_LIBS([Py_Initialize],[$PYTHON_LIB],[],[AC_MSG_ERROR([Aborting since lib$PYTHON_LIB not found],[1])])
     AC_CHECK_HEADERS([Python.h],[],[AC_MSG_ERROR([Aborting since Python.h not found],[1])])
 
+    AC_MSG_CHECKING([whether the embedded Python is free-threaded])
+    AC_COMPILE_IFELSE([AC_LANG_PROGRAM([[#include <Python.h>]],[[
+#ifndef Py_GIL_DISABLED
+#error GIL enabled
+#endif
+    ]])],[PYGMENTS_FREE_THREADED=yes],[PYGMENTS_FREE_THREADED=no])
+    AC_MSG_RESULT([$PYGMENTS_FREE_THREADED])
+
+    if test "$PYGMENTS_FREE_THREADED" = "yes" && test "$PHP_THREAD_SAFETY" != "yes"; then
+        AC_MSG_WARN([A free-threaded Python only benefits thread-safe (ZTS) builds of PHP])
+    fi
+
+    AC_SEARCH_LIBS([deflate],[z],[],[AC_MSG_ERROR([Aborting since libz not found],[1])])
+    AC_CHECK_HEADERS([zlib.h],[],[AC_MSG_ERROR([Aborting since zlib.h not found],[1])])
+
+    AC_SEARCH_LIBS([pthread_mutexattr_setrobust],[pthread],[],[AC_MSG_ERROR([Aborting since robust pthread mutexes are not supported],[1])])
+
     # Add PHP_RPATHS to extension build via EXTRA_LDFLAGS.
     if test $PHP_RPATHS != ""; then
         PHP_UTILIZE_RPATHS()
@@ -15,7 +48,10 @@ if test $PHP_PYGMENTS != "no"; then
         PHP_SUBST([EXTRA_LDFLAGS])
     fi
 
-    PHP_ADD_LIBRARY(python$MODVERSION,1,PYGMENTS_SHARED_LIBADD)
+    PHP_ADD_LIBRARY($PYTHON_LIB,1,PYGMENTS_SHARED_LIBADD)
+    PHP_ADD_LIBRARY(z,1,PYGMENTS_SHARED_LIBADD)
     PHP_SUBST(PYGMENTS_SHARED_LIBADD)
-    PHP_NEW_EXTENSION(pygments,pygments.c highlight.c,$ext_shared)
+    PHP_NEW_EXTENSION(pygments,pygments.c highlight.c snapshot.c lexer.c parallel.c compact.c compress.c preview.c profile.c engine.c render.c document.c coalesce.c cache.c,$ext_shared)
+    PHP_ADD_EXTENSION_DEP(pygments,pcre)
+    PHP_ADD_MAKEFILE_FRAGMENT
 fi
@@ -0,0 +1,657 @@
+/*
+ * document.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "document.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* The maximum length of a language name. Longer names are not recognized. */
+#define DOCUMENT_MAX_LANGUAGE 64
+
+/*
+ * code_block
+ *
+ * A code block found in a document. The block replaces the region [start,end)
+ * of the document.
+ */
+
+struct code_block
+{
+    size_t start;
+    size_t end;
+
+    /* The declared language. This is empty if none was declared. */
+    char language[DOCUMENT_MAX_LANGUAGE];
+
+    /* The code with any Markdown indentation or HTML escaping removed. */
+    char* code;
+    size_t code_len;
+};
+
+int document_format_parse(enum document_format* dst,const char* name)
+{
+    if (strcasecmp(name,"markdown") == 0 || strcasecmp(name,"md") == 0) {
+        *dst = DOCUMENT_MARKDOWN;
+        return 0;
+    }
+
+    if (strcasecmp(name,"html") == 0) {
+        *dst = DOCUMENT_HTML;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\f';
+}
+
+static void set_language(struct code_block* block,const char* name,size_t len)
+{
+    if (len >= DOCUMENT_MAX_LANGUAGE) {
+        len = 0;
+    }
+
+    memcpy(block->language,name,len);
+    block->language[len] = 0;
+}
+
+/* Appends highlighted output that replaces a Markdown code block. Markdown ends
+ * an HTML block at the first blank line, so each blank line (which can only
+ * occur inside the <pre> element) is given an empty element that does not
+ * change how it renders.
+ */
+static void append_markdown_html(smart_str* output,const char* html,size_t len)
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t i;
+        size_t end;
+        const char* nl = memchr(html + pos,'\n',len - pos);
+
+        end = (nl != NULL) ? (size_t)(nl - html) + 1 : len;
+        for (i = pos;i < end && is_space(html[i]);++i);
+        if (i == end) {
+            smart_str_appendl(output,"<span></span>",sizeof("<span></span>")-1);
+        }
+
+        smart_str_appendl(output,html + pos,end - pos);
+        pos = end;
+    }
+}
+
+/* Highlights a code block and appends the output. Returns -1 if the block could
+ * not be highlighted, in which case nothing is appended. Blocks that are cut
+ * short by the context's preview limits are counted in the stats.
+ */
+static int append_block(const struct pygments_context* ctx,const struct code_block* block,
+    enum document_format format,smart_str* output,struct document_stats* stats)
+{
+    size_t len;
+    struct lexer_options lxopts;
+    struct highlight_result* result;
+
+    /* The code is passed as a C string. */
+    if (memchr(block->code,0,block->code_len) != NULL) {
+        return -1;
+    }
+
+    lxopts.preferred_lexer = (block->language[0] != 0) ? block->language : NULL;
+    lxopts.filename = NULL;
+
+    result = highlight(ctx,block->code,&lxopts);
+    if (result == NULL) {
+        return -1;
+    }
+    if (result->truncated) {
+        stats->truncated += 1;
+    }
+
+    /* Leave off the final newline so that the text following the block is
+     * unchanged.
+     */
+    len = strlen(result->html);
+    if (len > 0 && result->html[len-1] == '\n') {
+        len -= 1;
+    }
+
+    if (format == DOCUMENT_MARKDOWN) {
+        append_markdown_html(output,result->html,len);
+    }
+    else {
+        smart_str_appendl(output,result->html,len);
+    }
+
+    highlight_result_free(result);
+    return 0;
+}
+
+/* Markdown */
+
+/* Determines if the line opens or closes a fenced code block. Returns the
+ * number of fence characters or 0 if the line is not a fence.
+ */
+static size_t parse_fence(const char* line,size_t len,size_t* indent,char* fence_char)
+{
+    size_t i = 0;
+    size_t n = 0;
+
+    while (i < len && line[i] == ' ') {
+        i += 1;
+    }
+    if (i > 3 || i == len || (line[i] != '`' && line[i] != '~')) {
+        return 0;
+    }
+
+    while (i + n < len && line[i+n] == line[i]) {
+        n += 1;
+    }
+    if (n < 3) {
+        return 0;
+    }
+
+    *indent = i;
+    *fence_char = line[i];
+
+    return n;
+}
+
+static size_t line_end(const char* doc,size_t len,size_t pos)
+{
+    const char* nl = memchr(doc + pos,'\n',len - pos);
+    return (nl != NULL) ? (size_t)(nl - doc) : len;
+}
+
+/* Parses a fenced code block starting at the line at 'pos'. Returns 0 if the
+ * line does not open a fenced code block.
+ */
+static int parse_markdown_block(struct code_block* block,const char* doc,size_t len,size_t pos)
+{
+    char fence_char;
+    size_t n;
+    size_t i;
+    size_t eol;
+    size_t indent;
+    size_t info;
+    size_t info_end;
+    size_t content;
+
+    eol = line_end(doc,len,pos);
+    n = parse_fence(doc + pos,eol - pos,&indent,&fence_char);
+    if (n == 0) {
+        return 0;
+    }
+
+    /* The language is the first word of the info string. A backtick fence
+     * cannot have backticks in its info string.
+     */
+    info = pos + indent + n;
+    if (fence_char == '`' && memchr(doc + info,'`',eol - info) != NULL) {
+        return 0;
+    }
+
+    while (info < eol && (is_space(doc[info]) || doc[info] == '{' || doc[info] == '.')) {
+        info += 1;
+    }
+    for (info_end = info;info_end < eol;++info_end) {
+        char c = doc[info_end];
+        if (is_space(c) || c == '{' || c == '}' || c == ',') {
+            break;
+        }
+    }
+    set_language(block,doc + info,info_end - info);
+
+    /* Find the closing fence. If there is none, then the block extends to the
+     * end of the document.
+     */
+    block->start = pos;
+    block->end = len;
+    content = (eol < len) ? eol + 1 : len;
+
+    block->code = malloc(len - content + 1);
+    if (block->code == NULL) {
+        return 0;
+    }
+    block->code_len = 0;
+
+    pos = content;
+    while (pos < len) {
+        size_t m;
+        size_t close_indent;
+        char close_char;
+
+        eol = line_end(doc,len,pos);
+        m = parse_fence(doc + pos,eol - pos,&close_indent,&close_char);
+        if (m >= n && close_char == fence_char) {
+            for (i = pos + close_indent + m;i < eol && is_space(doc[i]);++i);
+            if (i == eol) {
+                /* Keep a '\r' of a CRLF line ending with the text that
+                 * follows.
+                 */
+                block->end = (eol > pos && doc[eol-1] == '\r') ? eol - 1 : eol;
+                break;
+            }
+        }
+
+        /* Remove the indentation of the opening fence from each line. */
+        for (i = 0;i < indent && pos + i < eol && doc[pos+i] == ' ';++i);
+        pos += i;
+        if (eol < len) {
+            eol += 1;
+        }
+
+        memcpy(block->code + block->code_len,doc + pos,eol - pos);
+        block->code_len += eol - pos;
+        pos = eol;
+    }
+
+    block->code[block->code_len] = 0;
+    return 1;
+}
+
+static void highlight_markdown(const struct pygments_context* ctx,const char* doc,size_t len,
+    smart_str* output,struct document_stats* stats)
+{
+    size_t pos = 0;
+    size_t copied = 0;
+
+    while (pos < len) {
+        struct code_block block;
+
+        if (!parse_markdown_block(&block,doc,len,pos)) {
+            size_t eol = line_end(doc,len,pos);
+            pos = (eol < len) ? eol + 1 : len;
+            continue;
+        }
+
+        smart_str_appendl(output,doc + copied,block.start - copied);
+
+        stats->blocks += 1;
+        if (append_block(ctx,&block,DOCUMENT_MARKDOWN,output,stats) == 0) {
+            stats->highlighted += 1;
+        }
+        else {
+            smart_str_appendl(output,doc + block.start,block.end - block.start);
+        }
+        free(block.code);
+
+        copied = block.end;
+        pos = block.end;
+    }
+
+    smart_str_appendl(output,doc + copied,len - copied);
+}
+
+/* HTML */
+
+/* Determines if the tag at 'p' has the specified name. 'name' includes the
+ * opening '<' (and '/' for an end tag).
+ */
+static int match_tag(const char* p,const char* end,const char* name)
+{
+    size_t n = strlen(name);
+
+    return (size_t)(end - p) > n && strncasecmp(p,name,n) == 0
+        && (is_space(p[n]) || p[n] == '>' || p[n] == '/');
+}
+
+/* Parses the attributes of a start tag. 'p' points just past the tag name.
+ * Returns a pointer just past the closing '>' or NULL if the tag is not closed.
+ * The value of the class attribute, if any, is stored in 'cls'.
+ */
+static const char* parse_start_tag(const char* p,const char* end,const char** cls,
+    size_t* cls_len)
+{
+    *cls = NULL;
+    *cls_len = 0;
+
+    while (p < end) {
+        const char* name;
+        size_t name_len;
+        const char* value = NULL;
+        size_t value_len = 0;
+
+        if (is_space(*p) || *p == '/') {
+            p += 1;
+            continue;
+        }
+        if (*p == '>') {
+            return p + 1;
+        }
+
+        name = p;
+        while (p < end && !is_space(*p) && *p != '=' && *p != '>' && *p != '/') {
+            p += 1;
+        }
+        name_len = p - name;
+
+        while (p < end && is_space(*p)) {
+            p += 1;
+        }
+        if (p < end && *p == '=') {
+            p += 1;
+            while (p < end && is_space(*p)) {
+                p += 1;
+            }
+
+            if (p < end && (*p == '"' || *p == '\'')) {
+                const char* q = memchr(p + 1,*p,end - p - 1);
+                if (q == NULL) {
+                    return NULL;
+                }
+
+                value = p + 1;
+                value_len = q - value;
+                p = q + 1;
+            }
+            else {
+                value = p;
+                while (p < end && !is_space(*p) && *p != '>') {
+                    p += 1;
+                }
+                value_len = p - value;
+            }
+        }
+
+        if (name_len == 5 && strncasecmp(name,"class",5) == 0 && value != NULL) {
+            *cls = value;
+            *cls_len = value_len;
+        }
+    }
+
+    return NULL;
+}
+
+/* Finds the language in a class attribute value ("language-x" or "lang-x"). */
+static int class_language(struct code_block* block,const char* cls,size_t len)
+{
+    const char* end = cls + len;
+
+    while (cls < end) {
+        const char* word;
+
+        while (cls < end && is_space(*cls)) {
+            cls += 1;
+        }
+        word = cls;
+        while (cls < end && !is_space(*cls)) {
+            cls += 1;
+        }
+
+        if (cls - word > 9 && strncmp(word,"language-",9) == 0) {
+            set_language(block,word + 9,cls - word - 9);
+            return 1;
+        }
+        if (cls - word > 5 && strncmp(word,"lang-",5) == 0) {
+            set_language(block,word + 5,cls - word - 5);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static size_t encode_utf8(char* dst,unsigned long c)
+{
+    if (c < 0x80) {
+        dst[0] = (char)c;
+        return 1;
+    }
+    if (c < 0x800) {
+        dst[0] = (char)(0xc0 | (c >> 6));
+        dst[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    }
+    if (c < 0x10000) {
+        dst[0] = (char)(0xe0 | (c >> 12));
+        dst[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        dst[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+
+    dst[0] = (char)(0xf0 | (c >> 18));
+    dst[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+    dst[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+    dst[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+}
+
+/* Decodes the character reference at 'p' (just past the '&'). Returns the
+ * length of the reference (excluding the '&') or 0 if it is not recognized. The
+ * decoded text is never longer than the reference.
+ */
+static size_t decode_reference(const char* p,const char* end,char* dst,size_t* dst_len)
+{
+    static const struct {
+        const char* name;
+        const char* text;
+    } NAMED[] = {
+        {"lt;","<"},
+        {"gt;",">"},
+        {"amp;","&"},
+        {"quot;","\""},
+        {"apos;","'"},
+        {"nbsp;","\xc2\xa0"},
+        {NULL,NULL}
+    };
+    int i;
+
+    if (p < end && *p == '#') {
+        int base = 10;
+        const char* q = p + 1;
+        unsigned long c = 0;
+
+        if (q < end && (*q == 'x' || *q == 'X')) {
+            base = 16;
+            q += 1;
+        }
+
+        for (i = 0;q < end && i < 8;++q,++i) {
+            int digit;
+
+            if (*q >= '0' && *q <= '9') {
+                digit = *q - '0';
+            }
+            else if (base == 16 && *q >= 'a' && *q <= 'f') {
+                digit = *q - 'a' + 10;
+            }
+            else if (base == 16 && *q >= 'A' && *q <= 'F') {
+                digit = *q - 'A' + 10;
+            }
+            else {
+                break;
+            }
+
+            c = c * base + digit;
+        }
+
+        if (i == 0 || q == end || *q != ';' || c == 0 || c > 0x10ffff
+            || (c >= 0xd800 && c <= 0xdfff))
+        {
+            return 0;
+        }
+
+        *dst_len = encode_utf8(dst,c);
+        return q + 1 - p;
+    }
+
+    for (i = 0;NAMED[i].name != NULL;++i) {
+        size_t n = strlen(NAMED[i].name);
+
+        if ((size_t)(end - p) >= n && memcmp(p,NAMED[i].name,n) == 0) {
+            *dst_len = strlen(NAMED[i].text);
+            memcpy(dst,NAMED[i].text,*dst_len);
+            return n;
+        }
+    }
+
+    return 0;
+}
+
+/* Parses a <pre><code> element starting at 'pos'. Returns 0 if there is no such
+ * element or if its content is not plain text.
+ */
+static int parse_html_block(struct code_block* block,const char* doc,size_t len,size_t pos)
+{
+    const char* p = doc + pos;
+    const char* end = doc + len;
+    const char* pre_class;
+    const char* code_class;
+    const char* content;
+    const char* content_end;
+    size_t pre_class_len;
+    size_t code_class_len;
+
+    if (!match_tag(p,end,"<pre")) {
+        return 0;
+    }
+
+    p = parse_start_tag(p + 4,end,&pre_class,&pre_class_len);
+    if (p == NULL) {
+        return 0;
+    }
+    while (p < end && is_space(*p)) {
+        p += 1;
+    }
+
+    if (!match_tag(p,end,"<code")) {
+        return 0;
+    }
+
+    content = parse_start_tag(p + 5,end,&code_class,&code_class_len);
+    if (content == NULL) {
+        return 0;
+    }
+
+    /* Elements with markup in them (e.g. already highlighted code) are left
+     * alone.
+     */
+    content_end = memchr(content,'<',end - content);
+    if (content_end == NULL || !match_tag(content_end,end,"</code")) {
+        return 0;
+    }
+
+    p = memchr(content_end,'>',end - content_end);
+    if (p == NULL) {
+        return 0;
+    }
+    p += 1;
+    while (p < end && is_space(*p)) {
+        p += 1;
+    }
+
+    if (!match_tag(p,end,"</pre")) {
+        return 0;
+    }
+    p = memchr(p,'>',end - p);
+    if (p == NULL) {
+        return 0;
+    }
+
+    block->start = pos;
+    block->end = p + 1 - doc;
+
+    block->language[0] = 0;
+    if ((code_class == NULL || !class_language(block,code_class,code_class_len))
+        && pre_class != NULL)
+    {
+        class_language(block,pre_class,pre_class_len);
+    }
+
+    /* Unescape the content. */
+    block->code = malloc(content_end - content + 1);
+    if (block->code == NULL) {
+        return 0;
+    }
+    block->code_len = 0;
+
+    for (p = content;p < content_end;) {
+        const char* amp = memchr(p,'&',content_end - p);
+        size_t n;
+        size_t decoded;
+
+        if (amp == NULL) {
+            amp = content_end;
+        }
+
+        memcpy(block->code + block->code_len,p,amp - p);
+        block->code_len += amp - p;
+        if (amp == content_end) {
+            break;
+        }
+
+        n = decode_reference(amp + 1,content_end,block->code + block->code_len,&decoded);
+        if (n == 0) {
+            block->code[block->code_len++] = '&';
+            p = amp + 1;
+        }
+        else {
+            block->code_len += decoded;
+            p = amp + 1 + n;
+        }
+    }
+
+    block->code[block->code_len] = 0;
+    return 1;
+}
+
+static void highlight_html(const struct pygments_context* ctx,const char* doc,size_t len,
+    smart_str* output,struct document_stats* stats)
+{
+    size_t pos = 0;
+    size_t copied = 0;
+
+    while (pos < len) {
+        const char* lt;
+        struct code_block block;
+
+        lt = memchr(doc + pos,'<',len - pos);
+        if (lt == NULL) {
+            break;
+        }
+        pos = lt - doc;
+
+        if (!parse_html_block(&block,doc,len,pos)) {
+            pos += 1;
+            continue;
+        }
+
+        smart_str_appendl(output,doc + copied,block.start - copied);
+
+        stats->blocks += 1;
+        if (append_block(ctx,&block,DOCUMENT_HTML,output,stats) == 0) {
+            stats->highlighted += 1;
+        }
+        else {
+            smart_str_appendl(output,doc + block.start,block.end - block.start);
+        }
+        free(block.code);
+
+        copied = block.end;
+        pos = block.end;
+    }
+
+    smart_str_appendl(output,doc + copied,len - copied);
+}
+
+void highlight_document(const struct pygments_context* ctx,const char* doc,size_t len,
+    enum document_format format,smart_str* output,struct document_stats* stats)
+{
+    memset(stats,0,sizeof(struct document_stats));
+
+    if (format == DOCUMENT_MARKDOWN) {
+        highlight_markdown(ctx,doc,len,output,stats);
+    }
+    else {
+        highlight_html(ctx,doc,len,output,stats);
+    }
+}
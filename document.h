@@ -0,0 +1,65 @@
+/*
+ * document.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef DOCUMENT_H
+#define DOCUMENT_H
+
+#include "highlight.h"
+#include <Zend/zend_smart_str.h>
+
+enum document_format
+{
+    /* Fenced code blocks (``` or ~~~) whose info string names the language. */
+    DOCUMENT_MARKDOWN,
+
+    /* <pre><code> elements whose class names the language as "language-x" or
+     * "lang-x".
+     */
+    DOCUMENT_HTML
+};
+
+/*
+ * document_stats
+ *
+ * Counts the code blocks found in a document.
+ */
+
+struct document_stats
+{
+    /* The number of code blocks found. */
+    long blocks;
+
+    /* The number of code blocks that were highlighted. The others are copied
+     * unchanged.
+     */
+    long highlighted;
+
+    /* The number of highlighted code blocks that were cut short by the preview
+     * limits (max_lines and max_bytes), which apply to each block separately.
+     */
+    long truncated;
+};
+
+/* Parses the document format name ("markdown" or "html"). Returns -1 if the
+ * name is not recognized.
+ */
+int document_format_parse(enum document_format* dst,const char* name);
+
+/*
+ * Highlights the code blocks in a Markdown or HTML document. The document is
+ * scanned natively and each code block is highlighted with the lexer for its
+ * declared language (or a guessed lexer if none is declared). The document,
+ * with each code block replaced by the highlighted output, is appended to
+ * 'output'. Text outside of the code blocks is copied unchanged. A code block
+ * that cannot be highlighted (e.g. because the language is unknown) is also
+ * copied unchanged.
+ */
+void highlight_document(const struct pygments_context* ctx,const char* doc,size_t len,
+    enum document_format format,smart_str* output,struct document_stats* stats);
+
+#endif
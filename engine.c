@@ -0,0 +1,428 @@
+/*
+ * engine.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "engine.h"
+#include <string.h>
+#include <stdlib.h>
+
+/* Python re module flags */
+#define RE_IGNORECASE 2
+#define RE_MULTILINE 8
+#define RE_DOTALL 16
+#define RE_UNICODE 32
+#define RE_ASCII 256
+
+#define ENGINE_RULES_CAPSULE "pygments.engine_rules"
+
+struct engine_rules
+{
+    /* The rules list the codes were compiled from. */
+    PyObject* statetokens;
+
+    Py_ssize_t count;
+    pcre2_code* codes[1];
+};
+
+int regex_engine_init(struct regex_engine* engine)
+{
+    memset(engine,0,sizeof(struct regex_engine));
+
+    engine->cache = PyDict_New();
+    if (engine->cache == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    /* Use our own compile context so that the newline convention matches
+     * Python regardless of how PCRE2 was built.
+     */
+    engine->cctx = pcre2_compile_context_create(php_pcre_gctx());
+    engine->match_data = pcre2_match_data_create(1,php_pcre_gctx());
+    if (engine->cctx == NULL || engine->match_data == NULL) {
+        regex_engine_free(engine);
+        return -1;
+    }
+
+    pcre2_set_newline(engine->cctx,PCRE2_NEWLINE_LF);
+
+    return 0;
+}
+
+void regex_engine_free(struct regex_engine* engine)
+{
+    Py_CLEAR(engine->cache);
+
+    if (engine->cctx != NULL) {
+        pcre2_compile_context_free(engine->cctx);
+        engine->cctx = NULL;
+    }
+
+    if (engine->match_data != NULL) {
+        pcre2_match_data_free(engine->match_data);
+        engine->match_data = NULL;
+    }
+
+    engine->enabled = 0;
+}
+
+int regex_engine_eligible(const struct regex_engine* engine,PyObject* text)
+{
+    Py_ssize_t i;
+    Py_ssize_t len;
+    const unsigned char* data;
+
+    if (!engine->enabled || engine->cache == NULL || !PyUnicode_IS_ASCII(text)) {
+        return 0;
+    }
+
+    data = PyUnicode_DATA(text);
+    len = PyUnicode_GET_LENGTH(text);
+    for (i = 0;i < len;++i) {
+        if (data[i] >= 0x1c && data[i] <= 0x1f) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Translates a Python pattern into the PCRE2 dialect. Anything that is not
+ * known to behave the same in both is rejected. Returns the length of the
+ * translated pattern or -1 if it cannot be translated. The output buffer must
+ * be at least twice the length of the input.
+ */
+static Py_ssize_t translate_pattern(const char* src,Py_ssize_t len,char* dst)
+{
+    Py_ssize_t i = 0;
+    Py_ssize_t n = 0;
+    Py_ssize_t class_start = -1;
+
+    while (i < len) {
+        char c = src[i];
+
+        if (c == '\\') {
+            char e;
+
+            if (i + 1 >= len) {
+                return -1;
+            }
+
+            e = src[i+1];
+            if (e == 'Z' && class_start < 0) {
+                /* Python's \Z only matches at the very end. */
+                dst[n++] = '\\';
+                dst[n++] = 'z';
+            }
+            else if (e == 'v') {
+                /* Python's \v is a vertical tab, not a character class. */
+                memcpy(dst + n,"\\x0b",4);
+                n += 4;
+            }
+            else if (e >= '1' && e <= '9') {
+                /* Only allow unambiguous backreferences. */
+                if (class_start >= 0 || (i + 2 < len && src[i+2] >= '0' && src[i+2] <= '9')) {
+                    return -1;
+                }
+
+                dst[n++] = c;
+                dst[n++] = e;
+            }
+            else if (strchr("AbBdDsSwWafnrtx0\\",e) != NULL
+                || !((e >= 'a' && e <= 'z') || (e >= 'A' && e <= 'Z')))
+            {
+                if (e == 'A' && class_start >= 0) {
+                    return -1;
+                }
+
+                dst[n++] = c;
+                dst[n++] = e;
+            }
+            else {
+                /* Includes \u, \U and \N, which have no PCRE2 equivalent. */
+                return -1;
+            }
+
+            i += 2;
+            continue;
+        }
+
+        if (class_start >= 0) {
+            if (c == '[' && i + 1 < len && strchr(":.=",src[i+1]) != NULL) {
+                /* PCRE2 treats these as POSIX classes. */
+                return -1;
+            }
+
+            /* A ']' that starts the class is a literal. */
+            if (c == ']' && i != class_start && !(i == class_start + 1 && src[class_start] == '^')) {
+                class_start = -1;
+            }
+
+            dst[n++] = c;
+            i += 1;
+            continue;
+        }
+
+        if (c == '[') {
+            class_start = i + 1;
+        }
+        else if (c == '(' && i + 2 < len && src[i+1] == '?') {
+            Py_ssize_t j = i + 2;
+
+            /* Reject inline flags that PCRE2 does not support or that change
+             * how the pattern is parsed.
+             */
+            while (j < len && strchr("aiLmsux-",src[j]) != NULL) {
+                if (strchr("aLux",src[j]) != NULL) {
+                    return -1;
+                }
+                j += 1;
+            }
+        }
+        else if (c == '{' && i + 1 < len && src[i+1] == ',') {
+            Py_ssize_t j = i + 2;
+
+            /* Python's {,n} means {0,n}. */
+            while (j < len && src[j] >= '0' && src[j] <= '9') {
+                j += 1;
+            }
+
+            if (j == i + 2 || j >= len || src[j] != '}') {
+                return -1;
+            }
+
+            memcpy(dst + n,"{0",2);
+            n += 2;
+            i += 1;
+            continue;
+        }
+
+        dst[n++] = c;
+        i += 1;
+    }
+
+    if (class_start >= 0) {
+        return -1;
+    }
+
+    return n;
+}
+
+/* Compiles the regex used by a rule. Returns NULL if it cannot be compiled. */
+static pcre2_code* compile_rule(struct regex_engine* engine,PyObject* rule)
+{
+    int errcode;
+    long flags;
+    uint32_t options;
+    PCRE2_SIZE erroffset;
+    Py_ssize_t len;
+    Py_ssize_t n;
+    const char* src;
+    char* buf;
+    PyObject* regex;
+    PyObject* pattern;
+    PyObject* pyflags;
+    pcre2_code* code;
+
+    if (!PyTuple_Check(rule) || PyTuple_GET_SIZE(rule) != 3) {
+        return NULL;
+    }
+
+    /* The rule stores the bound match() method of the compiled regex. */
+    regex = PyObject_GetAttrString(PyTuple_GET_ITEM(rule,0),"__self__");
+    if (regex == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    pattern = PyObject_GetAttrString(regex,"pattern");
+    pyflags = PyObject_GetAttrString(regex,"flags");
+    Py_DECREF(regex);
+    if (pattern == NULL || pyflags == NULL || !PyUnicode_Check(pattern)
+        || !PyUnicode_IS_ASCII(pattern) || !PyLong_Check(pyflags))
+    {
+        PyErr_Clear();
+        Py_XDECREF(pattern);
+        Py_XDECREF(pyflags);
+        return NULL;
+    }
+
+    flags = PyLong_AsLong(pyflags);
+    Py_DECREF(pyflags);
+    if ((flags & ~(RE_IGNORECASE|RE_MULTILINE|RE_DOTALL|RE_UNICODE|RE_ASCII)) != 0) {
+        Py_DECREF(pattern);
+        return NULL;
+    }
+
+    src = (const char*)PyUnicode_DATA(pattern);
+    len = PyUnicode_GET_LENGTH(pattern);
+    buf = malloc(len * 2 + 1);
+    if (buf == NULL) {
+        Py_DECREF(pattern);
+        return NULL;
+    }
+
+    n = translate_pattern(src,len,buf);
+    Py_DECREF(pattern);
+    if (n < 0) {
+        free(buf);
+        return NULL;
+    }
+
+    /* Rules are always matched at the current position. ALT_CIRCUMFLEX makes
+     * '^' match after a trailing newline in multiline mode, as in Python.
+     */
+    options = PCRE2_ANCHORED | PCRE2_ALT_CIRCUMFLEX;
+    if (flags & RE_IGNORECASE) {
+        options |= PCRE2_CASELESS;
+    }
+    if (flags & RE_MULTILINE) {
+        options |= PCRE2_MULTILINE;
+    }
+    if (flags & RE_DOTALL) {
+        options |= PCRE2_DOTALL;
+    }
+
+    code = pcre2_compile((PCRE2_SPTR)buf,(PCRE2_SIZE)n,options,&errcode,&erroffset,engine->cctx);
+    free(buf);
+    if (code == NULL) {
+        return NULL;
+    }
+
+    /* JIT compilation is optional: the interpreter is used if it is disabled or
+     * if it fails.
+     */
+    if (engine->jit) {
+        pcre2_jit_compile(code,PCRE2_JIT_COMPLETE);
+    }
+
+    return code;
+}
+
+static void free_rules(PyObject* capsule)
+{
+    Py_ssize_t i;
+    struct engine_rules* rules = PyCapsule_GetPointer(capsule,ENGINE_RULES_CAPSULE);
+
+    if (rules == NULL) {
+        PyErr_Clear();
+        return;
+    }
+
+    for (i = 0;i < rules->count;++i) {
+        if (rules->codes[i] != NULL) {
+            pcre2_code_free(rules->codes[i]);
+        }
+    }
+
+    Py_XDECREF(rules->statetokens);
+    free(rules);
+}
+
+struct engine_rules* regex_engine_rules(struct regex_engine* engine,PyObject* lexer_class,
+    PyObject* state,PyObject* statetokens)
+{
+    Py_ssize_t i;
+    Py_ssize_t count;
+    PyObject* key;
+    PyObject* capsule;
+    struct engine_rules* rules;
+
+    if (engine->cache == NULL) {
+        return NULL;
+    }
+
+    key = PyTuple_Pack(2,lexer_class,state);
+    if (key == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    capsule = PyDict_GetItemWithError(engine->cache,key);
+    if (capsule != NULL) {
+        rules = PyCapsule_GetPointer(capsule,ENGINE_RULES_CAPSULE);
+        if (rules != NULL && rules->statetokens == statetokens
+            && rules->count == PyList_GET_SIZE(statetokens))
+        {
+            Py_DECREF(key);
+            return rules;
+        }
+    }
+    PyErr_Clear();
+
+    /* Compile the rules for the state. */
+    count = PyList_GET_SIZE(statetokens);
+    rules = calloc(1,sizeof(struct engine_rules) + count * sizeof(pcre2_code*));
+    if (rules == NULL) {
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    rules->statetokens = statetokens;
+    Py_INCREF(statetokens);
+    rules->count = count;
+    for (i = 0;i < count;++i) {
+        rules->codes[i] = compile_rule(engine,PyList_GET_ITEM(statetokens,i));
+    }
+
+    capsule = PyCapsule_New(rules,ENGINE_RULES_CAPSULE,free_rules);
+    if (capsule == NULL) {
+        PyErr_Clear();
+        for (i = 0;i < count;++i) {
+            if (rules->codes[i] != NULL) {
+                pcre2_code_free(rules->codes[i]);
+            }
+        }
+        Py_DECREF(statetokens);
+        free(rules);
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    if (PyDict_SetItem(engine->cache,key,capsule) == -1) {
+        PyErr_Clear();
+        Py_DECREF(capsule);
+        Py_DECREF(key);
+        return NULL;
+    }
+
+    Py_DECREF(capsule);
+    Py_DECREF(key);
+
+    return rules;
+}
+
+int regex_engine_match(struct regex_engine* engine,struct engine_rules* rules,
+    Py_ssize_t index,PyObject* text,Py_ssize_t pos,Py_ssize_t* end)
+{
+    int result;
+
+    if (index >= rules->count || rules->codes[index] == NULL) {
+        return -1;
+    }
+
+    result = pcre2_match(rules->codes[index],
+        (PCRE2_SPTR)PyUnicode_DATA(text),
+        (PCRE2_SIZE)PyUnicode_GET_LENGTH(text),
+        (PCRE2_SIZE)pos,
+        0,
+        engine->match_data,
+        php_pcre_mctx());
+
+    if (result == PCRE2_ERROR_NOMATCH) {
+        return 0;
+    }
+
+    /* Let Python decide if PCRE2 gave up (e.g. a match limit was hit). */
+    if (result < 0) {
+        return -1;
+    }
+
+    *end = (Py_ssize_t)pcre2_get_ovector_pointer(engine->match_data)[1];
+
+    return 1;
+}
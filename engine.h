@@ -0,0 +1,73 @@
+/*
+ * engine.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <Python.h>
+#include <php.h>
+#include <ext/pcre/php_pcre.h>
+
+/*
+ * regex_engine
+ *
+ * Matches RegexLexer rules using PHP's PCRE2 library (with JIT where it is
+ * available) instead of Python's re module. Patterns are translated from the
+ * Python dialect conservatively; a rule whose pattern cannot be translated is
+ * matched with Python instead.
+ *
+ * The engine is only used for text that PCRE2 and Python are known to treat
+ * alike: ASCII text without the \x1c-\x1f separators (which Python considers
+ * whitespace). Compiled rules are cached for the lifetime of the context.
+ */
+
+struct regex_engine
+{
+    /* Non-zero if the engine is enabled. */
+    int enabled;
+
+    /* Non-zero if newly compiled rules are JIT-compiled. This follows PHP's
+     * pcre.jit setting. Rules that are already compiled are left as they are.
+     */
+    int jit;
+
+    /* Maps (lexer class, state name) tuples to capsules that store the compiled
+     * rules for the state.
+     */
+    PyObject* cache;
+
+    pcre2_compile_context* cctx;
+    pcre2_match_data* match_data;
+};
+
+/* The compiled rules for a lexer state. */
+struct engine_rules;
+
+/* Initializes the engine. The engine is initially disabled. */
+int regex_engine_init(struct regex_engine* engine);
+
+/* Frees the engine's members. */
+void regex_engine_free(struct regex_engine* engine);
+
+/* Determines if the engine can be used to lex the specified text. */
+int regex_engine_eligible(const struct regex_engine* engine,PyObject* text);
+
+/* Gets the compiled rules for a lexer state, compiling them if needed. Returns
+ * NULL if the state cannot use the engine.
+ */
+struct engine_rules* regex_engine_rules(struct regex_engine* engine,PyObject* lexer_class,
+    PyObject* state,PyObject* statetokens);
+
+/* Matches rule 'index' at 'pos' in the text. Returns 1 if the rule matched (the
+ * end of the match is stored in 'end'), 0 if it did not match or -1 if the rule
+ * must be matched with Python.
+ */
+int regex_engine_match(struct regex_engine* engine,struct engine_rules* rules,
+    Py_ssize_t index,PyObject* text,Py_ssize_t pos,Py_ssize_t* end);
+
+#endif
@@ -7,6 +7,15 @@
  */
 
 #include "highlight.h"
+#include "snapshot.h"
+#include "parallel.h"
+#include "compact.h"
+#include "compress.h"
+#include "lexer.h"
+#include "cache.h"
+#include <ext/standard/md5.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -24,6 +33,100 @@ static void make_default_options(struct context_options* opts)
     opts->prestyles = "";
 }
 
+/* Disables the collector. Returns non-zero if it was enabled. */
+static int gc_disable(const struct pygments_context* ctx)
+{
+#if PY_VERSION_HEX < 0x030A0000
+    int enabled;
+    PyObject* result;
+#endif
+
+    /* Python 3.10 exposes the collector's state directly; earlier versions
+     * must go through the gc module.
+     */
+#if PY_VERSION_HEX >= 0x030A0000
+    return PyGC_Disable();
+#else
+    result = PyObject_CallMethod(ctx->module_gc,"isenabled",NULL);
+    if (result == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    enabled = PyObject_IsTrue(result);
+    Py_DECREF(result);
+    if (enabled <= 0) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    result = PyObject_CallMethod(ctx->module_gc,"disable",NULL);
+    if (result == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    Py_DECREF(result);
+    return 1;
+#endif
+}
+
+static void gc_enable(const struct pygments_context* ctx)
+{
+#if PY_VERSION_HEX < 0x030A0000
+    PyObject* result;
+#endif
+
+#if PY_VERSION_HEX >= 0x030A0000
+    PyGC_Enable();
+#else
+    result = PyObject_CallMethod(ctx->module_gc,"enable",NULL);
+    if (result == NULL) {
+        PyErr_Clear();
+        return;
+    }
+
+    Py_DECREF(result);
+#endif
+}
+
+/* The collector's state belongs to the interpreter, which is shared by the
+ * contexts of every thread. It is disabled by the first call that suspends it
+ * and only restored when the last such call resumes it.
+ */
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static long gc_suspenders = 0;
+static int gc_reenable = 0;
+
+static int gc_suspend(const struct pygments_context* ctx)
+{
+    if (!ctx->gcopts.deferred || ctx->module_gc == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&gc_lock);
+    if (gc_suspenders++ == 0) {
+        gc_reenable = gc_disable(ctx);
+    }
+    pthread_mutex_unlock(&gc_lock);
+
+    return 1;
+}
+
+static void gc_resume(const struct pygments_context* ctx,int suspended)
+{
+    if (!suspended) {
+        return;
+    }
+
+    pthread_mutex_lock(&gc_lock);
+    if (--gc_suspenders == 0 && gc_reenable) {
+        gc_enable(ctx);
+        gc_reenable = 0;
+    }
+    pthread_mutex_unlock(&gc_lock);
+}
+
 static PyObject* lookup_lexer(const struct pygments_context* ctx,
     PyObject* pycode,const struct lexer_options* opts)
 {
@@ -73,7 +176,6 @@ static PyObject* lookup_lexer(const struct pygments_context* ctx,
             lexer = PyObject_CallObject(ctx->func_guess_lexer,args);
             Py_DECREF(args);
             if (lexer == NULL) {
-                PyErr_Print();
                 PyErr_Clear();
                 return NULL;
             }
@@ -142,7 +244,8 @@ static int zval_check_int(int* result,zval* zv,const char* errctx,const char* op
         return FAILURE;
     }
 
-    return (int)zval_get_long(zv);
+    *result = (int)zval_get_long(zv);
+    return SUCCESS;
 }
 
 static int zval_check_string(
@@ -167,7 +270,14 @@ static int zval_check_string(
 
 static inline int set_python_attribute_bool(PyObject* inst,const char* attr,int value)
 {
-    return PyObject_SetAttrString(inst,attr,value ? Py_True : Py_False);
+    int result = PyObject_SetAttrString(inst,attr,value ? Py_True : Py_False);
+
+    if (result == -1) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    return result;
 }
 
 static int set_python_attribute_int(PyObject* inst,const char* attr,int value)
@@ -184,6 +294,11 @@ static int set_python_attribute_int(PyObject* inst,const char* attr,int value)
     result = PyObject_SetAttrString(inst,attr,num);
     Py_DECREF(num);
 
+    if (result == -1) {
+        PyErr_Clear();
+        return -1;
+    }
+
     return result;
 }
 
@@ -222,6 +337,63 @@ static inline int set_python_attribute_none(PyObject* inst,const char* attr,int
     return result;
 }
 
+static PyObject* import_attribute(const char* module_name,const char* attr)
+{
+    PyObject* module;
+    PyObject* result;
+
+    module = PyImport_ImportModule(module_name);
+    if (module == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    result = PyObject_GetAttrString(module,attr);
+    Py_DECREF(module);
+    if (result == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    return result;
+}
+
+/* Loads the members needed to run RegexLexer instances natively. Failure is
+ * not an error: native lexing is simply not available.
+ */
+static void init_lexer_support(struct pygments_context* ctx)
+{
+    ctx->class_RegexLexer = import_attribute("pygments.lexer","RegexLexer");
+    if (ctx->class_RegexLexer != NULL) {
+        ctx->func_get_tokens_unprocessed = PyObject_GetAttrString(ctx->class_RegexLexer,
+            "get_tokens_unprocessed");
+        if (ctx->func_get_tokens_unprocessed == NULL) {
+            PyErr_Clear();
+        }
+    }
+
+    ctx->token_Token = import_attribute("pygments.token","Token");
+    ctx->token_Error = import_attribute("pygments.token","Error");
+    ctx->token_Whitespace = import_attribute("pygments.token","Whitespace");
+    ctx->token_Text = import_attribute("pygments.token","Text");
+    ctx->standard_types = import_attribute("pygments.token","STANDARD_TYPES");
+    if (ctx->token_Token != NULL) {
+        ctx->type_TokenType = (PyObject*)Py_TYPE(ctx->token_Token);
+        Py_INCREF(ctx->type_TokenType);
+    }
+
+    ctx->str_root = PyUnicode_InternFromString("root");
+    ctx->str_newline = PyUnicode_InternFromString("\n");
+
+    if (ctx->token_Error == NULL || ctx->token_Whitespace == NULL
+        || ctx->type_TokenType == NULL || ctx->str_root == NULL || ctx->str_newline == NULL)
+    {
+        PyErr_Clear();
+        Py_CLEAR(ctx->class_RegexLexer);
+        Py_CLEAR(ctx->func_get_tokens_unprocessed);
+    }
+}
+
 int pygments_context_init(struct pygments_context* ctx)
 {
     PyObject* name;
@@ -268,7 +440,7 @@ int pygments_context_init(struct pygments_context* ctx)
     }
 
     formatters_module = PyImport_Import(name);
-    Py_DECREF(formatters_module);
+    Py_DECREF(name);
     if (formatters_module == NULL) {
         PyErr_Clear();
         pygments_context_close(ctx);
@@ -303,6 +475,15 @@ int pygments_context_init(struct pygments_context* ctx)
         return -1;
     }
 
+    ctx->func_format = PyObject_GetAttrString(ctx->module_pygments,"format");
+    if (ctx->func_format == NULL) {
+        PyErr_Clear();
+        Py_DECREF(formatters_module);
+        Py_DECREF(HtmlFormatter_class);
+        pygments_context_close(ctx);
+        return -1;
+    }
+
     ctx->func_get_lexer_by_name = PyObject_GetAttrString(ctx->module_lexers,"get_lexer_by_name");
     if (ctx->func_get_lexer_by_name == NULL) {
         PyErr_Clear();
@@ -334,6 +515,57 @@ int pygments_context_init(struct pygments_context* ctx)
     Py_DECREF(formatters_module);
     Py_DECREF(HtmlFormatter_class);
 
+    name = PyUnicode_FromString("gc");
+    if (name == NULL) {
+        PyErr_Clear();
+        pygments_context_close(ctx);
+        return -1;
+    }
+
+    ctx->module_gc = PyImport_Import(name);
+    Py_DECREF(name);
+    if (ctx->module_gc == NULL) {
+        PyErr_Clear();
+        pygments_context_close(ctx);
+        return -1;
+    }
+
+    init_lexer_support(ctx);
+
+    /* Prepare the extension's Python types up front. Preparing them lazily
+     * could race when several threads use their own contexts at once.
+     */
+    if (compress_writer_ready() == -1 || preview_type_ready() == -1) {
+        PyErr_Clear();
+    }
+
+    ctx->compact_types = PyDict_New();
+    if (ctx->compact_types == NULL) {
+        PyErr_Clear();
+    }
+
+    ctx->profiler = malloc(sizeof(struct profiler));
+    if (ctx->profiler != NULL && profiler_init(ctx->profiler) == -1) {
+        free(ctx->profiler);
+        ctx->profiler = NULL;
+    }
+
+    ctx->engine = malloc(sizeof(struct regex_engine));
+    if (ctx->engine != NULL && regex_engine_init(ctx->engine) == -1) {
+        free(ctx->engine);
+        ctx->engine = NULL;
+    }
+
+    ctx->tokens = malloc(sizeof(struct token_cache));
+    if (ctx->tokens != NULL && token_cache_init(ctx->tokens) == -1) {
+        free(ctx->tokens);
+        ctx->tokens = NULL;
+    }
+
+    ctx->gcopts.thresholds[0] = 700;
+    ctx->gcopts.thresholds[1] = 10;
+    ctx->gcopts.thresholds[2] = 10;
+
     pygments_context_set_default_options(ctx);
 
     return 0;
@@ -351,6 +583,11 @@ int pygments_context_close(struct pygments_context* ctx)
         ctx->func_highlight = NULL;
     }
 
+    if (ctx->func_format != NULL) {
+        Py_DECREF(ctx->func_format);
+        ctx->func_format = NULL;
+    }
+
     if (ctx->module_lexers != NULL) {
         Py_DECREF(ctx->module_lexers);
         ctx->module_lexers = NULL;
@@ -376,6 +613,46 @@ int pygments_context_close(struct pygments_context* ctx)
         ctx->formatter = NULL;
     }
 
+    if (ctx->module_gc != NULL) {
+        Py_DECREF(ctx->module_gc);
+        ctx->module_gc = NULL;
+    }
+
+    Py_CLEAR(ctx->class_RegexLexer);
+    Py_CLEAR(ctx->func_get_tokens_unprocessed);
+    Py_CLEAR(ctx->type_TokenType);
+    Py_CLEAR(ctx->token_Token);
+    Py_CLEAR(ctx->token_Error);
+    Py_CLEAR(ctx->token_Whitespace);
+    Py_CLEAR(ctx->token_Text);
+    Py_CLEAR(ctx->standard_types);
+    Py_CLEAR(ctx->compact_types);
+    Py_CLEAR(ctx->str_root);
+    Py_CLEAR(ctx->str_newline);
+
+    if (ctx->snapshot_lexers != NULL) {
+        Py_DECREF(ctx->snapshot_lexers);
+        ctx->snapshot_lexers = NULL;
+    }
+
+    if (ctx->profiler != NULL) {
+        profiler_free(ctx->profiler);
+        free(ctx->profiler);
+        ctx->profiler = NULL;
+    }
+
+    if (ctx->engine != NULL) {
+        regex_engine_free(ctx->engine);
+        free(ctx->engine);
+        ctx->engine = NULL;
+    }
+
+    if (ctx->tokens != NULL) {
+        token_cache_free(ctx->tokens);
+        free(ctx->tokens);
+        ctx->tokens = NULL;
+    }
+
     return 0;
 }
 
@@ -399,13 +676,28 @@ int pygments_context_options_parse(struct context_options* dst,
         return FAILURE;
     }
 
+    zv = zend_hash_str_find(ht,"compact",sizeof("compact")-1);
+    if (zv != NULL && zval_check_bool(&dst->compact,zv,errctx,"compact") == FAILURE) {
+        return FAILURE;
+    }
+
+    zv = zend_hash_str_find(ht,"max_lines",sizeof("max_lines")-1);
+    if (zv != NULL && zval_check_int(&dst->max_lines,zv,errctx,"max_lines") == FAILURE) {
+        return FAILURE;
+    }
+
+    zv = zend_hash_str_find(ht,"max_bytes",sizeof("max_bytes")-1);
+    if (zv != NULL && zval_check_int(&dst->max_bytes,zv,errctx,"max_bytes") == FAILURE) {
+        return FAILURE;
+    }
+
     zv = zend_hash_str_find(ht,"noclasses",sizeof("noclasses")-1);
     if (zv != NULL && zval_check_bool(&dst->noclasses,zv,errctx,"noclasses") == FAILURE) {
         return FAILURE;
     }
 
     zv = zend_hash_str_find(ht,"linenostart",sizeof("linenostart")-1);
-    if (zv != NULL && zval_check_int(&dst->linenostart,zv,errctx,"linenostart")) {
+    if (zv != NULL && zval_check_int(&dst->linenostart,zv,errctx,"linenostart") == FAILURE) {
         return FAILURE;
     }
 
@@ -447,47 +739,143 @@ int pygments_context_options_parse(struct context_options* dst,
     return SUCCESS;
 }
 
-int pygments_context_assign_options(struct pygments_context* ctx,
-    const struct context_options* opts)
+/* Assigns the HTML formatter options to a formatter instance. */
+static void assign_formatter_options(PyObject* formatter,const struct context_options* opts)
 {
-    set_python_attribute_bool(ctx->formatter,"linenos",opts->linenos);
-    set_python_attribute_int(ctx->formatter,"linenostart",opts->linenostart);
-    set_python_attribute_bool(ctx->formatter,"noclasses",opts->noclasses);
+    set_python_attribute_bool(formatter,"linenos",opts->linenos);
+    set_python_attribute_int(formatter,"linenostart",opts->linenostart);
+    set_python_attribute_bool(formatter,"noclasses",opts->noclasses);
     if (opts->lineanchors != NULL) {
-        set_python_attribute_string(ctx->formatter,"lineanchors",opts->lineanchors);
+        set_python_attribute_string(formatter,"lineanchors",opts->lineanchors);
     }
     else {
-        set_python_attribute_none(ctx->formatter,"lineanchors",1);
+        set_python_attribute_none(formatter,"lineanchors",1);
     }
 
     if (opts->classprefix != NULL) {
-        set_python_attribute_string(ctx->formatter,"classprefix",opts->classprefix);
+        set_python_attribute_string(formatter,"classprefix",opts->classprefix);
     }
     else {
-        set_python_attribute_none(ctx->formatter,"classprefix",1);
+        set_python_attribute_none(formatter,"classprefix",1);
     }
 
     if (opts->cssclass != NULL) {
-        set_python_attribute_string(ctx->formatter,"cssclass",opts->cssclass);
+        set_python_attribute_string(formatter,"cssclass",opts->cssclass);
     }
     else {
-        set_python_attribute_none(ctx->formatter,"cssclass",1);
+        set_python_attribute_none(formatter,"cssclass",1);
     }
 
     if (opts->cssstyles != NULL) {
-        set_python_attribute_string(ctx->formatter,"cssstyles",opts->cssstyles);
+        set_python_attribute_string(formatter,"cssstyles",opts->cssstyles);
     }
     else {
-        set_python_attribute_none(ctx->formatter,"cssstyles",1);
+        set_python_attribute_none(formatter,"cssstyles",1);
     }
 
     if (opts->prestyles != NULL) {
-        set_python_attribute_string(ctx->formatter,"prestyles",opts->prestyles);
+        set_python_attribute_string(formatter,"prestyles",opts->prestyles);
+    }
+    else {
+        set_python_attribute_none(formatter,"prestyles",1);
+    }
+}
+
+void pygments_context_options_digest(const struct context_options* opts,
+    unsigned char* digest)
+{
+    size_t i;
+    char buf[128];
+    PHP_MD5_CTX md5;
+    const char* strings[] = {
+        opts->lineanchors,
+        opts->classprefix,
+        opts->cssclass,
+        opts->cssstyles,
+        opts->prestyles
+    };
+
+    PHP_MD5Init(&md5);
+
+    snprintf(buf,sizeof(buf),"%d %d %d %d %d %d",opts->linenos,opts->linenostart,
+        opts->noclasses,opts->compact,opts->max_lines,opts->max_bytes);
+    PHP_MD5Update(&md5,buf,strlen(buf));
+
+    /* NULL and empty strings are treated the same by the formatter. */
+    for (i = 0;i < sizeof(strings) / sizeof(strings[0]);++i) {
+        PHP_MD5Update(&md5,"\n",1);
+        PHP_MD5Update(&md5,NULL2EMPTY(strings[i]),strlen(NULL2EMPTY(strings[i])));
+    }
+
+    PHP_MD5Final(digest,&md5);
+}
+
+/* Determines if the options change how the formatter renders token spans.
+ * HtmlFormatter caches the span markup for each token type, and the markup
+ * depends on these options.
+ */
+static int span_options_changed(PyObject* formatter,const struct context_options* opts)
+{
+    int changed;
+    PyObject* value;
+    const char* classprefix = (opts->classprefix != NULL) ? opts->classprefix : "";
+
+    value = PyObject_GetAttrString(formatter,"noclasses");
+    if (value == NULL) {
+        PyErr_Clear();
+        return 1;
+    }
+    changed = (PyObject_IsTrue(value) != (opts->noclasses != 0));
+    Py_DECREF(value);
+    if (changed) {
+        PyErr_Clear();
+        return 1;
+    }
+
+    value = PyObject_GetAttrString(formatter,"classprefix");
+    if (value == NULL) {
+        PyErr_Clear();
+        return 1;
+    }
+    if (value == Py_None) {
+        changed = (*classprefix != 0);
+    }
+    else if (PyUnicode_Check(value)) {
+        const char* current = PyUnicode_AsUTF8(value);
+        changed = (current == NULL || strcmp(current,classprefix) != 0);
     }
     else {
-        set_python_attribute_none(ctx->formatter,"prestyles",1);
+        changed = 1;
+    }
+    Py_DECREF(value);
+    PyErr_Clear();
+
+    return changed;
+}
+
+int pygments_context_assign_options(struct pygments_context* ctx,
+    const struct context_options* opts)
+{
+    /* Replace the formatter rather than have it render spans from its cache. */
+    if (span_options_changed(ctx->formatter,opts)) {
+        PyObject* formatter = PyObject_CallObject((PyObject*)Py_TYPE(ctx->formatter),NULL);
+
+        if (formatter != NULL) {
+            Py_DECREF(ctx->formatter);
+            ctx->formatter = formatter;
+        }
+        else {
+            PyErr_Clear();
+        }
     }
 
+    assign_formatter_options(ctx->formatter,opts);
+    pygments_context_options_digest(opts,ctx->options_digest);
+
+    ctx->compact = opts->compact;
+    ctx->preview.max_lines = opts->max_lines;
+    ctx->preview.max_bytes = opts->max_bytes;
+
     return 0;
 }
 
@@ -498,59 +886,497 @@ int pygments_context_set_default_options(struct pygments_context* ctx)
     return pygments_context_assign_options(ctx,&opts);
 }
 
-struct highlight_result* highlight(const struct pygments_context* ctx,const char* code,
-    const struct lexer_options* opts)
+int pygments_context_collect(struct pygments_context* ctx)
 {
-    PyObject* pycode;
+    int i;
+    int generation;
+    long counts[PYGMENTS_GC_GENERATIONS];
+    long collected;
+    double start;
+    double elapsed;
+    PyObject* result;
+
+    if (ctx->module_gc == NULL) {
+        return -1;
+    }
+
+    result = PyObject_CallMethod(ctx->module_gc,"get_count",NULL);
+    if (result == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    if (!PyArg_ParseTuple(result,"lll",&counts[0],&counts[1],&counts[2])) {
+        PyErr_Clear();
+        Py_DECREF(result);
+        return -1;
+    }
+    Py_DECREF(result);
+
+    /* Find the oldest generation whose count has exceeded its threshold.
+     * Collecting a generation also collects all younger generations.
+     */
+    generation = -1;
+    for (i = PYGMENTS_GC_GENERATIONS-1;i >= 0;--i) {
+        if (counts[i] > ctx->gcopts.thresholds[i]) {
+            generation = i;
+            break;
+        }
+    }
+
+    if (generation < 0) {
+        return 0;
+    }
+
+    start = monotonic_time();
+    result = PyObject_CallMethod(ctx->module_gc,"collect","i",generation);
+    elapsed = monotonic_time() - start;
+    if (result == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    collected = PyLong_AsLong(result);
+    Py_DECREF(result);
+    if (collected == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+        collected = 0;
+    }
+
+    ctx->gcstats.collections[generation] += 1;
+    ctx->gcstats.collected += collected;
+    ctx->gcstats.total_time += elapsed;
+    if (elapsed > ctx->gcstats.max_time) {
+        ctx->gcstats.max_time = elapsed;
+    }
+
+    return 1;
+}
+
+/* Calls a function from the sys module that returns an integer. Returns -1 if
+ * the function is not available.
+ */
+static long sys_call_long(const char* name)
+{
+    long value;
+    PyObject* func;
+    PyObject* result;
+
+    func = PySys_GetObject(name);
+    if (func == NULL) {
+        return -1;
+    }
+
+    result = PyObject_CallObject(func,NULL);
+    if (result == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    value = PyLong_AsLong(result);
+    Py_DECREF(result);
+    if (value == -1 && PyErr_Occurred()) {
+        PyErr_Clear();
+    }
+
+    return value;
+}
+
+/* Gets the memory traced by tracemalloc if it is tracing. */
+static void traced_memory(struct memory_stats* dst)
+{
+    PyObject* module;
+    PyObject* result;
+
+    dst->traced_memory = -1;
+    dst->traced_peak = -1;
+
+    module = PyImport_ImportModule("tracemalloc");
+    if (module == NULL) {
+        PyErr_Clear();
+        return;
+    }
+
+    result = PyObject_CallMethod(module,"is_tracing",NULL);
+    if (result != NULL && PyObject_IsTrue(result) == 1) {
+        Py_DECREF(result);
+        result = PyObject_CallMethod(module,"get_traced_memory",NULL);
+        if (result != NULL && PyTuple_Check(result) && PyTuple_GET_SIZE(result) == 2) {
+            dst->traced_memory = PyLong_AsLong(PyTuple_GET_ITEM(result,0));
+            dst->traced_peak = PyLong_AsLong(PyTuple_GET_ITEM(result,1));
+        }
+    }
+
+    Py_XDECREF(result);
+    Py_DECREF(module);
+    if (PyErr_Occurred()) {
+        PyErr_Clear();
+    }
+}
+
+int pygments_memory_stats(struct memory_stats* dst)
+{
+    dst->allocated_blocks = sys_call_long("getallocatedblocks");
+    dst->total_refcount = sys_call_long("gettotalrefcount");
+    traced_memory(dst);
+
+    return 0;
+}
+
+/* Formats a token stream into a string with the specified formatter, compacting
+ * the output if 'compact' is non-zero.
+ */
+static PyObject* format_tokens(const struct pygments_context* ctx,PyObject* formatter,
+    PyObject* stream,int compact)
+{
+    PyObject* html;
+    PyObject* compacted;
+
+    if (compact) {
+        stream = compact_token_stream(ctx,formatter,stream);
+        if (stream == NULL) {
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(stream);
+    }
+
+    html = PyObject_CallFunctionObjArgs(ctx->func_format,stream,formatter,NULL);
+    Py_DECREF(stream);
+    if (html == NULL || !compact) {
+        return html;
+    }
+
+    compacted = compact_html(html);
+    Py_DECREF(html);
+
+    return compacted;
+}
+
+/* Gets the token stream for the code, limited by the preview limits if they are
+ * enabled. If so, then 'preview' is set to a new reference to the preview
+ * stream so that the caller can tell if it was truncated; otherwise it is set
+ * to NULL.
+ */
+static PyObject* get_tokens(const struct pygments_context* ctx,PyObject* lexer,
+    PyObject* pycode,PyObject** preview)
+{
+    PyObject* stream;
+
+    *preview = NULL;
+
+    stream = PyObject_CallMethod(lexer,"get_tokens","O",pycode);
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    /* Stop lexing once the preview limits are reached. Tokens are produced
+     * lazily so the rest of the input is never lexed.
+     */
+    if (preview_enabled(&ctx->preview)) {
+        *preview = preview_token_stream(stream,&ctx->preview);
+        Py_DECREF(stream);
+        if (*preview == NULL) {
+            return NULL;
+        }
+        stream = *preview;
+        Py_INCREF(stream);
+    }
+
+    return stream;
+}
+
+/* Formats the token stream. This is equivalent to the formatting step of
+ * pygments.highlight() but allows the token stream and output to be
+ * post-processed. If 'output' is not NULL, then the formatter writes into it and
+ * None is returned.
+ */
+static PyObject* format_stream(const struct pygments_context* ctx,PyObject* stream,
+    struct compress_stream* output)
+{
+    PyObject* html;
+    PyObject* writer;
+
+    if (output == NULL) {
+        return format_tokens(ctx,ctx->formatter,stream,ctx->compact);
+    }
+
+    if (ctx->compact) {
+        stream = compact_token_stream(ctx,ctx->formatter,stream);
+        if (stream == NULL) {
+            return NULL;
+        }
+    }
+    else {
+        Py_INCREF(stream);
+    }
+
+    /* Compress the output as the formatter writes it. */
+    writer = compress_writer_new(output);
+    if (writer == NULL) {
+        Py_DECREF(stream);
+        return NULL;
+    }
+
+    output->compact = ctx->compact;
+    html = PyObject_CallFunctionObjArgs(ctx->func_format,stream,ctx->formatter,writer,NULL);
+    Py_DECREF(writer);
+    Py_DECREF(stream);
+    if (html == NULL) {
+        return NULL;
+    }
+
+    if (compress_stream_finish(output) == -1) {
+        Py_DECREF(html);
+        PyErr_SetString(PyExc_RuntimeError,"failed to compress output");
+        return NULL;
+    }
+
+    return html;
+}
+
+/* Lexes the code natively, using the regex engine if enabled and with the
+ * profiler active if 'profile' is non-zero. On success, the lexer replays the
+ * resulting tokens when the code is highlighted.
+ */
+static int native_lex(const struct pygments_context* ctx,PyObject* lexer,PyObject* code,
+    int profile)
+{
+    int result;
+    struct regex_state state;
+    PyObject* text;
+    PyObject* tokens;
+
+    text = PyObject_CallMethod(lexer,"_preprocess_lexer_input","O",code);
+    if (text == NULL || !PyUnicode_Check(text)) {
+        Py_XDECREF(text);
+        return -1;
+    }
+
+    tokens = PyList_New(0);
+    if (tokens == NULL || regex_state_init(&state,0) == -1) {
+        Py_XDECREF(tokens);
+        Py_DECREF(text);
+        return -1;
+    }
+
+    state.engine = regex_lexer_engine(ctx,text);
+
+    if (profile) {
+        ctx->profiler->active = 1;
+    }
+
+    result = regex_lexer_run(ctx,lexer,text,&state,-1,tokens,NULL);
+
+    if (profile) {
+        ctx->profiler->active = 0;
+        ctx->profiler->samples += 1;
+    }
+
+    if (result == 0) {
+        result = regex_lexer_replay(lexer,tokens);
+    }
+
+    regex_state_free(&state);
+    Py_DECREF(tokens);
+    Py_DECREF(text);
+
+    return result;
+}
+
+/* Gets the lexer used to highlight the code and runs any lexing that is done
+ * ahead of formatting. Returns a new reference or NULL on failure.
+ */
+static PyObject* prepare_lexer(const struct pygments_context* ctx,PyObject* pycode,
+    const char* code,const struct lexer_options* opts)
+{
+    PyObject* prefix;
     PyObject* lexer;
-    PyObject* args;
-    struct highlight_result* result;
 
-    /* Make sure the context is properly initialized. */
-    if (ctx->func_highlight == NULL) {
+    /* Get a lexer suitable for the operation. In preview mode, only the part of
+     * the code that will be shown is used to guess the lexer.
+     */
+
+    if (preview_enabled(&ctx->preview)) {
+        prefix = PyUnicode_Substring(pycode,0,preview_prefix_length(pycode,&ctx->preview));
+        if (prefix == NULL) {
+            PyErr_Clear();
+            return NULL;
+        }
+    }
+    else {
+        prefix = pycode;
+        Py_INCREF(prefix);
+    }
+
+    lexer = lookup_lexer(ctx,prefix,opts);
+    Py_DECREF(prefix);
+    if (lexer == NULL) {
         return NULL;
     }
 
-    /* Allocate result structure. */
-    result = malloc(sizeof(struct highlight_result));
-    if (result == NULL) {
+    pygments_snapshot_track(ctx,lexer);
+
+    /* Lex large inputs in parallel if enabled. On success, the lexer replays the
+     * resulting tokens when called by pygments.highlight().
+     */
+    if (ctx->paropts.workers > 1 && !preview_enabled(&ctx->preview)
+        && (long)strlen(code) >= ctx->paropts.min_size)
+    {
+        if (parallel_lex(ctx,lexer,pycode) == -1) {
+            PyErr_Clear();
+        }
+    }
+
+    /* Otherwise, lex natively if the regex engine is enabled or the call is
+     * sampled by the profiler.
+     */
+    else if (!preview_enabled(&ctx->preview) && regex_lexer_check(ctx,lexer)) {
+        int profile = (ctx->profiler != NULL && profiler_sample(ctx->profiler));
+
+        if (profile || (ctx->engine != NULL && ctx->engine->enabled)) {
+            if (native_lex(ctx,lexer,pycode,profile) == -1) {
+                PyErr_Clear();
+            }
+        }
+    }
+
+    return lexer;
+}
+
+/* Gets the tokens for the code. If the token cache is enabled, then the tokens
+ * are taken from the cache if possible or else collected into a list and stored
+ * in the cache; 'truncated' is set in either case. Otherwise the lexer's stream
+ * is returned and 'preview' is set as by get_tokens().
+ */
+static PyObject* lex_code(const struct pygments_context* ctx,PyObject* pycode,
+    const char* code,const struct lexer_options* opts,PyObject** preview,int* truncated)
+{
+    int cached;
+    unsigned char key[16];
+    PyObject* lexer;
+    PyObject* stream;
+    PyObject* tokens;
+
+    *preview = NULL;
+
+    /* Reuse the tokens from an earlier call for the same code and lexer. In
+     * that case, the lexer does not need to be looked up either.
+     */
+    cached = (ctx->tokens != NULL && token_cache_enabled(ctx->tokens));
+    if (cached) {
+        token_cache_key(key,code,opts,&ctx->preview);
+        tokens = token_cache_get(ctx->tokens,key,pycode,truncated);
+        if (tokens != NULL) {
+            return tokens;
+        }
+    }
+
+    lexer = prepare_lexer(ctx,pycode,code,opts);
+    if (lexer == NULL) {
+        return NULL;
+    }
+
+    stream = get_tokens(ctx,lexer,pycode,preview);
+    Py_DECREF(lexer);
+    if (stream == NULL || !cached) {
+        return stream;
+    }
+
+    tokens = PySequence_List(stream);
+    Py_DECREF(stream);
+    if (*preview != NULL) {
+        *truncated = preview_truncated(*preview);
+        Py_CLEAR(*preview);
+    }
+    if (tokens == NULL) {
+        return NULL;
+    }
+
+    token_cache_put(ctx->tokens,key,pycode,tokens,*truncated);
+
+    return tokens;
+}
+
+/* Implements highlight() and highlight_compressed(). */
+static PyObject* highlight_impl(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts,struct compress_stream* output,int* truncated)
+{
+    int suspended;
+    PyObject* pycode;
+    PyObject* stream;
+    PyObject* preview;
+    PyObject* result;
+
+    *truncated = 0;
+
+    /* Make sure the context is properly initialized. */
+    if (ctx->func_highlight == NULL || ctx->func_format == NULL) {
         return NULL;
     }
-    memset(result,0,sizeof(struct highlight_result));
 
     /* Convert source code string to Python string. */
     pycode = PyUnicode_FromString(code);
     if (pycode == NULL) {
         PyErr_Clear();
-        free(result);
         return NULL;
     }
 
-    /* Get a lexer suitable for the operation. */
+    /* Keep the cyclic garbage collector from running in the middle of the
+     * call if collections are deferred.
+     */
+    suspended = gc_suspend(ctx);
 
-    lexer = lookup_lexer(ctx,pycode,opts);
-    if (lexer == NULL) {
-        free(result);
+    /* Lex and format the code. */
+
+    stream = lex_code(ctx,pycode,code,opts,&preview,truncated);
+    if (stream == NULL) {
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+        }
+
+        gc_resume(ctx,suspended);
         Py_DECREF(pycode);
         return NULL;
     }
 
-    /* Call pygments.highlight(). */
-
-    args = Py_BuildValue("(OOO)",pycode,lexer,ctx->formatter);
-    result->_pyobj = PyObject_CallObject(ctx->func_highlight,args);
-    Py_DECREF(args);
-    Py_DECREF(lexer);
+    result = format_stream(ctx,stream,output);
+    Py_DECREF(stream);
+    if (preview != NULL) {
+        *truncated = preview_truncated(preview);
+        Py_DECREF(preview);
+    }
     Py_DECREF(pycode);
-    if (result->_pyobj == NULL) {
+    gc_resume(ctx,suspended);
+    if (result == NULL) {
         if (PyErr_Occurred()) {
             PyErr_Clear();
         }
 
-        free(result);
         return NULL;
     }
 
+    return result;
+}
+
+/* Creates a highlight result from the output string. The reference to 'html'
+ * is stolen.
+ */
+static struct highlight_result* make_result(PyObject* html,int truncated)
+{
+    struct highlight_result* result;
+
+    /* Allocate result structure. */
+    result = malloc(sizeof(struct highlight_result));
+    if (result == NULL) {
+        Py_DECREF(html);
+        return NULL;
+    }
+    memset(result,0,sizeof(struct highlight_result));
+
+    result->_pyobj = html;
+    result->truncated = truncated;
     result->html = PyUnicode_AsUTF8(result->_pyobj);
     if (result->html == NULL) {
         /* NOTE: PyString_AS_STRING() shouldn't return NULL, but we include this
@@ -560,6 +1386,7 @@ struct highlight_result* highlight(const struct pygments_context* ctx,const char
             PyErr_Clear();
         }
 
+        Py_DECREF(result->_pyobj);
         free(result);
         return NULL;
     }
@@ -567,6 +1394,206 @@ struct highlight_result* highlight(const struct pygments_context* ctx,const char
     return result;
 }
 
+struct highlight_result* highlight(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts)
+{
+    int truncated;
+    PyObject* html;
+
+    html = highlight_impl(ctx,code,opts,NULL,&truncated);
+    if (html == NULL) {
+        return NULL;
+    }
+
+    return make_result(html,truncated);
+}
+
+int highlight_multi(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts,const struct context_options* variants,int count,
+    struct highlight_result** results)
+{
+    int i;
+    int suspended;
+    int truncated = 0;
+    PyObject* pycode;
+    PyObject* stream;
+    PyObject* preview;
+    PyObject* tokens;
+
+    memset(results,0,sizeof(struct highlight_result*) * count);
+
+    /* Make sure the context is properly initialized. */
+    if (ctx->func_highlight == NULL || ctx->func_format == NULL) {
+        return -1;
+    }
+
+    /* Convert source code string to Python string. */
+    pycode = PyUnicode_FromString(code);
+    if (pycode == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    suspended = gc_suspend(ctx);
+
+    /* Lex the code once, keeping the tokens so that they can be formatted for
+     * each variant.
+     */
+    stream = lex_code(ctx,pycode,code,opts,&preview,&truncated);
+    Py_DECREF(pycode);
+    if (stream == NULL) {
+        PyErr_Clear();
+        gc_resume(ctx,suspended);
+        return -1;
+    }
+
+    tokens = PySequence_List(stream);
+    Py_DECREF(stream);
+    if (preview != NULL) {
+        truncated = preview_truncated(preview);
+        Py_DECREF(preview);
+    }
+    if (tokens == NULL) {
+        PyErr_Clear();
+        gc_resume(ctx,suspended);
+        return -1;
+    }
+
+    /* Format the tokens with a separate formatter for each variant so that the
+     * context's formatter options are left alone.
+     */
+    for (i = 0;i < count;++i) {
+        PyObject* formatter;
+        PyObject* html;
+
+        formatter = PyObject_CallObject((PyObject*)Py_TYPE(ctx->formatter),NULL);
+        if (formatter == NULL) {
+            break;
+        }
+
+        assign_formatter_options(formatter,variants + i);
+        html = format_tokens(ctx,formatter,tokens,variants[i].compact);
+        Py_DECREF(formatter);
+        if (html == NULL) {
+            break;
+        }
+
+        results[i] = make_result(html,truncated);
+        if (results[i] == NULL) {
+            break;
+        }
+    }
+
+    Py_DECREF(tokens);
+    gc_resume(ctx,suspended);
+
+    if (i < count) {
+        PyErr_Clear();
+        while (i > 0) {
+            highlight_result_free(results[--i]);
+            results[i] = NULL;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int highlight_compressed(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts,struct compress_stream* output,int* truncated)
+{
+    int dummy;
+    PyObject* result;
+
+    result = highlight_impl(ctx,code,opts,output,truncated != NULL ? truncated : &dummy);
+    if (result == NULL) {
+        return -1;
+    }
+
+    Py_DECREF(result);
+    return 0;
+}
+
+PyObject* highlight_tokens(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts,int* truncated)
+{
+    int suspended;
+    Py_ssize_t i;
+    PyObject* pycode;
+    PyObject* stream;
+    PyObject* preview;
+    PyObject* tokens;
+    PyObject* result;
+
+    *truncated = 0;
+
+    /* Make sure the context is properly initialized. */
+    if (ctx->func_highlight == NULL || ctx->func_format == NULL) {
+        return NULL;
+    }
+
+    /* Convert source code string to Python string. */
+    pycode = PyUnicode_FromString(code);
+    if (pycode == NULL) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    suspended = gc_suspend(ctx);
+
+    stream = lex_code(ctx,pycode,code,opts,&preview,truncated);
+    Py_DECREF(pycode);
+    if (stream == NULL) {
+        PyErr_Clear();
+        gc_resume(ctx,suspended);
+        return NULL;
+    }
+
+    tokens = PySequence_List(stream);
+    Py_DECREF(stream);
+    if (preview != NULL) {
+        *truncated = preview_truncated(preview);
+        Py_DECREF(preview);
+    }
+    if (tokens == NULL) {
+        PyErr_Clear();
+        gc_resume(ctx,suspended);
+        return NULL;
+    }
+
+    /* Replace each token type with its name, e.g. "Token.Keyword". */
+    result = PyList_New(PyList_GET_SIZE(tokens));
+    for (i = 0;result != NULL && i < PyList_GET_SIZE(tokens);++i) {
+        PyObject* ttype;
+        PyObject* value;
+        PyObject* name;
+        PyObject* item;
+
+        if (!PyArg_ParseTuple(PyList_GET_ITEM(tokens,i),"OO",&ttype,&value)) {
+            Py_CLEAR(result);
+            break;
+        }
+
+        name = PyObject_Str(ttype);
+        item = (name != NULL) ? PyTuple_Pack(2,name,value) : NULL;
+        Py_XDECREF(name);
+        if (item == NULL) {
+            Py_CLEAR(result);
+            break;
+        }
+
+        PyList_SET_ITEM(result,i,item);
+    }
+
+    Py_DECREF(tokens);
+    if (result == NULL) {
+        PyErr_Clear();
+    }
+    gc_resume(ctx,suspended);
+
+    return result;
+}
+
 void highlight_result_free(struct highlight_result* result)
 {
     Py_DECREF(result->_pyobj);
@@ -11,8 +11,115 @@
 
 #include <Python.h>
 #include <php.h>
+#include "preview.h"
+#include "profile.h"
+#include "engine.h"
+#include <time.h>
+
+struct compress_stream;
+struct token_cache;
 
 #define PHP_PYGMENTS_DEFAULT_CSSCLASS "php-pygments"
+#define PYGMENTS_GC_GENERATIONS 3
+
+/* Gets the time (in seconds) from a clock that is not affected by changes to
+ * the system time.
+ */
+static inline double monotonic_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/*
+ * gc_options
+ *
+ * Controls how the context schedules Python's cyclic garbage collector. When
+ * collection is deferred, the collector is disabled for the duration of each
+ * highlight() call and collections are instead run between requests by
+ * pygments_context_collect().
+ */
+
+struct gc_options
+{
+    /* If non-zero, then cyclic garbage collection is deferred. */
+    int deferred;
+
+    /* Collection thresholds for each generation. A generation is collected
+     * when its count (as reported by gc.get_count()) exceeds its threshold.
+     */
+    long thresholds[PYGMENTS_GC_GENERATIONS];
+};
+
+/*
+ * gc_stats
+ *
+ * Accumulates statistics for deferred garbage collections run on a context.
+ * Each thread has its own context, so under ZTS these only count the
+ * collections run by the context's thread.
+ */
+
+struct gc_stats
+{
+    /* The number of collections run for each generation. */
+    long collections[PYGMENTS_GC_GENERATIONS];
+
+    /* The total number of unreachable objects found by the collector. */
+    long collected;
+
+    /* The total and maximum time (in seconds) spent in the collector. */
+    double total_time;
+    double max_time;
+};
+
+/*
+ * memory_stats
+ *
+ * Describes the memory held by the embedded Python interpreter. These are meant
+ * for tracking growth over the lifetime of a long-running process.
+ */
+
+struct memory_stats
+{
+    /* The number of memory blocks currently allocated by Python's allocator. */
+    long allocated_blocks;
+
+    /* The total reference count of all objects. This is only available in
+     * debug builds of Python and is -1 otherwise.
+     */
+    long total_refcount;
+
+    /* The current and peak size (in bytes) of the memory traced by tracemalloc.
+     * These are -1 unless tracemalloc is tracing (e.g. PYTHONTRACEMALLOC is set).
+     */
+    long traced_memory;
+    long traced_peak;
+};
+
+/*
+ * parallel_options
+ *
+ * Controls parallel lexing of large inputs (see parallel.h).
+ */
+
+struct parallel_options
+{
+    /* The number of processes among which the input is divided. Parallel
+     * lexing is disabled if this is less than 2.
+     */
+    int workers;
+
+    /* The minimum size (in bytes) of input that is lexed in parallel. */
+    long min_size;
+
+    /* The number of seconds to wait for the workers. Workers that have not
+     * finished by then are killed and their chunks are lexed serially. There
+     * is no limit if this is not positive.
+     */
+    double timeout;
+};
 
 /*
  * pygments_context
@@ -27,6 +134,7 @@ struct pygments_context
     /* The pygments module */
     PyObject* module_pygments;
     PyObject* func_highlight;
+    PyObject* func_format;
 
     /* The pygments.lexers module */
     PyObject* module_lexers;
@@ -34,8 +142,68 @@ struct pygments_context
     PyObject* func_guess_lexer_for_filename;
     PyObject* func_guess_lexer;
 
+    /* Members of the pygments.lexer and pygments.token modules used to run
+     * RegexLexer instances natively. These are NULL if not supported by the
+     * installed pygments version.
+     */
+    PyObject* class_RegexLexer;
+    PyObject* func_get_tokens_unprocessed;
+    PyObject* type_TokenType;
+    PyObject* token_Token;
+    PyObject* token_Error;
+    PyObject* token_Whitespace;
+    PyObject* token_Text;
+    PyObject* standard_types;
+    PyObject* str_root;
+    PyObject* str_newline;
+
     /* A pygments.formatters.HtmlFormatter instance */
     PyObject* formatter;
+
+    /* If non-zero, then compact output is produced. This is not a formatter
+     * attribute but is assigned with the other context options.
+     */
+    int compact;
+
+    /* Maps each style to a dict that maps token types to their compacted token
+     * types under that style (see compact.h).
+     */
+    PyObject* compact_types;
+
+    /* A digest of the options last assigned to the context. */
+    unsigned char options_digest[16];
+
+    /* Preview limits. These are assigned with the other context options. */
+    struct preview_options preview;
+
+    /* The gc module */
+    PyObject* module_gc;
+
+    /* Garbage collector scheduling */
+    struct gc_options gcopts;
+    struct gc_stats gcstats;
+
+    /* Parallel lexing */
+    struct parallel_options paropts;
+
+    /* The RegexLexer profiler. This is NULL if it could not be allocated. */
+    struct profiler* profiler;
+
+    /* The PCRE2 regex engine (see engine.h). This is NULL if it could not be
+     * allocated.
+     */
+    struct regex_engine* engine;
+
+    /* The token stream cache (see cache.h). This is NULL if it could not be
+     * allocated.
+     */
+    struct token_cache* tokens;
+
+    /* The set of lexer classes recorded for the lexer snapshot. This is NULL if
+     * snapshots are not enabled.
+     */
+    PyObject* snapshot_lexers;
+    Py_ssize_t snapshot_loaded;
 };
 
 /* context_options
@@ -90,6 +258,19 @@ struct context_options
      * for the outer <pre> element.
      */
     const char* prestyles;
+
+    /*
+     * If non-zero, then the HTML output is made as small as possible without
+     * changing how it renders (see compact.h).
+     */
+    int compact;
+
+    /*
+     * If non-zero, then only the specified number of lines or bytes of the
+     * source code are lexed and highlighted (see preview.h).
+     */
+    int max_lines;
+    int max_bytes;
 };
 
 /*
@@ -121,6 +302,9 @@ struct highlight_result
 {
     const char* html;
 
+    /* Non-zero if the output was cut short by the preview limits. */
+    int truncated;
+
     PyObject* _pyobj;
 };
 
@@ -140,6 +324,10 @@ int pygments_context_options_parse(struct context_options* dst,
     zval* zfrom,
     const char* errctx);
 
+/* Computes a digest of the options that identifies the output they produce. */
+void pygments_context_options_digest(const struct context_options* opts,
+    unsigned char* digest);
+
 /* Assigns the specified options to the context's formatter instance. */
 int pygments_context_assign_options(struct pygments_context* ctx,
     const struct context_options* opts);
@@ -147,13 +335,49 @@ int pygments_context_assign_options(struct pygments_context* ctx,
 /* Resets the context's formatter options to defaults. */
 int pygments_context_set_default_options(struct pygments_context* ctx);
 
+/* Runs a deferred garbage collection on the context if any generation has
+ * exceeded its threshold. At most one (the oldest such) generation is collected
+ * per call so that the cost is spread out over several requests.
+ */
+int pygments_context_collect(struct pygments_context* ctx);
+
+/* Gets statistics about the memory held by the Python interpreter. */
+int pygments_memory_stats(struct memory_stats* dst);
+
 /* This is the core function that wraps the calls into the Pygments library for
  * syntax highlighting.
  */
 struct highlight_result* highlight(const struct pygments_context* ctx,const char* code,
     const struct lexer_options* opts);
 
-/* Frees the result of a call to highlight(). */
+/* Like highlight(), but the output is compressed into the specified stream as
+ * it is produced instead of being returned. The stream must be initialized by
+ * the caller. If 'truncated' is not NULL, then it is set to non-zero if the
+ * output was cut short by the preview limits. Returns 0 on success and -1 on
+ * failure.
+ */
+int highlight_compressed(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts,struct compress_stream* output,int* truncated);
+
+/* Like highlight(), but the code is lexed once and the tokens are formatted once
+ * for each of the 'count' option sets in 'variants'. The preview limits are
+ * taken from the context (since they affect lexing) and the other options from
+ * each variant. On success, the results are stored in 'results', which must
+ * have room for 'count' elements, and 0 is returned. Returns -1 on failure.
+ */
+int highlight_multi(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts,const struct context_options* variants,int count,
+    struct highlight_result** results);
+
+/* Lexes the code as highlight() would, but gets the tokens instead of the
+ * formatted output. Returns a new list of (token type name, value) tuples, e.g.
+ * ("Token.Keyword","int"), or NULL on failure. 'truncated' is set to non-zero if
+ * the tokens were cut short by the preview limits.
+ */
+PyObject* highlight_tokens(const struct pygments_context* ctx,const char* code,
+    const struct lexer_options* opts,int* truncated);
+
+/* Frees the result of a call to highlight() or highlight_multi(). */
 void highlight_result_free(struct highlight_result* result);
 
 #endif
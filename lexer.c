@@ -0,0 +1,573 @@
+/*
+ * lexer.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "lexer.h"
+
+int regex_state_init(struct regex_state* state,Py_ssize_t pos)
+{
+    state->pos = pos;
+    state->engine = 0;
+    state->stack = Py_BuildValue("[s]","root");
+    if (state->stack == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void regex_state_free(struct regex_state* state)
+{
+    Py_CLEAR(state->stack);
+}
+
+int regex_state_is_root(const struct regex_state* state,Py_ssize_t pos)
+{
+    return state->pos == pos
+        && PyList_GET_SIZE(state->stack) == 1
+        && PyUnicode_CompareWithASCIIString(PyList_GET_ITEM(state->stack,0),"root") == 0;
+}
+
+int regex_lexer_engine(const struct pygments_context* ctx,PyObject* text)
+{
+    return ctx->engine != NULL && regex_engine_eligible(ctx->engine,text);
+}
+
+int regex_lexer_check(const struct pygments_context* ctx,PyObject* lexer)
+{
+    int result;
+    PyObject* method;
+
+    if (ctx->class_RegexLexer == NULL || ctx->func_get_tokens_unprocessed == NULL) {
+        return 0;
+    }
+
+    result = PyObject_IsInstance(lexer,ctx->class_RegexLexer);
+    if (result != 1) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    method = PyObject_GetAttrString((PyObject*)Py_TYPE(lexer),"get_tokens_unprocessed");
+    if (method == NULL) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    result = (method == ctx->func_get_tokens_unprocessed);
+    Py_DECREF(method);
+
+    return result;
+}
+
+static int append_token(PyObject* tokens,Py_ssize_t pos,PyObject* ttype,PyObject* value)
+{
+    int result;
+    PyObject* token;
+
+    token = Py_BuildValue("(nOO)",pos,ttype,value);
+    if (token == NULL) {
+        return -1;
+    }
+
+    result = PyList_Append(tokens,token);
+    Py_DECREF(token);
+
+    return result;
+}
+
+static int push_state(PyObject* stack,PyObject* name)
+{
+    if (PyUnicode_CompareWithASCIIString(name,"#pop") == 0) {
+        if (PyList_GET_SIZE(stack) > 1) {
+            return PyList_SetSlice(stack,PyList_GET_SIZE(stack)-1,PyList_GET_SIZE(stack),NULL);
+        }
+
+        return 0;
+    }
+
+    if (PyUnicode_CompareWithASCIIString(name,"#push") == 0) {
+        return PyList_Append(stack,PyList_GET_ITEM(stack,PyList_GET_SIZE(stack)-1));
+    }
+
+    return PyList_Append(stack,name);
+}
+
+/* Applies a processed state transition from a token definition. */
+static int transition(PyObject* stack,PyObject* new_state)
+{
+    Py_ssize_t i;
+
+    if (PyTuple_Check(new_state)) {
+        for (i = 0;i < PyTuple_GET_SIZE(new_state);++i) {
+            PyObject* name = PyTuple_GET_ITEM(new_state,i);
+
+            if (!PyUnicode_Check(name)) {
+                PyErr_SetString(PyExc_ValueError,"wrong state def");
+                return -1;
+            }
+
+            if (push_state(stack,name) == -1) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    if (PyLong_Check(new_state)) {
+        /* Pop, but keep at least one state on the stack. */
+        Py_ssize_t n = PyLong_AsSsize_t(new_state);
+        Py_ssize_t size = PyList_GET_SIZE(stack);
+
+        if (n == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+
+        if ((n < 0 ? -n : n) >= size) {
+            return PyList_SetSlice(stack,1,size,NULL);
+        }
+
+        return PyList_SetSlice(stack,n < 0 ? size + n : n,size,NULL);
+    }
+
+    if (PyUnicode_Check(new_state)
+        && PyUnicode_CompareWithASCIIString(new_state,"#push") == 0)
+    {
+        return push_state(stack,new_state);
+    }
+
+    PyErr_SetString(PyExc_ValueError,"wrong state def");
+    return -1;
+}
+
+static PyObject* lookup_state(PyObject* tokendefs,PyObject* stack)
+{
+    PyObject* statetokens;
+
+    statetokens = PyDict_GetItemWithError(tokendefs,PyList_GET_ITEM(stack,PyList_GET_SIZE(stack)-1));
+    if (statetokens == NULL) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_KeyError,"unknown lexer state");
+        }
+        return NULL;
+    }
+
+    if (!PyList_Check(statetokens)) {
+        PyErr_SetString(PyExc_TypeError,"unexpected token table");
+        return NULL;
+    }
+
+    return statetokens;
+}
+
+/* Applies a matching rule: emits its tokens and performs its transition. The
+ * new position is stored in 'pos'.
+ */
+static int apply_rule(const struct pygments_context* ctx,PyObject* lexer,PyObject* rule,
+    PyObject* match,Py_ssize_t* pos,PyObject* stack,PyObject* tokens)
+{
+    PyObject* action = PyTuple_GET_ITEM(rule,1);
+    PyObject* new_state = PyTuple_GET_ITEM(rule,2);
+    PyObject* obj;
+
+    if (action != Py_None) {
+        if (Py_TYPE(action) == (PyTypeObject*)ctx->type_TokenType) {
+            int result;
+
+            obj = PyObject_CallMethod(match,"group",NULL);
+            if (obj == NULL) {
+                return -1;
+            }
+
+            result = append_token(tokens,*pos,action,obj);
+            Py_DECREF(obj);
+            if (result == -1) {
+                return -1;
+            }
+        }
+        else {
+            PyObject* iter;
+            PyObject* item;
+
+            obj = PyObject_CallFunctionObjArgs(action,lexer,match,NULL);
+            if (obj == NULL) {
+                return -1;
+            }
+
+            iter = PyObject_GetIter(obj);
+            Py_DECREF(obj);
+            if (iter == NULL) {
+                return -1;
+            }
+
+            while ((item = PyIter_Next(iter)) != NULL) {
+                int result = PyList_Append(tokens,item);
+                Py_DECREF(item);
+                if (result == -1) {
+                    Py_DECREF(iter);
+                    return -1;
+                }
+            }
+
+            Py_DECREF(iter);
+            if (PyErr_Occurred()) {
+                return -1;
+            }
+        }
+    }
+
+    obj = PyObject_CallMethod(match,"end",NULL);
+    if (obj == NULL) {
+        return -1;
+    }
+
+    *pos = PyLong_AsSsize_t(obj);
+    Py_DECREF(obj);
+    if (*pos == -1 && PyErr_Occurred()) {
+        return -1;
+    }
+
+    if (new_state != Py_None) {
+        return transition(stack,new_state);
+    }
+
+    return 0;
+}
+
+/* Applies a rule that was matched by the regex engine. This is equivalent to
+ * apply_rule() for a rule whose action is a token type.
+ */
+static int apply_rule_native(PyObject* rule,PyObject* text,Py_ssize_t* pos,Py_ssize_t end,
+    PyObject* stack,PyObject* tokens)
+{
+    int result;
+    PyObject* value;
+    PyObject* new_state = PyTuple_GET_ITEM(rule,2);
+
+    value = PyUnicode_Substring(text,*pos,end);
+    if (value == NULL) {
+        return -1;
+    }
+
+    result = append_token(tokens,*pos,PyTuple_GET_ITEM(rule,1),value);
+    Py_DECREF(value);
+    if (result == -1) {
+        return -1;
+    }
+
+    *pos = end;
+    if (new_state != Py_None) {
+        return transition(stack,new_state);
+    }
+
+    return 0;
+}
+
+/* Gets the regex engine's compiled rules for the current state. */
+static struct engine_rules* engine_state(const struct pygments_context* ctx,
+    const struct regex_state* state,PyObject* lexer,PyObject* statetokens)
+{
+    if (!state->engine) {
+        return NULL;
+    }
+
+    return regex_engine_rules(ctx->engine,(PyObject*)Py_TYPE(lexer),
+        PyList_GET_ITEM(state->stack,PyList_GET_SIZE(state->stack)-1),statetokens);
+}
+
+static int add_checkpoint(PyObject* checkpoints,PyObject* text,Py_ssize_t pos,
+    PyObject* stack,PyObject* tokens)
+{
+    int result;
+    PyObject* checkpoint;
+
+    if (pos > 0 && PyUnicode_READ_CHAR(text,pos-1) != '\n') {
+        return 0;
+    }
+
+    if (PyList_GET_SIZE(stack) != 1
+        || PyUnicode_CompareWithASCIIString(PyList_GET_ITEM(stack,0),"root") != 0)
+    {
+        return 0;
+    }
+
+    checkpoint = Py_BuildValue("(nn)",pos,PyList_GET_SIZE(tokens));
+    if (checkpoint == NULL) {
+        return -1;
+    }
+
+    result = PyList_Append(checkpoints,checkpoint);
+    Py_DECREF(checkpoint);
+
+    return result;
+}
+
+/* Gets the profiler statistics for the current state. Profiling of the state
+ * is skipped if this fails.
+ */
+static struct rule_stats* profile_state(struct profiler* profiler,PyObject* lexer,
+    PyObject* stack,PyObject* statetokens,Py_ssize_t* count)
+{
+    struct rule_stats* stats;
+
+    if (profiler == NULL) {
+        return NULL;
+    }
+
+    *count = PyList_GET_SIZE(statetokens);
+    stats = profiler_rules(profiler,(PyObject*)Py_TYPE(lexer),
+        PyList_GET_ITEM(stack,PyList_GET_SIZE(stack)-1),*count);
+    if (stats == NULL) {
+        PyErr_Clear();
+    }
+
+    return stats;
+}
+
+int regex_lexer_run(const struct pygments_context* ctx,PyObject* lexer,PyObject* text,
+    struct regex_state* state,Py_ssize_t stop,PyObject* tokens,PyObject* checkpoints)
+{
+    Py_ssize_t pos = state->pos;
+    Py_ssize_t len = PyUnicode_GET_LENGTH(text);
+    PyObject* stack = state->stack;
+    PyObject* tokendefs;
+    PyObject* statetokens;
+    struct profiler* profiler = NULL;
+    struct rule_stats* stats = NULL;
+    Py_ssize_t stats_count = 0;
+    struct engine_rules* rules = NULL;
+
+    if (ctx->profiler != NULL && ctx->profiler->active) {
+        profiler = ctx->profiler;
+    }
+
+    tokendefs = PyObject_GetAttrString(lexer,"_tokens");
+    if (tokendefs == NULL) {
+        return -1;
+    }
+
+    if (!PyDict_Check(tokendefs)) {
+        Py_DECREF(tokendefs);
+        PyErr_SetString(PyExc_TypeError,"unexpected token table");
+        return -1;
+    }
+
+    statetokens = lookup_state(tokendefs,stack);
+    if (statetokens == NULL) {
+        Py_DECREF(tokendefs);
+        return -1;
+    }
+    stats = profile_state(profiler,lexer,stack,statetokens,&stats_count);
+    rules = engine_state(ctx,state,lexer,statetokens);
+
+    while (stop < 0 || pos < stop) {
+        Py_ssize_t i;
+        Py_ssize_t n;
+        PyObject* match = NULL;
+        PyObject* rule = NULL;
+        PyObject* pypos;
+        Py_UCS4 ch;
+        int result;
+        int native = 0;
+        Py_ssize_t end = 0;
+        double start = 0;
+
+        if (checkpoints != NULL
+            && add_checkpoint(checkpoints,text,pos,stack,tokens) == -1)
+        {
+            Py_DECREF(tokendefs);
+            return -1;
+        }
+
+        /* NOTE: The rules list may be replaced by a callback, so we hold our
+         * own reference while scanning it.
+         */
+        Py_INCREF(statetokens);
+        n = PyList_GET_SIZE(statetokens);
+
+        pypos = PyLong_FromSsize_t(pos);
+        if (pypos == NULL) {
+            Py_DECREF(statetokens);
+            Py_DECREF(tokendefs);
+            return -1;
+        }
+
+        for (i = 0;i < n;++i) {
+            rule = PyList_GET_ITEM(statetokens,i);
+            if (!PyTuple_Check(rule) || PyTuple_GET_SIZE(rule) != 3) {
+                PyErr_SetString(PyExc_TypeError,"unexpected token definition");
+                break;
+            }
+
+            if (stats != NULL) {
+                start = monotonic_time();
+            }
+
+            /* Try the regex engine first. Only rules that emit a single token
+             * are applied natively; others need a Python match object, so the
+             * rule is matched again with Python.
+             */
+            result = (rules != NULL) ? regex_engine_match(ctx->engine,rules,i,text,pos,&end) : -1;
+            if (result == 1 && Py_TYPE(PyTuple_GET_ITEM(rule,1)) == (PyTypeObject*)ctx->type_TokenType) {
+                native = 1;
+            }
+            else if (result == 0) {
+                match = Py_None;
+                Py_INCREF(match);
+            }
+            else {
+                match = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(rule,0),text,pypos,NULL);
+            }
+
+            if (stats != NULL && i < stats_count) {
+                stats[i].attempts += 1;
+                stats[i].time += monotonic_time() - start;
+                if (native || (match != NULL && match != Py_None)) {
+                    stats[i].matches += 1;
+                }
+            }
+
+            if (native || match == NULL || match != Py_None) {
+                break;
+            }
+
+            Py_DECREF(match);
+            match = NULL;
+        }
+        Py_DECREF(pypos);
+
+        if (PyErr_Occurred()) {
+            Py_XDECREF(match);
+            Py_DECREF(statetokens);
+            Py_DECREF(tokendefs);
+            return -1;
+        }
+
+        if (match != NULL || native) {
+            int changed = (PyTuple_GET_ITEM(rule,2) != Py_None);
+
+            if (stats != NULL) {
+                start = monotonic_time();
+            }
+
+            Py_INCREF(rule);
+            if (native) {
+                result = apply_rule_native(rule,text,&pos,end,stack,tokens);
+            }
+            else {
+                result = apply_rule(ctx,lexer,rule,match,&pos,stack,tokens);
+            }
+            Py_DECREF(rule);
+
+            /* The time spent in the rule's action is charged to the rule. */
+            if (stats != NULL && i < stats_count) {
+                stats[i].time += monotonic_time() - start;
+            }
+            Py_XDECREF(match);
+            Py_DECREF(statetokens);
+            if (result == -1) {
+                Py_DECREF(tokendefs);
+                return -1;
+            }
+
+            if (changed) {
+                statetokens = lookup_state(tokendefs,stack);
+                if (statetokens == NULL) {
+                    Py_DECREF(tokendefs);
+                    return -1;
+                }
+                stats = profile_state(profiler,lexer,stack,statetokens,&stats_count);
+                rules = engine_state(ctx,state,lexer,statetokens);
+            }
+
+            continue;
+        }
+        Py_DECREF(statetokens);
+
+        /* We are here only if all state tokens have been considered and there
+         * was not a match on any of them.
+         */
+        if (pos >= len) {
+            break;
+        }
+
+        ch = PyUnicode_READ_CHAR(text,pos);
+        if (ch == '\n') {
+            /* At EOL, reset state to 'root'. */
+            if (PyList_SetSlice(stack,0,PyList_GET_SIZE(stack),NULL) == -1
+                || push_state(stack,ctx->str_root) == -1)
+            {
+                Py_DECREF(tokendefs);
+                return -1;
+            }
+
+            statetokens = lookup_state(tokendefs,stack);
+            if (statetokens == NULL) {
+                Py_DECREF(tokendefs);
+                return -1;
+            }
+            stats = profile_state(profiler,lexer,stack,statetokens,&stats_count);
+            rules = engine_state(ctx,state,lexer,statetokens);
+
+            result = append_token(tokens,pos,ctx->token_Whitespace,ctx->str_newline);
+        }
+        else {
+            PyObject* value = PyUnicode_Substring(text,pos,pos+1);
+            if (value == NULL) {
+                Py_DECREF(tokendefs);
+                return -1;
+            }
+
+            result = append_token(tokens,pos,ctx->token_Error,value);
+            Py_DECREF(value);
+        }
+
+        if (result == -1) {
+            Py_DECREF(tokendefs);
+            return -1;
+        }
+
+        pos += 1;
+    }
+
+    Py_DECREF(tokendefs);
+    state->pos = pos;
+
+    return 0;
+}
+
+/* Implements the replacement get_tokens_unprocessed() method. The bound 'self'
+ * is the list of tokens to replay.
+ */
+static PyObject* replay_tokens(PyObject* self,PyObject* args)
+{
+    return PyObject_GetIter(self);
+}
+
+static PyMethodDef replay_tokens_def = {
+    "get_tokens_unprocessed",
+    replay_tokens,
+    METH_VARARGS,
+    NULL
+};
+
+int regex_lexer_replay(PyObject* lexer,PyObject* tokens)
+{
+    int result;
+    PyObject* func;
+
+    func = PyCFunction_New(&replay_tokens_def,tokens);
+    if (func == NULL) {
+        return -1;
+    }
+
+    result = PyObject_SetAttrString(lexer,"get_tokens_unprocessed",func);
+    Py_DECREF(func);
+
+    return result;
+}
@@ -0,0 +1,77 @@
+/*
+ * lexer.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef LEXER_H
+#define LEXER_H
+
+#include "highlight.h"
+#include "profile.h"
+#include "engine.h"
+
+/*
+ * regex_state
+ *
+ * Represents the state of a RegexLexer between two tokens: the position in
+ * the text and the stack of lexer states. This is all the state that the
+ * RegexLexer.get_tokens_unprocessed() loop carries from one token to the next.
+ */
+
+struct regex_state
+{
+    /* The position in the text at which lexing continues. */
+    Py_ssize_t pos;
+
+    /* A list of state names. The last element is the current state. */
+    PyObject* stack;
+
+    /* If non-zero, then rules are matched with the context's regex engine where
+     * possible (see engine.h). This is assigned by the caller.
+     */
+    int engine;
+};
+
+/* Initializes the state to the start of the text in the 'root' state. */
+int regex_state_init(struct regex_state* state,Py_ssize_t pos);
+
+/* Frees the state's members. */
+void regex_state_free(struct regex_state* state);
+
+/* Determines if the state is at the specified position in the 'root' state. */
+int regex_state_is_root(const struct regex_state* state,Py_ssize_t pos);
+
+/* Determines if the context's regex engine can be used to lex the text. */
+int regex_lexer_engine(const struct pygments_context* ctx,PyObject* text);
+
+/* Determines if the lexer can be run by regex_lexer_run(). This is the case for
+ * RegexLexer subclasses that do not override get_tokens_unprocessed().
+ */
+int regex_lexer_check(const struct pygments_context* ctx,PyObject* lexer);
+
+/* Runs the RegexLexer state machine on the text, starting from the specified
+ * state. Each token is appended to the 'tokens' list as an (index, tokentype,
+ * value) tuple, exactly as it would be produced by get_tokens_unprocessed().
+ * Lexing stops at the first token boundary at or after 'stop', or at the end of
+ * the text if 'stop' is negative. The state is updated to reflect where lexing
+ * stopped.
+ *
+ * If 'checkpoints' is not NULL, then a (position, token count) tuple is appended
+ * to it each time the lexer is at the start of a line in the 'root' state.
+ *
+ * If the context's profiler is active, then statistics are recorded for each
+ * rule that is tried.
+ */
+int regex_lexer_run(const struct pygments_context* ctx,PyObject* lexer,PyObject* text,
+    struct regex_state* state,Py_ssize_t stop,PyObject* tokens,PyObject* checkpoints);
+
+/* Replaces the lexer's get_tokens_unprocessed() method on the instance with one
+ * that replays the specified list of (index, tokentype, value) tuples. The
+ * lexer's get_tokens() preprocessing and filters still apply.
+ */
+int regex_lexer_replay(PyObject* lexer,PyObject* tokens);
+
+#endif
@@ -0,0 +1,538 @@
+/*
+ * parallel.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "parallel.h"
+#include "lexer.h"
+#include <marshal.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * chunk
+ *
+ * Tracks a region of the input and the worker process that lexes it.
+ */
+
+struct chunk
+{
+    Py_ssize_t start;
+    Py_ssize_t stop;
+
+    pid_t pid;
+    int fd;
+};
+
+pid_t pygments_fork(void)
+{
+    pid_t pid;
+
+    PyOS_BeforeFork();
+    pid = fork();
+    if (pid == 0) {
+        PyOS_AfterFork_Child();
+    }
+    else {
+        PyOS_AfterFork_Parent();
+    }
+
+    return pid;
+}
+
+static int write_all(int fd,const char* buf,size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd,buf,size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        buf += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* Reads exactly 'size' bytes, giving up at the deadline unless it is zero. */
+static int read_all(int fd,char* buf,size_t size,double deadline)
+{
+    while (size > 0) {
+        ssize_t n;
+        int timeout = -1;
+        struct pollfd pfd;
+
+        if (deadline > 0) {
+            double remaining = deadline - monotonic_time();
+            if (remaining <= 0) {
+                return -1;
+            }
+            timeout = (int)(remaining * 1000) + 1;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        n = poll(&pfd,1,timeout);
+        if (n < 0 && errno != EINTR) {
+            return -1;
+        }
+        if (n <= 0) {
+            continue;
+        }
+
+        n = read(fd,buf,size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return -1;
+        }
+
+        buf += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+/* Lexes a chunk in a worker process and writes the result to the pipe. The
+ * result is a marshaled (tokens, pos, stack, checkpoints) tuple. Token types are
+ * sent as plain tuples since marshal does not support the token type class.
+ */
+static void run_chunk(const struct pygments_context* ctx,PyObject* lexer,PyObject* text,
+    const struct chunk* chunk,int fd)
+{
+    Py_ssize_t i;
+    uint64_t size;
+    struct regex_state state;
+    PyObject* tokens;
+    PyObject* checkpoints;
+    PyObject* result;
+    PyObject* bytes;
+
+    tokens = PyList_New(0);
+    checkpoints = PyList_New(0);
+    if (tokens == NULL || checkpoints == NULL || regex_state_init(&state,chunk->start) == -1) {
+        _exit(1);
+    }
+    state.engine = regex_lexer_engine(ctx,text);
+
+    if (regex_lexer_run(ctx,lexer,text,&state,chunk->stop,tokens,checkpoints) == -1) {
+        _exit(1);
+    }
+
+    for (i = 0;i < PyList_GET_SIZE(tokens);++i) {
+        PyObject* token = PyList_GET_ITEM(tokens,i);
+        PyObject* ttype;
+        PyObject* plain;
+
+        if (!PyTuple_Check(token) || PyTuple_GET_SIZE(token) != 3) {
+            _exit(1);
+        }
+
+        ttype = PyTuple_GET_ITEM(token,1);
+        plain = PySequence_Tuple(ttype);
+        if (plain == NULL) {
+            _exit(1);
+        }
+
+        plain = Py_BuildValue("(ONO)",PyTuple_GET_ITEM(token,0),plain,PyTuple_GET_ITEM(token,2));
+        if (plain == NULL) {
+            _exit(1);
+        }
+
+        PyList_SetItem(tokens,i,plain);
+    }
+
+    result = Py_BuildValue("(NnNN)",tokens,state.pos,state.stack,checkpoints);
+    if (result == NULL) {
+        _exit(1);
+    }
+
+    bytes = PyMarshal_WriteObjectToString(result,Py_MARSHAL_VERSION);
+    if (bytes == NULL) {
+        _exit(1);
+    }
+
+    size = (uint64_t)PyBytes_GET_SIZE(bytes);
+    if (write_all(fd,(const char*)&size,sizeof(size)) == -1
+        || write_all(fd,PyBytes_AS_STRING(bytes),PyBytes_GET_SIZE(bytes)) == -1)
+    {
+        _exit(1);
+    }
+
+    _exit(0);
+}
+
+static void start_chunk(const struct pygments_context* ctx,PyObject* lexer,PyObject* text,
+    struct chunk* chunk)
+{
+    int fds[2];
+
+    chunk->pid = -1;
+    chunk->fd = -1;
+
+    if (pipe(fds) == -1) {
+        return;
+    }
+
+    chunk->pid = pygments_fork();
+    if (chunk->pid == 0) {
+        close(fds[0]);
+        run_chunk(ctx,lexer,text,chunk,fds[1]);
+    }
+
+    close(fds[1]);
+    if (chunk->pid < 0) {
+        close(fds[0]);
+        return;
+    }
+
+    chunk->fd = fds[0];
+}
+
+/* Closes the pipe and reaps the worker. The worker is killed first since it
+ * may still be running (or may hang before exiting after sending its result).
+ */
+static void finish_chunk(struct chunk* chunk)
+{
+    if (chunk->fd >= 0) {
+        close(chunk->fd);
+        chunk->fd = -1;
+    }
+
+    if (chunk->pid > 0) {
+        kill(chunk->pid,SIGKILL);
+
+        while (waitpid(chunk->pid,NULL,0) == -1 && errno == EINTR);
+        chunk->pid = -1;
+    }
+}
+
+/* Converts a plain tuple back into a token type. */
+static PyObject* resolve_ttype(const struct pygments_context* ctx,PyObject* cache,PyObject* plain)
+{
+    Py_ssize_t i;
+    PyObject* ttype;
+
+    ttype = PyDict_GetItemWithError(cache,plain);
+    if (ttype != NULL) {
+        Py_INCREF(ttype);
+        return ttype;
+    }
+
+    if (PyErr_Occurred() || !PyTuple_Check(plain)) {
+        return NULL;
+    }
+
+    ttype = ctx->token_Token;
+    Py_INCREF(ttype);
+    for (i = 0;i < PyTuple_GET_SIZE(plain);++i) {
+        PyObject* next = PyObject_GetAttr(ttype,PyTuple_GET_ITEM(plain,i));
+        Py_DECREF(ttype);
+        if (next == NULL) {
+            return NULL;
+        }
+
+        ttype = next;
+    }
+
+    if (PyDict_SetItem(cache,plain,ttype) == -1) {
+        Py_DECREF(ttype);
+        return NULL;
+    }
+
+    return ttype;
+}
+
+/* Reads the marshaled result of a worker. Returns NULL if the worker failed
+ * or did not respond by the deadline.
+ */
+static PyObject* read_chunk(struct chunk* chunk,double deadline)
+{
+    int status;
+    uint64_t size;
+    char* buf;
+    PyObject* result;
+
+    /* Let other threads run Python code while waiting for the worker. */
+    Py_BEGIN_ALLOW_THREADS
+    status = read_all(chunk->fd,(char*)&size,sizeof(size),deadline);
+    Py_END_ALLOW_THREADS
+    if (status == -1) {
+        return NULL;
+    }
+
+    buf = malloc(size > 0 ? size : 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    status = read_all(chunk->fd,buf,size,deadline);
+    Py_END_ALLOW_THREADS
+    if (status == -1) {
+        free(buf);
+        return NULL;
+    }
+
+    result = PyMarshal_ReadObjectFromString(buf,(Py_ssize_t)size);
+    free(buf);
+
+    return result;
+}
+
+/* Appends the worker's tokens starting at the specified index. */
+static int splice_tokens(const struct pygments_context* ctx,PyObject* chunk_tokens,
+    Py_ssize_t index,PyObject* cache,PyObject* tokens)
+{
+    Py_ssize_t i;
+
+    for (i = index;i < PyList_GET_SIZE(chunk_tokens);++i) {
+        int status;
+        PyObject* token = PyList_GET_ITEM(chunk_tokens,i);
+        PyObject* ttype;
+
+        if (!PyTuple_Check(token) || PyTuple_GET_SIZE(token) != 3) {
+            PyErr_SetString(PyExc_ValueError,"bad token from worker");
+            return -1;
+        }
+
+        ttype = resolve_ttype(ctx,cache,PyTuple_GET_ITEM(token,1));
+        if (ttype == NULL) {
+            return -1;
+        }
+
+        token = Py_BuildValue("(ONO)",PyTuple_GET_ITEM(token,0),ttype,PyTuple_GET_ITEM(token,2));
+        if (token == NULL) {
+            return -1;
+        }
+
+        status = PyList_Append(tokens,token);
+        Py_DECREF(token);
+        if (status == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Lexes the chunk using the worker's result where possible. The worker lexed
+ * the chunk starting from the 'root' state and recorded a checkpoint at each
+ * line where it was in the 'root' state. We lex serially until we arrive at one
+ * of these checkpoints in the 'root' state, at which point the remainder of the
+ * worker's tokens are identical to what we would produce.
+ */
+static int collect_chunk(const struct pygments_context* ctx,PyObject* lexer,PyObject* text,
+    struct chunk* chunk,PyObject* cache,struct regex_state* state,PyObject* tokens,
+    double deadline)
+{
+    Py_ssize_t i;
+    Py_ssize_t pos;
+    PyObject* result;
+    PyObject* chunk_tokens;
+    PyObject* stack;
+    PyObject* checkpoints;
+
+    result = read_chunk(chunk,deadline);
+    if (result == NULL) {
+        PyErr_Clear();
+        return regex_lexer_run(ctx,lexer,text,state,chunk->stop,tokens,NULL);
+    }
+
+    if (!PyArg_ParseTuple(result,"O!nO!O!",&PyList_Type,&chunk_tokens,&pos,
+            &PyList_Type,&stack,&PyList_Type,&checkpoints))
+    {
+        Py_DECREF(result);
+        return -1;
+    }
+
+    for (i = 0;i < PyList_GET_SIZE(checkpoints);++i) {
+        Py_ssize_t at;
+        Py_ssize_t index;
+
+        if (!PyArg_ParseTuple(PyList_GET_ITEM(checkpoints,i),"nn",&at,&index)) {
+            Py_DECREF(result);
+            return -1;
+        }
+
+        if (at < state->pos) {
+            continue;
+        }
+
+        if (state->pos < at
+            && regex_lexer_run(ctx,lexer,text,state,at,tokens,NULL) == -1)
+        {
+            Py_DECREF(result);
+            return -1;
+        }
+
+        if (regex_state_is_root(state,at)) {
+            if (splice_tokens(ctx,chunk_tokens,index,cache,tokens) == -1) {
+                Py_DECREF(result);
+                return -1;
+            }
+
+            Py_INCREF(stack);
+            Py_DECREF(state->stack);
+            state->stack = stack;
+            state->pos = pos;
+            Py_DECREF(result);
+
+            return 0;
+        }
+    }
+
+    Py_DECREF(result);
+
+    /* The lexer never synchronized with the worker. */
+    if (chunk->stop >= 0 && state->pos >= chunk->stop) {
+        return 0;
+    }
+
+    return regex_lexer_run(ctx,lexer,text,state,chunk->stop,tokens,NULL);
+}
+
+int parallel_lex(const struct pygments_context* ctx,PyObject* lexer,PyObject* code)
+{
+    int i;
+    int j;
+    int n;
+    int result;
+    double deadline = 0;
+    Py_ssize_t len;
+    struct chunk* chunks;
+    struct regex_state state;
+    PyObject* text;
+    PyObject* tokens;
+    PyObject* cache;
+
+    n = ctx->paropts.workers;
+    if (n < 2 || !regex_lexer_check(ctx,lexer)) {
+        return 0;
+    }
+
+    /* Apply the same preprocessing that get_tokens() applies so that positions
+     * are consistent with what the lexer sees when highlighting.
+     */
+    text = PyObject_CallMethod(lexer,"_preprocess_lexer_input","O",code);
+    if (text == NULL || !PyUnicode_Check(text)) {
+        PyErr_Clear();
+        Py_XDECREF(text);
+        return 0;
+    }
+
+    /* Split the text into chunks that start at the beginning of a line. */
+    chunks = calloc(n,sizeof(struct chunk));
+    if (chunks == NULL) {
+        Py_DECREF(text);
+        return -1;
+    }
+
+    len = PyUnicode_GET_LENGTH(text);
+    for (i = 0;i < n;++i) {
+        chunks[i].pid = -1;
+        chunks[i].fd = -1;
+        chunks[i].stop = -1;
+
+        if (i > 0) {
+            Py_ssize_t at = PyUnicode_FindChar(text,'\n',(len / n) * i,len,1);
+            chunks[i].start = (at < 0) ? len : at + 1;
+            if (chunks[i].start < chunks[i-1].start) {
+                chunks[i].start = chunks[i-1].start;
+            }
+            chunks[i-1].stop = chunks[i].start;
+        }
+    }
+
+    /* Workers lex every chunk but the first, which is lexed by this process
+     * while the workers run.
+     */
+    if (ctx->paropts.timeout > 0) {
+        deadline = monotonic_time() + ctx->paropts.timeout;
+    }
+    for (i = 1;i < n;++i) {
+        if (chunks[i].start < len) {
+            start_chunk(ctx,lexer,text,chunks + i);
+        }
+    }
+
+    result = -1;
+    tokens = PyList_New(0);
+    cache = PyDict_New();
+    if (tokens == NULL || cache == NULL || regex_state_init(&state,0) == -1) {
+        Py_XDECREF(tokens);
+        Py_XDECREF(cache);
+        for (i = 1;i < n;++i) {
+            finish_chunk(chunks + i);
+        }
+        free(chunks);
+        Py_DECREF(text);
+        return -1;
+    }
+    state.engine = regex_lexer_engine(ctx,text);
+
+    for (i = 0;i < n;++i) {
+        struct chunk* chunk = chunks + i;
+
+        if (chunk->fd >= 0) {
+            if (collect_chunk(ctx,lexer,text,chunk,cache,&state,tokens,deadline) == -1) {
+                break;
+            }
+
+            finish_chunk(chunk);
+
+            /* Once the deadline has passed, kill the remaining workers so that
+             * their chunks are lexed serially instead of waited on.
+             */
+            if (deadline > 0 && monotonic_time() >= deadline) {
+                for (j = i + 1;j < n;++j) {
+                    finish_chunk(chunks + j);
+                }
+            }
+            continue;
+        }
+
+        if (chunk->stop >= 0 && state.pos >= chunk->stop) {
+            continue;
+        }
+
+        if (regex_lexer_run(ctx,lexer,text,&state,chunk->stop,tokens,NULL) == -1) {
+            break;
+        }
+    }
+
+    if (i == n) {
+        result = regex_lexer_replay(lexer,tokens) == 0 ? 1 : -1;
+    }
+
+    for (i = 1;i < n;++i) {
+        finish_chunk(chunks + i);
+    }
+
+    regex_state_free(&state);
+    Py_DECREF(cache);
+    Py_DECREF(tokens);
+    free(chunks);
+    Py_DECREF(text);
+
+    return result;
+}
@@ -0,0 +1,36 @@
+/*
+ * parallel.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include "highlight.h"
+#include <sys/types.h>
+
+/* Forks the process. This notifies the embedded interpreter before and after
+ * the fork so that its internal state remains consistent in both processes.
+ */
+pid_t pygments_fork(void);
+
+/*
+ * Lexes the code in parallel using the context's parallel options. The input is
+ * split into chunks at line boundaries, and each chunk (except the first) is
+ * lexed by a forked worker process starting from the 'root' state. The results
+ * are stitched together in order. A chunk is only accepted if the lexer reached
+ * the chunk's starting position in the 'root' state; otherwise it is lexed again
+ * from the actual state. This guarantees that the tokens are identical to those
+ * produced when lexing serially. Workers that have not finished by the context's
+ * timeout are killed and their chunks are lexed serially instead.
+ *
+ * On success, the lexer is set up to replay the tokens when highlighted and 1
+ * is returned. If the lexer or input is not suitable for parallel lexing, then
+ * 0 is returned and the lexer is not modified.
+ */
+int parallel_lex(const struct pygments_context* ctx,PyObject* lexer,PyObject* code);
+
+#endif
@@ -0,0 +1,237 @@
+/*
+ * preview.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "preview.h"
+
+typedef struct
+{
+    PyObject_HEAD
+    PyObject* source;
+
+    /* Limits and the amounts consumed so far */
+    long max_lines;
+    long max_bytes;
+    long lines;
+    long bytes;
+
+    /* Set once a limit is reached. */
+    int done;
+    int truncated;
+} PreviewObject;
+
+static inline int utf8_length(Py_UCS4 ch)
+{
+    if (ch < 0x80) {
+        return 1;
+    }
+    if (ch < 0x800) {
+        return 2;
+    }
+    if (ch < 0x10000) {
+        return 3;
+    }
+
+    return 4;
+}
+
+/* Scans text against the limits, updating the consumed amounts. Returns the
+ * number of characters that fit if a limit was reached or -1 otherwise.
+ */
+static Py_ssize_t scan_text(PyObject* text,long max_lines,long max_bytes,
+    long* lines,long* bytes)
+{
+    Py_ssize_t i;
+    Py_ssize_t len = PyUnicode_GET_LENGTH(text);
+    int kind = PyUnicode_KIND(text);
+    const void* data = PyUnicode_DATA(text);
+
+    /* Fast path: ASCII text that fits entirely within the byte limit. */
+    if (max_lines <= 0) {
+        if (max_bytes <= 0) {
+            return -1;
+        }
+
+        if (PyUnicode_IS_ASCII(text) && *bytes + len <= max_bytes) {
+            *bytes += len;
+            return -1;
+        }
+    }
+
+    for (i = 0;i < len;++i) {
+        Py_UCS4 ch = PyUnicode_READ(kind,data,i);
+
+        if (max_bytes > 0) {
+            int n = utf8_length(ch);
+
+            if (*bytes + n > max_bytes) {
+                return i;
+            }
+            *bytes += n;
+        }
+
+        if (ch == '\n' && max_lines > 0 && ++*lines >= max_lines) {
+            return i + 1;
+        }
+    }
+
+    return -1;
+}
+
+static PyObject* preview_next(PreviewObject* self)
+{
+    Py_ssize_t cut;
+    PyObject* token;
+    PyObject* value;
+    PyObject* part;
+    PyObject* result;
+
+    if (self->done || self->source == NULL) {
+        return NULL;
+    }
+
+    token = PyIter_Next(self->source);
+    if (token == NULL) {
+        return NULL;
+    }
+
+    if (!PyTuple_Check(token) || PyTuple_GET_SIZE(token) != 2
+        || !PyUnicode_Check(PyTuple_GET_ITEM(token,1)))
+    {
+        return token;
+    }
+
+    value = PyTuple_GET_ITEM(token,1);
+    cut = scan_text(value,self->max_lines,self->max_bytes,&self->lines,&self->bytes);
+    if (cut < 0) {
+        return token;
+    }
+
+    /* A limit was reached. The output is truncated if anything remains. */
+    self->done = 1;
+    if (cut < PyUnicode_GET_LENGTH(value)) {
+        self->truncated = 1;
+    }
+    else {
+        PyObject* next = PyIter_Next(self->source);
+
+        if (next != NULL) {
+            self->truncated = 1;
+            Py_DECREF(next);
+        }
+        else if (PyErr_Occurred()) {
+            /* Errors past the limit do not affect the output. */
+            PyErr_Clear();
+        }
+    }
+
+    /* Release the underlying stream so that lexing stops here. */
+    Py_CLEAR(self->source);
+
+    if (cut == 0) {
+        Py_DECREF(token);
+        return NULL;
+    }
+
+    if (cut == PyUnicode_GET_LENGTH(value)) {
+        return token;
+    }
+
+    part = PyUnicode_Substring(value,0,cut);
+    if (part == NULL) {
+        Py_DECREF(token);
+        return NULL;
+    }
+
+    result = PyTuple_Pack(2,PyTuple_GET_ITEM(token,0),part);
+    Py_DECREF(part);
+    Py_DECREF(token);
+
+    return result;
+}
+
+static void preview_dealloc(PreviewObject* self)
+{
+    Py_XDECREF(self->source);
+    PyObject_Free(self);
+}
+
+static PyTypeObject PreviewType = {
+    PyVarObject_HEAD_INIT(NULL,0)
+    .tp_name = "pygments_ext.PreviewIterator",
+    .tp_basicsize = sizeof(PreviewObject),
+    .tp_dealloc = (destructor)preview_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_iter = PyObject_SelfIter,
+    .tp_iternext = (iternextfunc)preview_next
+};
+
+int preview_enabled(const struct preview_options* opts)
+{
+    return opts->max_lines > 0 || opts->max_bytes > 0;
+}
+
+Py_ssize_t preview_prefix_length(PyObject* text,const struct preview_options* opts)
+{
+    long lines = 0;
+    long bytes = 0;
+    Py_ssize_t cut;
+
+    cut = scan_text(text,opts->max_lines,opts->max_bytes,&lines,&bytes);
+    if (cut < 0) {
+        return PyUnicode_GET_LENGTH(text);
+    }
+
+    return cut;
+}
+
+int preview_type_ready(void)
+{
+    if (!(PreviewType.tp_flags & Py_TPFLAGS_READY) && PyType_Ready(&PreviewType) == -1) {
+        return -1;
+    }
+
+    return 0;
+}
+
+PyObject* preview_token_stream(PyObject* stream,const struct preview_options* opts)
+{
+    PreviewObject* preview;
+
+    if (preview_type_ready() == -1) {
+        return NULL;
+    }
+
+    preview = PyObject_New(PreviewObject,&PreviewType);
+    if (preview == NULL) {
+        return NULL;
+    }
+
+    preview->source = PyObject_GetIter(stream);
+    if (preview->source == NULL) {
+        Py_DECREF(preview);
+        return NULL;
+    }
+
+    preview->max_lines = opts->max_lines;
+    preview->max_bytes = opts->max_bytes;
+    preview->lines = 0;
+    preview->bytes = 0;
+    preview->done = 0;
+    preview->truncated = 0;
+
+    return (PyObject*)preview;
+}
+
+int preview_truncated(PyObject* stream)
+{
+    if (Py_TYPE(stream) != &PreviewType) {
+        return 0;
+    }
+
+    return ((PreviewObject*)stream)->truncated;
+}
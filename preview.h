@@ -0,0 +1,53 @@
+/*
+ * preview.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <Python.h>
+
+/*
+ * preview_options
+ *
+ * Limits how much of the input is highlighted. A limit of zero means no limit.
+ */
+
+struct preview_options
+{
+    /* The maximum number of lines to highlight. */
+    long max_lines;
+
+    /* The maximum number of bytes (of UTF-8 encoded source code) to highlight. */
+    long max_bytes;
+};
+
+/* Determines if any preview limit is set. */
+int preview_enabled(const struct preview_options* opts);
+
+/* Gets the length (in characters) of the prefix of 'text' that falls within the
+ * preview limits.
+ */
+Py_ssize_t preview_prefix_length(PyObject* text,const struct preview_options* opts);
+
+/* Wraps a token stream so that iteration stops once the preview limits are
+ * reached. The token that reaches a limit is cut short; tokens after it are
+ * never requested from the underlying stream.
+ */
+PyObject* preview_token_stream(PyObject* stream,const struct preview_options* opts);
+
+/* Determines if a stream returned by preview_token_stream() was cut short. This
+ * is only meaningful after the stream is exhausted.
+ */
+int preview_truncated(PyObject* stream);
+
+/* Prepares the preview stream type. This is called when a context is created
+ * so that the type is ready before any thread wraps a stream.
+ */
+int preview_type_ready(void);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * profile.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "profile.h"
+#include <stdio.h>
+#include <string.h>
+
+int profiler_init(struct profiler* profiler)
+{
+    memset(profiler,0,sizeof(struct profiler));
+
+    profiler->data = PyDict_New();
+    if (profiler->data == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    return 0;
+}
+
+void profiler_free(struct profiler* profiler)
+{
+    Py_CLEAR(profiler->data);
+}
+
+int profiler_sample(struct profiler* profiler)
+{
+    if (profiler->rate <= 0 || profiler->data == NULL) {
+        return 0;
+    }
+
+    profiler->credit += profiler->rate;
+    if (profiler->credit < 1.0) {
+        return 0;
+    }
+
+    profiler->credit -= 1.0;
+    if (profiler->credit >= 1.0) {
+        profiler->credit = 0;
+    }
+
+    return 1;
+}
+
+struct rule_stats* profiler_rules(struct profiler* profiler,PyObject* lexer_class,
+    PyObject* state,Py_ssize_t n)
+{
+    Py_ssize_t size;
+    PyObject* key;
+    PyObject* entry;
+
+    key = PyTuple_Pack(2,lexer_class,state);
+    if (key == NULL) {
+        return NULL;
+    }
+
+    entry = PyDict_GetItemWithError(profiler->data,key);
+    if (entry == NULL) {
+        if (PyErr_Occurred()) {
+            Py_DECREF(key);
+            return NULL;
+        }
+
+        entry = PyByteArray_FromStringAndSize(NULL,0);
+        if (entry == NULL || PyDict_SetItem(profiler->data,key,entry) == -1) {
+            Py_XDECREF(entry);
+            Py_DECREF(key);
+            return NULL;
+        }
+        Py_DECREF(entry);
+    }
+    Py_DECREF(key);
+
+    /* The rules list can grow if a lexer modifies its token definitions. */
+    size = PyByteArray_GET_SIZE(entry);
+    if ((size_t)size < n * sizeof(struct rule_stats)) {
+        if (PyByteArray_Resize(entry,n * sizeof(struct rule_stats)) == -1) {
+            return NULL;
+        }
+
+        memset(PyByteArray_AS_STRING(entry) + size,0,n * sizeof(struct rule_stats) - size);
+    }
+
+    return (struct rule_stats*)PyByteArray_AS_STRING(entry);
+}
+
+/* Gets the pattern of a rule from the lexer class's token definitions. */
+static PyObject* rule_pattern(PyObject* lexer_class,PyObject* state,Py_ssize_t index)
+{
+    PyObject* tokendefs;
+    PyObject* rules;
+    PyObject* pattern = NULL;
+
+    tokendefs = PyObject_GetAttrString(lexer_class,"_tokens");
+    if (tokendefs == NULL) {
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    }
+
+    rules = PyDict_Check(tokendefs) ? PyDict_GetItem(tokendefs,state) : NULL;
+    if (rules != NULL && PyList_Check(rules) && index < PyList_GET_SIZE(rules)) {
+        PyObject* rule = PyList_GET_ITEM(rules,index);
+
+        /* The first element is the bound match method of the compiled regex. */
+        if (PyTuple_Check(rule) && PyTuple_GET_SIZE(rule) > 0) {
+            PyObject* regex = PyObject_GetAttrString(PyTuple_GET_ITEM(rule,0),"__self__");
+
+            if (regex != NULL) {
+                pattern = PyObject_GetAttrString(regex,"pattern");
+                Py_DECREF(regex);
+            }
+        }
+    }
+
+    Py_DECREF(tokendefs);
+    if (pattern == NULL) {
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    }
+
+    return pattern;
+}
+
+PyObject* profiler_report(struct profiler* profiler)
+{
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* entry;
+    PyObject* result;
+
+    result = PyList_New(0);
+    if (result == NULL || profiler->data == NULL) {
+        return result;
+    }
+
+    while (PyDict_Next(profiler->data,&pos,&key,&entry)) {
+        Py_ssize_t i;
+        Py_ssize_t n = PyByteArray_GET_SIZE(entry) / sizeof(struct rule_stats);
+        struct rule_stats* stats = (struct rule_stats*)PyByteArray_AS_STRING(entry);
+        PyObject* lexer_class = PyTuple_GET_ITEM(key,0);
+        PyObject* state = PyTuple_GET_ITEM(key,1);
+
+        for (i = 0;i < n;++i) {
+            int status;
+            PyObject* pattern;
+            PyObject* item;
+
+            if (stats[i].attempts == 0) {
+                continue;
+            }
+
+            pattern = rule_pattern(lexer_class,state,i);
+            if (pattern == NULL) {
+                Py_DECREF(result);
+                return NULL;
+            }
+
+            item = Py_BuildValue("(sOnNlld)",((PyTypeObject*)lexer_class)->tp_name,state,i,
+                pattern,stats[i].attempts,stats[i].matches,stats[i].time);
+            if (item == NULL) {
+                Py_DECREF(result);
+                return NULL;
+            }
+
+            status = PyList_Append(result,item);
+            Py_DECREF(item);
+            if (status == -1) {
+                Py_DECREF(result);
+                return NULL;
+            }
+        }
+    }
+
+    return result;
+}
+
+/* Writes a frame name, replacing characters that are special to the collapsed
+ * stack format.
+ */
+static void write_frame(FILE* fp,const char* name)
+{
+    for (;*name;++name) {
+        fputc((*name == ';' || *name == ' ' || *name == '\n') ? '_' : *name,fp);
+    }
+}
+
+int profiler_dump(struct profiler* profiler,const char* path)
+{
+    int result;
+    Py_ssize_t pos = 0;
+    PyObject* key;
+    PyObject* entry;
+    FILE* fp;
+
+    if (profiler->data == NULL) {
+        return -1;
+    }
+
+    fp = fopen(path,"w");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    while (PyDict_Next(profiler->data,&pos,&key,&entry)) {
+        Py_ssize_t i;
+        Py_ssize_t n = PyByteArray_GET_SIZE(entry) / sizeof(struct rule_stats);
+        struct rule_stats* stats = (struct rule_stats*)PyByteArray_AS_STRING(entry);
+        const char* state = PyUnicode_AsUTF8(PyTuple_GET_ITEM(key,1));
+
+        if (state == NULL) {
+            PyErr_Clear();
+            continue;
+        }
+
+        for (i = 0;i < n;++i) {
+            long usec = (long)(stats[i].time * 1e6);
+
+            if (usec <= 0) {
+                continue;
+            }
+
+            write_frame(fp,((PyTypeObject*)PyTuple_GET_ITEM(key,0))->tp_name);
+            fputc(';',fp);
+            write_frame(fp,state);
+            fprintf(fp,";#%ld %ld\n",(long)i,usec);
+        }
+    }
+
+    result = ferror(fp);
+    if (fclose(fp) != 0 || result != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void profiler_reset(struct profiler* profiler)
+{
+    profiler->samples = 0;
+    if (profiler->data != NULL) {
+        PyDict_Clear(profiler->data);
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * profile.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <Python.h>
+
+/*
+ * rule_stats
+ *
+ * Accumulates statistics for a single rule of a RegexLexer state.
+ */
+
+struct rule_stats
+{
+    /* The number of times the rule's regex was tried and the number of times
+     * it matched.
+     */
+    long attempts;
+    long matches;
+
+    /* The total time (in seconds) spent matching the rule and running its
+     * action.
+     */
+    double time;
+};
+
+/*
+ * profiler
+ *
+ * Implements a sampling profiler for the RegexLexer loop (see lexer.h). For a
+ * fraction of highlight() calls, the loop records statistics for each (lexer,
+ * state, rule index) that it runs.
+ */
+
+struct profiler
+{
+    /* The fraction of calls that are profiled. Profiling is disabled if this is
+     * not positive.
+     */
+    double rate;
+
+    /* Accumulates 'rate' for each call. A call is sampled each time this
+     * reaches one.
+     */
+    double credit;
+
+    /* Non-zero while a sampled call is running. */
+    int active;
+
+    /* The number of sampled calls. */
+    long samples;
+
+    /* Maps (lexer class, state name) tuples to a bytearray that stores a
+     * rule_stats array with an element for each rule in the state.
+     */
+    PyObject* data;
+};
+
+/* Initializes the profiler. Profiling is initially disabled. */
+int profiler_init(struct profiler* profiler);
+
+/* Frees the profiler's members. */
+void profiler_free(struct profiler* profiler);
+
+/* Determines if the next call should be profiled. */
+int profiler_sample(struct profiler* profiler);
+
+/* Gets the statistics array for a lexer state having 'n' rules. */
+struct rule_stats* profiler_rules(struct profiler* profiler,PyObject* lexer_class,
+    PyObject* state,Py_ssize_t n);
+
+/* Gets the aggregated statistics as a list of (lexer name, state name, rule
+ * index, pattern, attempts, matches, time) tuples.
+ */
+PyObject* profiler_report(struct profiler* profiler);
+
+/* Writes the aggregated statistics to the specified file in the collapsed
+ * stack format used by flame graph tools. Each line has the form
+ * "lexer;state;#index count", where count is the time in microseconds.
+ */
+int profiler_dump(struct profiler* profiler,const char* path);
+
+/* Discards all statistics. */
+void profiler_reset(struct profiler* profiler);
+
+#endif
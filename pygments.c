@@ -22,18 +22,50 @@ static PHP_RSHUTDOWN_FUNCTION(pygments);
 
 /* PHP userspace functions */
 static PHP_FUNCTION(pygments_highlight);
+static PHP_FUNCTION(pygments_highlight_compressed);
+static PHP_FUNCTION(pygments_highlight_multi);
+static PHP_FUNCTION(pygments_tokens);
+static PHP_FUNCTION(pygments_render_tree);
+static PHP_FUNCTION(pygments_highlight_document);
 static PHP_FUNCTION(pygments_set_options);
+static PHP_FUNCTION(pygments_gc_stats);
+static PHP_FUNCTION(pygments_memory_stats);
+static PHP_FUNCTION(pygments_profile);
+static PHP_FUNCTION(pygments_profile_dump);
+static PHP_FUNCTION(pygments_coalesce_stats);
+static PHP_FUNCTION(pygments_token_cache_stats);
 
 /* Function entries */
 static zend_function_entry php_pygments_functions[] = {
     PHP_FE(pygments_highlight,arginfo_pygments_highlight)
+    PHP_FE(pygments_highlight_compressed,arginfo_pygments_highlight_compressed)
+    PHP_FE(pygments_highlight_multi,arginfo_pygments_highlight_multi)
+    PHP_FE(pygments_tokens,arginfo_pygments_tokens)
+    PHP_FE(pygments_render_tree,arginfo_pygments_render_tree)
+    PHP_FE(pygments_highlight_document,arginfo_pygments_highlight_document)
     PHP_FE(pygments_set_options,arginfo_pygments_set_options)
+    PHP_FE(pygments_gc_stats,arginfo_pygments_gc_stats)
+    PHP_FE(pygments_memory_stats,arginfo_pygments_memory_stats)
+    PHP_FE(pygments_profile,arginfo_pygments_profile)
+    PHP_FE(pygments_profile_dump,arginfo_pygments_profile_dump)
+    PHP_FE(pygments_coalesce_stats,arginfo_pygments_coalesce_stats)
+    PHP_FE(pygments_token_cache_stats,arginfo_pygments_token_cache_stats)
     {NULL, NULL, NULL}
 };
 
+/* Module dependencies: the regex engine uses the PCRE2 library bundled with the
+ * pcre extension.
+ */
+static const zend_module_dep pygments_deps[] = {
+    ZEND_MOD_REQUIRED("pcre")
+    ZEND_MOD_END
+};
+
 /* Module entries */
 zend_module_entry pygments_module_entry = {
-    STANDARD_MODULE_HEADER,
+    STANDARD_MODULE_HEADER_EX,
+    NULL,
+    pygments_deps,
     PHP_PYGMENTS_EXTNAME,
     php_pygments_functions,
     PHP_MINIT(pygments),
@@ -52,22 +84,107 @@ ZEND_GET_MODULE(pygments)
 /* Define module globals. */
 ZEND_DECLARE_MODULE_GLOBALS(pygments);
 
+/* The table of in-flight highlight calls. This is created before the process
+ * forks any workers so that it is shared by all of them.
+ */
+static struct coalesce_table* coalesce_table = NULL;
+
+/* INI entries */
+PHP_INI_BEGIN()
+    STD_PHP_INI_BOOLEAN("pygments.gc_defer","0",PHP_INI_SYSTEM,OnUpdateBool,
+        gc_defer,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.gc_threshold0","700",PHP_INI_SYSTEM,OnUpdateLong,
+        gc_threshold0,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.gc_threshold1","10",PHP_INI_SYSTEM,OnUpdateLong,
+        gc_threshold1,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.gc_threshold2","10",PHP_INI_SYSTEM,OnUpdateLong,
+        gc_threshold2,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.snapshot","",PHP_INI_SYSTEM,OnUpdateString,
+        snapshot,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.parallel_workers","0",PHP_INI_SYSTEM,OnUpdateLong,
+        parallel_workers,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.parallel_min_size","1048576",PHP_INI_SYSTEM,OnUpdateLong,
+        parallel_min_size,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.parallel_timeout","30",PHP_INI_SYSTEM,OnUpdateReal,
+        parallel_timeout,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.profile_rate","0",PHP_INI_SYSTEM,OnUpdateReal,
+        profile_rate,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.profile_dump","",PHP_INI_SYSTEM,OnUpdateString,
+        profile_dump,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.engine","python",PHP_INI_SYSTEM,OnUpdateString,
+        engine,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.coalesce_size","0",PHP_INI_SYSTEM,OnUpdateLong,
+        coalesce_size,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.coalesce_slots","64",PHP_INI_SYSTEM,OnUpdateLong,
+        coalesce_slots,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.coalesce_timeout","5",PHP_INI_SYSTEM,OnUpdateReal,
+        coalesce_timeout,zend_pygments_globals,pygments_globals)
+    STD_PHP_INI_ENTRY("pygments.token_cache_size","0",PHP_INI_SYSTEM,OnUpdateLong,
+        token_cache_size,zend_pygments_globals,pygments_globals)
+PHP_INI_END()
+
+#ifdef ZTS
+/* The main thread's set of lexers tracked for the snapshot. The context of
+ * every other thread shares this set so that the snapshot written at shutdown
+ * includes the lexers used by all threads.
+ */
+static PyObject* snapshot_lexers = NULL;
+#endif
+
 static void php_pygments_globals_ctor(zend_pygments_globals* gbls)
 {
-    int result = pygments_context_init(&gbls->highlighter);
+    int result;
+
+#ifdef ZTS
+    /* Get a Python thread state for the PHP thread. This creates one unless the
+     * thread is the main thread, whose thread state was created when Python
+     * was initialized. It is kept until the globals are destroyed.
+     */
+    gbls->gstate = PyGILState_Ensure();
+#endif
 
+    result = pygments_context_init(&gbls->highlighter);
     if (result == -1) {
         php_error(E_WARNING,"pygments: fail pygments_context_init()");
     }
+
+#ifdef ZTS
+    if (result == 0 && snapshot_lexers != NULL) {
+        Py_INCREF(snapshot_lexers);
+        gbls->highlighter.snapshot_lexers = snapshot_lexers;
+    }
+
+    gbls->tstate = PyEval_SaveThread();
+#endif
 }
 
 static void php_pygments_globals_dtor(zend_pygments_globals* gbls)
 {
-    int result = pygments_context_close(&gbls->highlighter);
+    int result;
 
+#ifdef ZTS
+    /* The main thread's globals are destroyed by MSHUTDOWN before Python is
+     * finalized. Nothing is left to free for globals destroyed afterwards.
+     */
+    if (gbls->tstate == NULL || !Py_IsInitialized()) {
+        return;
+    }
+
+    PyEval_RestoreThread(gbls->tstate);
+    gbls->tstate = NULL;
+#endif
+
+    result = pygments_context_close(&gbls->highlighter);
     if (result == -1) {
         php_error(E_WARNING,"pygments: fail pygments_context_close()");
     }
+
+#ifdef ZTS
+    /* This deletes the thread state unless it belongs to the main thread, which
+     * stays attached so that Python can be finalized.
+     */
+    PyGILState_Release(gbls->gstate);
+#endif
 }
 
 /* Implementation of module/request functions */
@@ -94,6 +211,38 @@ PHP_MINIT_FUNCTION(pygments)
     php_pygments_globals_ctor(&pygments_globals);
 #endif
 
+    REGISTER_INI_ENTRIES();
+
+    /* Load the lexer snapshot if configured. This warms up the lexers that were
+     * used by a previous process.
+     */
+    if (PYGMENTS_G(snapshot) != NULL && *PYGMENTS_G(snapshot) != 0
+        && pygments_context_check(&PYGMENTS_G(highlighter)))
+    {
+        int result;
+
+        PYGMENTS_PYTHON_ENTER();
+        result = pygments_snapshot_load(&PYGMENTS_G(highlighter),PYGMENTS_G(snapshot));
+        PYGMENTS_PYTHON_LEAVE();
+        if (result == -1) {
+            php_error(E_WARNING,"pygments: fail to load snapshot '%s'",PYGMENTS_G(snapshot));
+        }
+
+#ifdef ZTS
+        snapshot_lexers = PYGMENTS_G(highlighter).snapshot_lexers;
+#endif
+    }
+
+    /* Create the table for coalescing identical calls if enabled. */
+    if (PYGMENTS_G(coalesce_size) > 0) {
+        coalesce_table = coalesce_create((size_t)PYGMENTS_G(coalesce_size),
+            (long)PYGMENTS_G(coalesce_slots),
+            PYGMENTS_G(coalesce_timeout));
+        if (coalesce_table == NULL) {
+            php_error(E_WARNING,"pygments: fail to create coalescing table");
+        }
+    }
+
     return SUCCESS;
 }
 
@@ -107,6 +256,11 @@ PHP_MINFO_FUNCTION(pygments)
         "embedded Python version",
         MAKE_VERSION(PY_MAJOR_VERSION,PY_MINOR_VERSION,PY_MICRO_VERSION)
         );
+#ifdef Py_GIL_DISABLED
+    php_info_print_table_row(2,"free-threaded Python","yes");
+#else
+    php_info_print_table_row(2,"free-threaded Python","no");
+#endif
     php_info_print_table_end();
 
     DISPLAY_INI_ENTRIES();
@@ -114,10 +268,45 @@ PHP_MINFO_FUNCTION(pygments)
 
 PHP_MSHUTDOWN_FUNCTION(pygments)
 {
-    /* Free globals if non-threaded build. Threaded PHP cleans up globals
-     * automatically. We must do this before shutting down python.
+    PYGMENTS_PYTHON_ENTER();
+
+    /* Write the lexer snapshot if any new lexers were used. */
+    if (PYGMENTS_G(snapshot) != NULL && *PYGMENTS_G(snapshot) != 0
+        && pygments_context_check(&PYGMENTS_G(highlighter)))
+    {
+        pygments_snapshot_save(&PYGMENTS_G(highlighter),PYGMENTS_G(snapshot));
+    }
+
+    /* Write the profile if any calls were sampled. Each process writes its own
+     * file.
      */
-#ifndef ZTS
+    if (PYGMENTS_G(profile_dump) != NULL && *PYGMENTS_G(profile_dump) != 0
+        && PYGMENTS_G(highlighter).profiler != NULL
+        && PYGMENTS_G(highlighter).profiler->samples > 0)
+    {
+        char path[MAXPATHLEN];
+
+        snprintf(path,sizeof(path),"%s.%ld",PYGMENTS_G(profile_dump),(long)getpid());
+        profiler_dump(PYGMENTS_G(highlighter).profiler,path);
+    }
+
+    PYGMENTS_PYTHON_LEAVE();
+
+    if (coalesce_table != NULL) {
+        coalesce_destroy(coalesce_table);
+        coalesce_table = NULL;
+    }
+
+    UNREGISTER_INI_ENTRIES();
+
+    /* Free globals before shutting down python. In threaded builds, these are
+     * the main thread's globals; the globals of other threads are freed as the
+     * threads exit.
+     */
+#ifdef ZTS
+    php_pygments_globals_dtor(TSRMG_BULK(pygments_globals_id,zend_pygments_globals*));
+    snapshot_lexers = NULL;
+#else
     php_pygments_globals_dtor(&pygments_globals);
 #endif
 
@@ -134,6 +323,39 @@ PHP_MSHUTDOWN_FUNCTION(pygments)
 
 PHP_RINIT_FUNCTION(pygments)
 {
+    struct pygments_context* ctx = &PYGMENTS_G(highlighter);
+
+    /* Apply the garbage collector settings to the context. */
+    ctx->gcopts.deferred = PYGMENTS_G(gc_defer);
+    ctx->gcopts.thresholds[0] = (long)PYGMENTS_G(gc_threshold0);
+    ctx->gcopts.thresholds[1] = (long)PYGMENTS_G(gc_threshold1);
+    ctx->gcopts.thresholds[2] = (long)PYGMENTS_G(gc_threshold2);
+
+    /* Apply the parallel lexing settings to the context. */
+    ctx->paropts.workers = (int)PYGMENTS_G(parallel_workers);
+    ctx->paropts.min_size = (long)PYGMENTS_G(parallel_min_size);
+    ctx->paropts.timeout = PYGMENTS_G(parallel_timeout);
+
+    /* Apply the profiler settings to the context. */
+    if (ctx->profiler != NULL) {
+        ctx->profiler->rate = PYGMENTS_G(profile_rate);
+    }
+
+    /* Select the regex engine. */
+    if (ctx->engine != NULL) {
+        ctx->engine->enabled = (PYGMENTS_G(engine) != NULL
+            && strcmp(PYGMENTS_G(engine),"pcre") == 0);
+#ifdef HAVE_PCRE_JIT_SUPPORT
+        ctx->engine->jit = PCRE_G(jit);
+#else
+        ctx->engine->jit = 0;
+#endif
+    }
+
+    /* Apply the token cache limit to the context. */
+    if (ctx->tokens != NULL) {
+        ctx->tokens->max_size = (long)PYGMENTS_G(token_cache_size);
+    }
 
     return SUCCESS;
 }
@@ -144,7 +366,19 @@ PHP_RSHUTDOWN_FUNCTION(pygments)
      * out with that same state.
      */
     if (pygments_context_check(&PYGMENTS_G(highlighter))) {
+        PYGMENTS_PYTHON_ENTER();
         pygments_context_set_default_options(&PYGMENTS_G(highlighter));
+
+        /* Run any garbage collection that was deferred during the request. By
+         * this point the script's output has been handed to the SAPI. Under
+         * PHP-FPM the response is only finished after RSHUTDOWN, so the
+         * collection still delays the response unless the script called
+         * fastcgi_finish_request().
+         */
+        if (PYGMENTS_G(highlighter).gcopts.deferred) {
+            pygments_context_collect(&PYGMENTS_G(highlighter));
+        }
+        PYGMENTS_PYTHON_LEAVE();
     }
 
     return SUCCESS;
@@ -152,7 +386,7 @@ PHP_RSHUTDOWN_FUNCTION(pygments)
 
 /* Implementation of userspace functions */
 
-/* {{{ proto string pygments_highlight(string code[, string lexer, string filename])
+/* {{{ proto string pygments_highlight(string code[, string lexer, string filename, bool &truncated])
    Syntax-highlights the specified code, applying any specified options */
 PHP_FUNCTION(pygments_highlight)
 {
@@ -162,8 +396,11 @@ PHP_FUNCTION(pygments_highlight)
     size_t preferredLexer_len = 0;
     char* filename = NULL;
     size_t filename_len = 0;
+    zval* ztruncated = NULL;
     struct lexer_options lxopts;
     struct highlight_result* result;
+    enum coalesce_result coalesced = COALESCE_BYPASS;
+    struct coalesce_ticket ticket;
 
     if (!pygments_context_check(&PYGMENTS_G(highlighter))) {
         zend_throw_exception(NULL,"Pygments library is not loaded",0);
@@ -172,13 +409,14 @@ PHP_FUNCTION(pygments_highlight)
 
     if (zend_parse_parameters(
             ZEND_NUM_ARGS(),
-            "s|s!s",
+            "s|s!s!z",
             &code,
             &code_len,
             &preferredLexer,
             &preferredLexer_len,
             &filename,
-            &filename_len) == FAILURE)
+            &filename_len,
+            &ztruncated) == FAILURE)
     {
         return;
     }
@@ -187,7 +425,36 @@ PHP_FUNCTION(pygments_highlight)
     lxopts.preferred_lexer = preferredLexer;
     lxopts.filename = filename;
 
+    /* Share the result with identical calls in other processes if enabled. */
+    if (coalesce_table != NULL) {
+        unsigned char key[16];
+        zend_string* html;
+        int truncated;
+
+        coalesce_key(key,&PYGMENTS_G(highlighter),code,code_len,&lxopts);
+        coalesced = coalesce_begin(coalesce_table,key,&ticket,&html,&truncated);
+        if (coalesced == COALESCE_HIT) {
+            if (ztruncated != NULL) {
+                ZEND_TRY_ASSIGN_REF_BOOL(ztruncated,truncated);
+            }
+
+            RETURN_STR(html);
+        }
+    }
+
+    PYGMENTS_PYTHON_ENTER();
     result = highlight(&PYGMENTS_G(highlighter),code,&lxopts);
+    PYGMENTS_PYTHON_LEAVE();
+
+    if (coalesced == COALESCE_OWNER) {
+        if (result != NULL) {
+            coalesce_finish(coalesce_table,&ticket,result->html,strlen(result->html),
+                result->truncated);
+        }
+        else {
+            coalesce_finish(coalesce_table,&ticket,NULL,0,0);
+        }
+    }
 
     if (result == NULL) {
         RETURN_FALSE;
@@ -195,8 +462,415 @@ PHP_FUNCTION(pygments_highlight)
         /* Control no longer in function. */
     }
 
+    if (ztruncated != NULL) {
+        ZEND_TRY_ASSIGN_REF_BOOL(ztruncated,result->truncated);
+    }
+
     RETVAL_STRING(result->html);
+
+    PYGMENTS_PYTHON_ENTER();
     highlight_result_free(result);
+    PYGMENTS_PYTHON_LEAVE();
+}
+/* }}} */
+
+/* {{{ proto string pygments_highlight_compressed(string code, string encoding[, string lexer, string filename, array &info])
+   Syntax-highlights the specified code, returning the output compressed with
+   the specified encoding ("gzip", "deflate" or "raw") */
+PHP_FUNCTION(pygments_highlight_compressed)
+{
+    char* code;
+    size_t code_len;
+    char* encoding;
+    size_t encoding_len;
+    char* preferredLexer = NULL;
+    size_t preferredLexer_len = 0;
+    char* filename = NULL;
+    size_t filename_len = 0;
+    zval* zinfo = NULL;
+    int result;
+    int truncated;
+    enum compress_encoding enc;
+    struct lexer_options lxopts;
+    struct compress_stream stream;
+
+    if (!pygments_context_check(&PYGMENTS_G(highlighter))) {
+        zend_throw_exception(NULL,"Pygments library is not loaded",0);
+        return;
+    }
+
+    if (zend_parse_parameters(
+            ZEND_NUM_ARGS(),
+            "ss|s!s!z",
+            &code,
+            &code_len,
+            &encoding,
+            &encoding_len,
+            &preferredLexer,
+            &preferredLexer_len,
+            &filename,
+            &filename_len,
+            &zinfo) == FAILURE)
+    {
+        return;
+    }
+
+    if (compress_encoding_parse(&enc,encoding) == -1) {
+        zend_argument_value_error(2,"must be one of \"gzip\", \"deflate\" or \"raw\"");
+        return;
+    }
+
+    /* Assign lexer options. May be NULL if not provided by the user. */
+    lxopts.preferred_lexer = preferredLexer;
+    lxopts.filename = filename;
+
+    if (compress_stream_init(&stream,enc) == -1) {
+        RETURN_FALSE;
+    }
+
+    PYGMENTS_PYTHON_ENTER();
+    result = highlight_compressed(&PYGMENTS_G(highlighter),code,&lxopts,&stream,&truncated);
+    PYGMENTS_PYTHON_LEAVE();
+    if (result == -1) {
+        compress_stream_free(&stream);
+        RETURN_FALSE;
+    }
+
+    /* Report what is needed to splice raw output into a larger stream. */
+    if (zinfo != NULL) {
+        zval info;
+
+        array_init(&info);
+        add_assoc_long(&info,"length",(zend_long)stream.length);
+        add_assoc_long(&info,"crc32",(zend_long)stream.crc);
+        add_assoc_long(&info,"size",(zend_long)stream.size);
+        add_assoc_bool(&info,"truncated",truncated);
+        ZEND_TRY_ASSIGN_REF_VALUE(zinfo,&info);
+    }
+
+    RETVAL_STRINGL((char*)stream.data,stream.size);
+    compress_stream_free(&stream);
+}
+/* }}} */
+
+/* {{{ proto array pygments_highlight_multi(string code, array variants[, string lexer, string filename, bool &truncated])
+   Syntax-highlights the specified code once for each set of options, lexing
+   the code only once */
+PHP_FUNCTION(pygments_highlight_multi)
+{
+    char* code;
+    size_t code_len;
+    zval* zvariants;
+    char* preferredLexer = NULL;
+    size_t preferredLexer_len = 0;
+    char* filename = NULL;
+    size_t filename_len = 0;
+    zval* ztruncated = NULL;
+    zval* zv;
+    zend_string* key;
+    zend_ulong index;
+    int i;
+    int count;
+    int result;
+    struct lexer_options lxopts;
+    struct context_options* variants;
+    struct highlight_result** results;
+
+    if (!pygments_context_check(&PYGMENTS_G(highlighter))) {
+        zend_throw_exception(NULL,"Pygments library is not loaded",0);
+        return;
+    }
+
+    if (zend_parse_parameters(
+            ZEND_NUM_ARGS(),
+            "sa|s!s!z",
+            &code,
+            &code_len,
+            &zvariants,
+            &preferredLexer,
+            &preferredLexer_len,
+            &filename,
+            &filename_len,
+            &ztruncated) == FAILURE)
+    {
+        return;
+    }
+
+    count = zend_hash_num_elements(Z_ARRVAL_P(zvariants));
+    if (count == 0) {
+        zend_argument_value_error(2,"must not be empty");
+        return;
+    }
+
+    /* Parse the options for each variant. */
+    variants = ecalloc(count,sizeof(struct context_options));
+    i = 0;
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(zvariants),zv) {
+        ZVAL_DEREF(zv);
+        if (Z_TYPE_P(zv) != IS_ARRAY) {
+            efree(variants);
+            zend_argument_type_error(2,"must contain only arrays");
+            return;
+        }
+
+        if (pygments_context_options_parse(variants + i,zv,"pygments_highlight_multi") == FAILURE) {
+            efree(variants);
+            return;
+        }
+
+        i += 1;
+    } ZEND_HASH_FOREACH_END();
+
+    /* Assign lexer options. May be NULL if not provided by the user. */
+    lxopts.preferred_lexer = preferredLexer;
+    lxopts.filename = filename;
+
+    results = ecalloc(count,sizeof(struct highlight_result*));
+    PYGMENTS_PYTHON_ENTER();
+    result = highlight_multi(&PYGMENTS_G(highlighter),code,&lxopts,variants,count,results);
+    PYGMENTS_PYTHON_LEAVE();
+    if (result == -1) {
+        efree(results);
+        efree(variants);
+        RETURN_FALSE;
+    }
+
+    if (ztruncated != NULL) {
+        ZEND_TRY_ASSIGN_REF_BOOL(ztruncated,results[0]->truncated);
+    }
+
+    /* Return the outputs under the same keys as the variants. */
+    array_init_size(return_value,count);
+    i = 0;
+    ZEND_HASH_FOREACH_KEY(Z_ARRVAL_P(zvariants),index,key) {
+        if (key != NULL) {
+            add_assoc_string_ex(return_value,ZSTR_VAL(key),ZSTR_LEN(key),(char*)results[i]->html);
+        }
+        else {
+            add_index_string(return_value,index,results[i]->html);
+        }
+        i += 1;
+    } ZEND_HASH_FOREACH_END();
+
+    PYGMENTS_PYTHON_ENTER();
+    for (i = 0;i < count;++i) {
+        highlight_result_free(results[i]);
+    }
+    PYGMENTS_PYTHON_LEAVE();
+
+    efree(results);
+    efree(variants);
+}
+/* }}} */
+
+/* {{{ proto array pygments_tokens(string code[, string lexer, string filename, bool &truncated])
+   Lexes the specified code, returning the tokens instead of the output */
+PHP_FUNCTION(pygments_tokens)
+{
+    char* code;
+    size_t code_len;
+    char* preferredLexer = NULL;
+    size_t preferredLexer_len = 0;
+    char* filename = NULL;
+    size_t filename_len = 0;
+    zval* ztruncated = NULL;
+    int truncated;
+    Py_ssize_t i;
+    PyObject* tokens;
+    struct lexer_options lxopts;
+
+    if (!pygments_context_check(&PYGMENTS_G(highlighter))) {
+        zend_throw_exception(NULL,"Pygments library is not loaded",0);
+        return;
+    }
+
+    if (zend_parse_parameters(
+            ZEND_NUM_ARGS(),
+            "s|s!s!z",
+            &code,
+            &code_len,
+            &preferredLexer,
+            &preferredLexer_len,
+            &filename,
+            &filename_len,
+            &ztruncated) == FAILURE)
+    {
+        return;
+    }
+
+    /* Assign lexer options. May be NULL if not provided by the user. */
+    lxopts.preferred_lexer = preferredLexer;
+    lxopts.filename = filename;
+
+    PYGMENTS_PYTHON_ENTER();
+    tokens = highlight_tokens(&PYGMENTS_G(highlighter),code,&lxopts,&truncated);
+    if (tokens == NULL) {
+        PYGMENTS_PYTHON_LEAVE();
+        RETURN_FALSE;
+    }
+
+    array_init_size(return_value,PyList_GET_SIZE(tokens));
+    for (i = 0;i < PyList_GET_SIZE(tokens);++i) {
+        zval ztoken;
+        const char* ttype;
+        const char* value;
+        PyObject* pyvalue;
+        Py_ssize_t value_len;
+
+        value = NULL;
+        if (PyArg_ParseTuple(PyList_GET_ITEM(tokens,i),"sO",&ttype,&pyvalue)) {
+            value = PyUnicode_AsUTF8AndSize(pyvalue,&value_len);
+        }
+        if (value == NULL) {
+            PyErr_Clear();
+            zval_ptr_dtor(return_value);
+            Py_DECREF(tokens);
+            PYGMENTS_PYTHON_LEAVE();
+            RETURN_FALSE;
+        }
+
+        array_init_size(&ztoken,2);
+        add_next_index_string(&ztoken,ttype);
+        add_next_index_stringl(&ztoken,value,value_len);
+        add_next_index_zval(return_value,&ztoken);
+    }
+
+    Py_DECREF(tokens);
+    PYGMENTS_PYTHON_LEAVE();
+
+    if (ztruncated != NULL) {
+        ZEND_TRY_ASSIGN_REF_BOOL(ztruncated,truncated);
+    }
+}
+/* }}} */
+
+/* {{{ proto array pygments_render_tree(string src, string dst[, array options])
+   Syntax-highlights every file under a directory into another directory using
+   several worker processes */
+PHP_FUNCTION(pygments_render_tree)
+{
+    char* src;
+    size_t src_len;
+    char* dst;
+    size_t dst_len;
+    zval* zopts = NULL;
+    zval zfiles;
+    size_t i;
+    int result;
+    struct render_options opts;
+    struct render_summary summary;
+    static const char* STATUS_NAMES[] = {
+        "pending",
+        "rendered",
+        "skipped",
+        "failed"
+    };
+
+    if (!pygments_context_check(&PYGMENTS_G(highlighter))) {
+        zend_throw_exception(NULL,"Pygments library is not loaded",0);
+        return;
+    }
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(),"pp|a",&src,&src_len,&dst,&dst_len,&zopts) == FAILURE) {
+        return;
+    }
+
+    if (zopts != NULL) {
+        if (render_options_parse(&opts,zopts,"pygments_render_tree") == FAILURE) {
+            return;
+        }
+    }
+    else {
+        zval zempty;
+
+        array_init(&zempty);
+        render_options_parse(&opts,&zempty,"pygments_render_tree");
+        zval_ptr_dtor(&zempty);
+    }
+
+    PYGMENTS_PYTHON_ENTER();
+    result = render_tree(&PYGMENTS_G(highlighter),src,dst,&opts,&summary);
+    PYGMENTS_PYTHON_LEAVE();
+    if (result == -1) {
+        RETURN_FALSE;
+    }
+
+    array_init_size(&zfiles,summary.count);
+    for (i = 0;i < summary.count;++i) {
+        zval zfile;
+        const struct render_file* file = summary.files + i;
+
+        array_init(&zfile);
+        add_assoc_string(&zfile,"status",(char*)STATUS_NAMES[file->status]);
+        add_assoc_double(&zfile,"time",file->time);
+        if (file->status == RENDER_FAILED) {
+            add_assoc_string(&zfile,"error",(char*)file->error);
+        }
+        add_assoc_zval(&zfiles,file->path,&zfile);
+    }
+
+    array_init(return_value);
+    add_assoc_long(return_value,"workers",summary.workers);
+    add_assoc_long(return_value,"rendered",summary.rendered);
+    add_assoc_long(return_value,"skipped",summary.skipped);
+    add_assoc_long(return_value,"failed",summary.failed);
+    add_assoc_double(return_value,"time",summary.time);
+    add_assoc_zval(return_value,"files",&zfiles);
+
+    render_summary_free(&summary);
+}
+/* }}} */
+
+/* {{{ proto string pygments_highlight_document(string document[, string format, array &info])
+   Syntax-highlights the code blocks in a Markdown or HTML document */
+PHP_FUNCTION(pygments_highlight_document)
+{
+    char* doc;
+    size_t doc_len;
+    char* format = "markdown";
+    size_t format_len = sizeof("markdown")-1;
+    zval* zinfo = NULL;
+    enum document_format fmt;
+    struct document_stats stats;
+    smart_str output = {0};
+
+    if (!pygments_context_check(&PYGMENTS_G(highlighter))) {
+        zend_throw_exception(NULL,"Pygments library is not loaded",0);
+        return;
+    }
+
+    if (zend_parse_parameters(
+            ZEND_NUM_ARGS(),
+            "s|sz",
+            &doc,
+            &doc_len,
+            &format,
+            &format_len,
+            &zinfo) == FAILURE)
+    {
+        return;
+    }
+
+    if (document_format_parse(&fmt,format) == -1) {
+        zend_argument_value_error(2,"must be either \"markdown\" or \"html\"");
+        return;
+    }
+
+    PYGMENTS_PYTHON_ENTER();
+    highlight_document(&PYGMENTS_G(highlighter),doc,doc_len,fmt,&output,&stats);
+    PYGMENTS_PYTHON_LEAVE();
+
+    if (zinfo != NULL) {
+        zval info;
+
+        array_init(&info);
+        add_assoc_long(&info,"blocks",stats.blocks);
+        add_assoc_long(&info,"highlighted",stats.highlighted);
+        add_assoc_long(&info,"truncated",stats.truncated);
+        ZEND_TRY_ASSIGN_REF_VALUE(zinfo,&info);
+    }
+
+    RETURN_STR(smart_str_extract(&output));
 }
 /* }}} */
 
@@ -220,6 +894,218 @@ PHP_FUNCTION(pygments_set_options)
         return;
     }
 
+    PYGMENTS_PYTHON_ENTER();
     pygments_context_assign_options(&PYGMENTS_G(highlighter),&ctxopts);
+    PYGMENTS_PYTHON_LEAVE();
+}
+/* }}} */
+
+/* {{{ proto array pygments_gc_stats()
+   Gets statistics for garbage collections deferred by the pygments context */
+PHP_FUNCTION(pygments_gc_stats)
+{
+    int i;
+    zval zcollections;
+    const struct gc_stats* stats = &PYGMENTS_G(highlighter).gcstats;
+
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    array_init(&zcollections);
+    for (i = 0;i < PYGMENTS_GC_GENERATIONS;++i) {
+        add_next_index_long(&zcollections,stats->collections[i]);
+    }
+
+    array_init(return_value);
+    add_assoc_bool(return_value,"deferred",PYGMENTS_G(highlighter).gcopts.deferred);
+    add_assoc_zval(return_value,"collections",&zcollections);
+    add_assoc_long(return_value,"collected",stats->collected);
+    add_assoc_double(return_value,"total_time",stats->total_time);
+    add_assoc_double(return_value,"max_time",stats->max_time);
+}
+/* }}} */
+
+/* {{{ proto array pygments_memory_stats()
+   Gets statistics about the memory held by the Python interpreter */
+PHP_FUNCTION(pygments_memory_stats)
+{
+    struct memory_stats stats;
+
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    if (!pygments_context_check(&PYGMENTS_G(highlighter))) {
+        zend_throw_exception(NULL,"Pygments library is not loaded",0);
+        return;
+    }
+
+    PYGMENTS_PYTHON_ENTER();
+    pygments_memory_stats(&stats);
+    PYGMENTS_PYTHON_LEAVE();
+
+    array_init(return_value);
+    add_assoc_long(return_value,"allocated_blocks",stats.allocated_blocks);
+    if (stats.total_refcount >= 0) {
+        add_assoc_long(return_value,"total_refcount",stats.total_refcount);
+    }
+    else {
+        add_assoc_null(return_value,"total_refcount");
+    }
+    if (stats.traced_memory >= 0) {
+        add_assoc_long(return_value,"traced_memory",stats.traced_memory);
+        add_assoc_long(return_value,"traced_peak",stats.traced_peak);
+    }
+    else {
+        add_assoc_null(return_value,"traced_memory");
+        add_assoc_null(return_value,"traced_peak");
+    }
+}
+/* }}} */
+
+/* {{{ proto array pygments_profile([bool reset])
+   Gets the statistics recorded by the RegexLexer profiler */
+PHP_FUNCTION(pygments_profile)
+{
+    zend_bool reset = 0;
+    Py_ssize_t i;
+    PyObject* report;
+    struct profiler* profiler = PYGMENTS_G(highlighter).profiler;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(),"|b",&reset) == FAILURE) {
+        return;
+    }
+
+    array_init(return_value);
+    if (profiler == NULL) {
+        return;
+    }
+
+    PYGMENTS_PYTHON_ENTER();
+    report = profiler_report(profiler);
+    if (report == NULL) {
+        PyErr_Clear();
+        PYGMENTS_PYTHON_LEAVE();
+        return;
+    }
+
+    for (i = 0;i < PyList_GET_SIZE(report);++i) {
+        zval zentry;
+        const char* lexer;
+        const char* state;
+        long index;
+        PyObject* pattern;
+        long attempts;
+        long matches;
+        double time;
+
+        if (!PyArg_ParseTuple(PyList_GET_ITEM(report,i),"sslOlld",
+                &lexer,&state,&index,&pattern,&attempts,&matches,&time))
+        {
+            PyErr_Clear();
+            continue;
+        }
+
+        array_init(&zentry);
+        add_assoc_string(&zentry,"lexer",(char*)lexer);
+        add_assoc_string(&zentry,"state",(char*)state);
+        add_assoc_long(&zentry,"rule",index);
+        if (PyUnicode_Check(pattern) && PyUnicode_AsUTF8(pattern) != NULL) {
+            add_assoc_string(&zentry,"pattern",(char*)PyUnicode_AsUTF8(pattern));
+        }
+        else {
+            PyErr_Clear();
+            add_assoc_null(&zentry,"pattern");
+        }
+        add_assoc_long(&zentry,"attempts",attempts);
+        add_assoc_long(&zentry,"matches",matches);
+        add_assoc_double(&zentry,"time",time);
+        add_next_index_zval(return_value,&zentry);
+    }
+
+    Py_DECREF(report);
+
+    if (reset) {
+        profiler_reset(profiler);
+    }
+    PYGMENTS_PYTHON_LEAVE();
+}
+/* }}} */
+
+/* {{{ proto bool pygments_profile_dump(string path)
+   Writes the RegexLexer profile to a file in collapsed stack format */
+PHP_FUNCTION(pygments_profile_dump)
+{
+    char* path;
+    size_t path_len;
+    int result;
+    struct profiler* profiler = PYGMENTS_G(highlighter).profiler;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(),"p",&path,&path_len) == FAILURE) {
+        return;
+    }
+
+    if (profiler == NULL) {
+        RETURN_FALSE;
+    }
+
+    PYGMENTS_PYTHON_ENTER();
+    result = profiler_dump(profiler,path);
+    PYGMENTS_PYTHON_LEAVE();
+    if (result == -1) {
+        RETURN_FALSE;
+    }
+
+    RETURN_TRUE;
+}
+/* }}} */
+
+/* {{{ proto array pygments_coalesce_stats()
+   Gets statistics for calls to pygments_highlight() coalesced across processes */
+PHP_FUNCTION(pygments_coalesce_stats)
+{
+    long in_flight = 0;
+    struct coalesce_stats stats;
+
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    memset(&stats,0,sizeof(struct coalesce_stats));
+    if (coalesce_table != NULL) {
+        coalesce_stats(coalesce_table,&stats,&in_flight);
+    }
+
+    array_init(return_value);
+    add_assoc_bool(return_value,"enabled",coalesce_table != NULL);
+    add_assoc_long(return_value,"in_flight",in_flight);
+    add_assoc_long(return_value,"calls",stats.calls);
+    add_assoc_long(return_value,"computed",stats.computed);
+    add_assoc_long(return_value,"coalesced",stats.coalesced);
+    add_assoc_long(return_value,"timeouts",stats.timeouts);
+    add_assoc_long(return_value,"bypassed",stats.bypassed);
+    add_assoc_double(return_value,"saved_time",stats.saved_time);
+}
+/* }}} */
+
+/* {{{ proto array pygments_token_cache_stats()
+   Gets statistics for the token streams cached by the pygments context */
+PHP_FUNCTION(pygments_token_cache_stats)
+{
+    const struct token_cache* cache = PYGMENTS_G(highlighter).tokens;
+
+    if (zend_parse_parameters_none() == FAILURE) {
+        return;
+    }
+
+    array_init(return_value);
+    add_assoc_bool(return_value,"enabled",cache != NULL && token_cache_enabled(cache));
+    add_assoc_long(return_value,"entries",cache != NULL ? token_cache_count(cache) : 0);
+    add_assoc_long(return_value,"size",cache != NULL ? cache->size : 0);
+    add_assoc_long(return_value,"max_size",cache != NULL ? cache->max_size : 0);
+    add_assoc_long(return_value,"hits",cache != NULL ? cache->hits : 0);
+    add_assoc_long(return_value,"misses",cache != NULL ? cache->misses : 0);
+    add_assoc_long(return_value,"evictions",cache != NULL ? cache->evictions : 0);
 }
 /* }}} */
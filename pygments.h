@@ -19,6 +19,12 @@
 #include <ext/standard/info.h>
 #include <Zend/zend_exceptions.h>
 #include "highlight.h"
+#include "snapshot.h"
+#include "compress.h"
+#include "render.h"
+#include "document.h"
+#include "coalesce.h"
+#include "cache.h"
 
 #ifdef ZTS
 #include "TSRM.h"
@@ -33,6 +39,31 @@
 
 ZEND_BEGIN_MODULE_GLOBALS(pygments)
   struct pygments_context highlighter;
+
+  /* INI settings */
+  zend_bool gc_defer;
+  zend_long gc_threshold0;
+  zend_long gc_threshold1;
+  zend_long gc_threshold2;
+  char* snapshot;
+  zend_long parallel_workers;
+  zend_long parallel_min_size;
+  double parallel_timeout;
+  double profile_rate;
+  char* profile_dump;
+  char* engine;
+  zend_long coalesce_size;
+  zend_long coalesce_slots;
+  double coalesce_timeout;
+  zend_long token_cache_size;
+
+#ifdef ZTS
+  /* The Python thread state of the PHP thread. It is created with the globals
+   * and kept detached except while the thread calls into Python.
+   */
+  PyThreadState* tstate;
+  PyGILState_STATE gstate;
+#endif
 ZEND_END_MODULE_GLOBALS(pygments)
 extern ZEND_DECLARE_MODULE_GLOBALS(pygments);
 
@@ -44,4 +75,21 @@ extern ZEND_DECLARE_MODULE_GLOBALS(pygments);
     (pygments_globals.v)
 #endif
 
+/* Attaches and detaches the PHP thread's Python thread state around calls into
+ * Python. While detached, other threads may run Python code: with a regular
+ * build of Python, this releases the GIL; with a free-threaded build, it lets
+ * the interpreter pause all threads for garbage collection. A thread must not
+ * return to PHP while attached. These do nothing in non-threaded builds, where
+ * the process's only thread stays attached.
+ */
+#ifdef ZTS
+#define PYGMENTS_PYTHON_ENTER()                 \
+    PyEval_RestoreThread(PYGMENTS_G(tstate))
+#define PYGMENTS_PYTHON_LEAVE()                 \
+    (PYGMENTS_G(tstate) = PyEval_SaveThread())
+#else
+#define PYGMENTS_PYTHON_ENTER()
+#define PYGMENTS_PYTHON_LEAVE()
+#endif
+
 #endif
@@ -1,5 +1,27 @@
 <?php
 
-function pygments_highlight(string $code,string $preferred_lexer = null,string $filename = null) : string|bool {};
+function pygments_highlight(string $code,string $preferred_lexer = null,string $filename = null,&$truncated = null) : string|bool {};
+
+function pygments_highlight_compressed(string $code,string $encoding,string $preferred_lexer = null,string $filename = null,&$info = null) : string|bool {};
+
+function pygments_highlight_multi(string $code,array $variants,string $preferred_lexer = null,string $filename = null,&$truncated = null) : array|bool {};
+
+function pygments_tokens(string $code,string $preferred_lexer = null,string $filename = null,&$truncated = null) : array|bool {};
+
+function pygments_render_tree(string $src,string $dst,array $options = []) : array|bool {};
+
+function pygments_highlight_document(string $document,string $format = "markdown",&$info = null) : string {};
 
 function pygments_set_options(array $options) : void {};
+
+function pygments_gc_stats() : array {};
+
+function pygments_memory_stats() : array {};
+
+function pygments_profile(bool $reset = false) : array {};
+
+function pygments_profile_dump(string $path) : bool {};
+
+function pygments_coalesce_stats() : array {};
+
+function pygments_token_cache_stats() : array {};
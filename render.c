@@ -0,0 +1,962 @@
+/*
+ * render.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "render.h"
+#include "parallel.h"
+#include <ext/standard/md5.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MANIFEST_HEADER "pygments-manifest 1"
+
+/*
+ * tree_file
+ *
+ * A regular file found under the source directory.
+ */
+
+struct tree_file
+{
+    char* path;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+};
+
+struct tree
+{
+    struct tree_file* files;
+    size_t count;
+    size_t capacity;
+
+    /* The destination directory, which is not walked if it is inside the
+     * source directory.
+     */
+    dev_t dst_dev;
+    ino_t dst_ino;
+};
+
+/*
+ * manifest_entry
+ *
+ * Records a file that was rendered successfully by a previous run.
+ */
+
+struct manifest_entry
+{
+    char* path;
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    unsigned char digest[16];
+};
+
+struct manifest
+{
+    struct manifest_entry* entries;
+    size_t count;
+    size_t capacity;
+};
+
+/*
+ * render_slot
+ *
+ * The state of a single file shared between the parent and the worker
+ * processes. Workers claim files by incrementing the shared counter.
+ */
+
+struct render_slot
+{
+    int status;
+
+    /* Non-zero if 'digest' holds the digest recorded by the manifest. Workers
+     * replace it with the digest of the file they read.
+     */
+    int known;
+    unsigned char digest[16];
+
+    long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+
+    double time;
+    char error[RENDER_ERROR_SIZE];
+};
+
+struct render_shared
+{
+    size_t next;
+    struct render_slot slots[1];
+};
+
+static char* join_path(const char* a,const char* b,const char* suffix)
+{
+    size_t n;
+    char* path;
+
+    n = strlen(a) + strlen(b) + strlen(suffix) + 2;
+    path = malloc(n);
+    if (path != NULL) {
+        snprintf(path,n,"%s%s%s%s",a,(*a != 0 && *b != 0) ? "/" : "",b,suffix);
+    }
+
+    return path;
+}
+
+/* Creates the directory and any missing parent directories. */
+static int make_dirs(const char* path)
+{
+    char* buf;
+    char* p;
+    int result = 0;
+
+    buf = strdup(path);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    for (p = buf + 1;;++p) {
+        if (*p == '/' || *p == 0) {
+            char c = *p;
+
+            *p = 0;
+            if (mkdir(buf,0777) == -1 && errno != EEXIST) {
+                result = -1;
+                break;
+            }
+            *p = c;
+
+            if (c == 0) {
+                break;
+            }
+        }
+    }
+
+    free(buf);
+    return result;
+}
+
+static int compare_files(const void* a,const void* b)
+{
+    return strcmp(((const struct tree_file*)a)->path,((const struct tree_file*)b)->path);
+}
+
+static int compare_entries(const void* a,const void* b)
+{
+    return strcmp(((const struct manifest_entry*)a)->path,
+        ((const struct manifest_entry*)b)->path);
+}
+
+/* Adds the regular files under the directory to the tree. Symbolic links are
+ * not followed. Fails if the directory or any directory under it cannot be
+ * read, so that a subtree is never silently left out.
+ */
+static int walk_tree(struct tree* tree,const char* src,const char* rel,int hidden)
+{
+    int result = 0;
+    int error;
+    char* dirpath;
+    DIR* dir;
+    struct dirent* ent;
+
+    dirpath = join_path(src,rel,"");
+    if (dirpath == NULL) {
+        return -1;
+    }
+
+    dir = opendir(dirpath);
+    if (dir == NULL) {
+        free(dirpath);
+        return -1;
+    }
+
+    for (;;) {
+        char* path;
+        char* relpath;
+        struct stat st;
+
+        errno = 0;
+        ent = readdir(dir);
+        if (ent == NULL) {
+            if (errno != 0) {
+                result = -1;
+            }
+            break;
+        }
+
+        if (strcmp(ent->d_name,".") == 0 || strcmp(ent->d_name,"..") == 0
+            || (!hidden && ent->d_name[0] == '.'))
+        {
+            continue;
+        }
+
+        path = join_path(dirpath,ent->d_name,"");
+        relpath = join_path(rel,ent->d_name,"");
+        if (path == NULL || relpath == NULL) {
+            free(path);
+            free(relpath);
+            result = -1;
+            break;
+        }
+
+        /* Skip entries that were removed since the directory was read. */
+        if (lstat(path,&st) == -1) {
+            int removed = (errno == ENOENT);
+
+            free(path);
+            free(relpath);
+            if (removed) {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        free(path);
+
+        if (S_ISDIR(st.st_mode)) {
+            if ((st.st_dev != tree->dst_dev || st.st_ino != tree->dst_ino)
+                && walk_tree(tree,src,relpath,hidden) == -1)
+            {
+                free(relpath);
+                result = -1;
+                break;
+            }
+            free(relpath);
+            continue;
+        }
+
+        if (!S_ISREG(st.st_mode)) {
+            free(relpath);
+            continue;
+        }
+
+        if (tree->count == tree->capacity) {
+            size_t capacity = tree->capacity == 0 ? 64 : tree->capacity * 2;
+            struct tree_file* files = realloc(tree->files,capacity * sizeof(struct tree_file));
+
+            if (files == NULL) {
+                free(relpath);
+                result = -1;
+                break;
+            }
+
+            tree->files = files;
+            tree->capacity = capacity;
+        }
+
+        tree->files[tree->count].path = relpath;
+        tree->files[tree->count].size = (long long)st.st_size;
+        tree->files[tree->count].mtime_sec = (long long)st.st_mtim.tv_sec;
+        tree->files[tree->count].mtime_nsec = st.st_mtim.tv_nsec;
+        tree->count += 1;
+    }
+
+    /* Keep the error from the failed call for the caller. */
+    error = errno;
+    closedir(dir);
+    free(dirpath);
+    errno = error;
+
+    return result;
+}
+
+static void tree_free(struct tree* tree)
+{
+    size_t i;
+
+    for (i = 0;i < tree->count;++i) {
+        free(tree->files[i].path);
+    }
+    free(tree->files);
+}
+
+/* Computes a digest of everything besides the input that affects the output so
+ * that the manifest is discarded when any of it changes.
+ */
+static void render_fingerprint(char* dst,const struct pygments_context* ctx,
+    const struct render_options* opts)
+{
+    unsigned char digest[16];
+    PHP_MD5_CTX md5;
+    PyObject* version;
+
+    PHP_MD5Init(&md5);
+
+    version = PyObject_GetAttrString(ctx->module_pygments,"__version__");
+    if (version != NULL && PyUnicode_Check(version) && PyUnicode_AsUTF8(version) != NULL) {
+        PHP_MD5Update(&md5,PyUnicode_AsUTF8(version),strlen(PyUnicode_AsUTF8(version)));
+    }
+    Py_XDECREF(version);
+    PyErr_Clear();
+
+    pygments_context_options_digest(&opts->format,digest);
+    PHP_MD5Update(&md5,"\n",1);
+    PHP_MD5Update(&md5,digest,16);
+    PHP_MD5Update(&md5,"\n",1);
+    PHP_MD5Update(&md5,opts->suffix,strlen(opts->suffix));
+
+    PHP_MD5Final(digest,&md5);
+    make_digest_ex(dst,digest,16);
+}
+
+static int hex_digest(unsigned char* dst,const char* hex)
+{
+    int i;
+
+    for (i = 0;i < 16;++i) {
+        unsigned int byte;
+
+        if (sscanf(hex + i * 2,"%2x",&byte) != 1) {
+            return -1;
+        }
+        dst[i] = (unsigned char)byte;
+    }
+
+    return 0;
+}
+
+/* Loads the manifest. The manifest is left empty if it does not exist or was
+ * written with a different fingerprint.
+ */
+static void manifest_load(struct manifest* manifest,const char* path,const char* fingerprint)
+{
+    FILE* fp;
+    char* line = NULL;
+    size_t n = 0;
+    ssize_t len;
+
+    memset(manifest,0,sizeof(struct manifest));
+
+    fp = fopen(path,"r");
+    if (fp == NULL) {
+        return;
+    }
+
+    len = getline(&line,&n,fp);
+    if (len <= 0 || strncmp(line,MANIFEST_HEADER " ",sizeof(MANIFEST_HEADER)) != 0
+        || strncmp(line + sizeof(MANIFEST_HEADER),fingerprint,32) != 0)
+    {
+        free(line);
+        fclose(fp);
+        return;
+    }
+
+    while ((len = getline(&line,&n,fp)) > 0) {
+        int offset = 0;
+        char hex[33];
+        struct manifest_entry entry;
+
+        if (line[len-1] == '\n') {
+            line[len-1] = 0;
+        }
+
+        if (sscanf(line,"%lld %lld %ld %32s %n",&entry.size,&entry.mtime_sec,
+                &entry.mtime_nsec,hex,&offset) != 4
+            || offset == 0 || line[offset] == 0 || hex_digest(entry.digest,hex) == -1)
+        {
+            continue;
+        }
+
+        if (manifest->count == manifest->capacity) {
+            size_t capacity = manifest->capacity == 0 ? 64 : manifest->capacity * 2;
+            struct manifest_entry* entries = realloc(manifest->entries,
+                capacity * sizeof(struct manifest_entry));
+
+            if (entries == NULL) {
+                break;
+            }
+
+            manifest->entries = entries;
+            manifest->capacity = capacity;
+        }
+
+        entry.path = strdup(line + offset);
+        if (entry.path == NULL) {
+            break;
+        }
+
+        manifest->entries[manifest->count++] = entry;
+    }
+
+    free(line);
+    fclose(fp);
+
+    qsort(manifest->entries,manifest->count,sizeof(struct manifest_entry),compare_entries);
+}
+
+static const struct manifest_entry* manifest_find(const struct manifest* manifest,
+    const char* path)
+{
+    struct manifest_entry key;
+
+    if (manifest->count == 0) {
+        return NULL;
+    }
+
+    key.path = (char*)path;
+    return bsearch(&key,manifest->entries,manifest->count,sizeof(struct manifest_entry),
+        compare_entries);
+}
+
+static void manifest_free(struct manifest* manifest)
+{
+    size_t i;
+
+    for (i = 0;i < manifest->count;++i) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+}
+
+/* Writes the manifest for the files that are up to date. The manifest is
+ * replaced atomically.
+ */
+static int manifest_save(const char* path,const char* fingerprint,const struct tree* tree,
+    const struct render_shared* shared)
+{
+    size_t i;
+    FILE* fp;
+    char* tmppath;
+    char tmpsuffix[32];
+    int result = 0;
+
+    snprintf(tmpsuffix,sizeof(tmpsuffix),".%ld.tmp",(long)getpid());
+    tmppath = join_path("",path,tmpsuffix);
+    if (tmppath == NULL) {
+        return -1;
+    }
+
+    fp = fopen(tmppath,"w");
+    if (fp == NULL) {
+        free(tmppath);
+        return -1;
+    }
+
+    fprintf(fp,"%s %s\n",MANIFEST_HEADER,fingerprint);
+    for (i = 0;i < tree->count;++i) {
+        char hex[33];
+        const struct render_slot* slot = shared->slots + i;
+
+        if ((slot->status != RENDER_RENDERED && slot->status != RENDER_SKIPPED)
+            || strchr(tree->files[i].path,'\n') != NULL)
+        {
+            continue;
+        }
+
+        make_digest_ex(hex,slot->digest,16);
+        fprintf(fp,"%lld %lld %ld %s %s\n",slot->size,slot->mtime_sec,slot->mtime_nsec,
+            hex,tree->files[i].path);
+    }
+
+    if (fclose(fp) != 0 || rename(tmppath,path) == -1) {
+        unlink(tmppath);
+        result = -1;
+    }
+
+    free(tmppath);
+    return result;
+}
+
+static void render_fail(struct render_slot* slot,const char* error)
+{
+    slot->status = RENDER_FAILED;
+    snprintf(slot->error,sizeof(slot->error),"%s",error);
+}
+
+/* Writes the output file. It is written to a temporary file first and then
+ * renamed into place.
+ */
+static int write_output(const char* path,const char* html,struct render_slot* slot)
+{
+    FILE* fp;
+    char* dir;
+    char* sep;
+    char* tmppath;
+    char tmpsuffix[32];
+    size_t len = strlen(html);
+
+    dir = strdup(path);
+    if (dir == NULL) {
+        render_fail(slot,"out of memory");
+        return -1;
+    }
+
+    sep = strrchr(dir,'/');
+    if (sep != NULL && sep != dir) {
+        *sep = 0;
+        if (make_dirs(dir) == -1) {
+            render_fail(slot,strerror(errno));
+            free(dir);
+            return -1;
+        }
+    }
+    free(dir);
+
+    snprintf(tmpsuffix,sizeof(tmpsuffix),".%ld.tmp",(long)getpid());
+    tmppath = join_path("",path,tmpsuffix);
+    if (tmppath == NULL) {
+        render_fail(slot,"out of memory");
+        return -1;
+    }
+
+    fp = fopen(tmppath,"w");
+    if (fp == NULL) {
+        render_fail(slot,strerror(errno));
+        free(tmppath);
+        return -1;
+    }
+
+    if (fwrite(html,1,len,fp) != len || fclose(fp) != 0) {
+        render_fail(slot,"failed to write output");
+        unlink(tmppath);
+        free(tmppath);
+        return -1;
+    }
+
+    if (rename(tmppath,path) == -1) {
+        render_fail(slot,strerror(errno));
+        unlink(tmppath);
+        free(tmppath);
+        return -1;
+    }
+
+    free(tmppath);
+    return 0;
+}
+
+/* Renders a single file in a worker process. */
+static void render_file(const struct pygments_context* ctx,const char* src,const char* dst,
+    const struct render_options* opts,const struct tree_file* file,struct render_slot* slot)
+{
+    int fd;
+    char* path;
+    char* outpath;
+    char* code;
+    ssize_t n;
+    size_t size = 0;
+    size_t capacity;
+    unsigned char digest[16];
+    PHP_MD5_CTX md5;
+    struct stat st;
+    struct lexer_options lxopts;
+    struct highlight_result* result;
+
+    path = join_path(src,file->path,"");
+    if (path == NULL) {
+        render_fail(slot,"out of memory");
+        return;
+    }
+
+    fd = open(path,O_RDONLY);
+    free(path);
+    if (fd == -1 || fstat(fd,&st) == -1) {
+        render_fail(slot,strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    capacity = (size_t)st.st_size + 1;
+    code = malloc(capacity);
+    if (code == NULL) {
+        render_fail(slot,"out of memory");
+        close(fd);
+        return;
+    }
+
+    while ((n = read(fd,code + size,capacity - size - 1)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        size += n;
+        if (size == capacity - 1) {
+            char* bigger = realloc(code,capacity * 2);
+            if (bigger == NULL) {
+                n = -1;
+                break;
+            }
+            code = bigger;
+            capacity *= 2;
+        }
+    }
+    close(fd);
+    if (n != 0) {
+        render_fail(slot,"failed to read file");
+        free(code);
+        return;
+    }
+    code[size] = 0;
+
+    slot->size = (long long)st.st_size;
+    slot->mtime_sec = (long long)st.st_mtim.tv_sec;
+    slot->mtime_nsec = st.st_mtim.tv_nsec;
+
+    PHP_MD5Init(&md5);
+    PHP_MD5Update(&md5,code,size);
+    PHP_MD5Final(digest,&md5);
+
+    outpath = join_path(dst,file->path,opts->suffix);
+    if (outpath == NULL) {
+        render_fail(slot,"out of memory");
+        free(code);
+        return;
+    }
+
+    /* Skip files that were touched but not changed. */
+    if (!opts->force && slot->known && memcmp(digest,slot->digest,16) == 0
+        && access(outpath,F_OK) == 0)
+    {
+        slot->status = RENDER_SKIPPED;
+        free(outpath);
+        free(code);
+        return;
+    }
+    memcpy(slot->digest,digest,16);
+
+    if (memchr(code,0,size) != NULL) {
+        render_fail(slot,"binary file");
+        free(outpath);
+        free(code);
+        return;
+    }
+
+    lxopts.preferred_lexer = NULL;
+    lxopts.filename = file->path;
+    result = highlight(ctx,code,&lxopts);
+    free(code);
+    if (result == NULL) {
+        render_fail(slot,"failed to highlight file");
+        free(outpath);
+        return;
+    }
+
+    if (write_output(outpath,result->html,slot) == 0) {
+        slot->status = RENDER_RENDERED;
+    }
+
+    highlight_result_free(result);
+    free(outpath);
+}
+
+/* Runs a worker process. The worker renders unclaimed files until none are
+ * left.
+ */
+static void render_worker(struct pygments_context* ctx,const char* src,const char* dst,
+    const struct render_options* opts,const struct tree* tree,struct render_shared* shared)
+{
+    PyObject* formatter;
+
+    /* The workers already occupy the CPUs. */
+    ctx->paropts.workers = 0;
+
+    /* Apply the options to a new formatter since the inherited one has already
+     * derived state (e.g. its span openers) from the context's options.
+     */
+    formatter = PyObject_CallObject((PyObject*)Py_TYPE(ctx->formatter),NULL);
+    if (formatter == NULL) {
+        _exit(1);
+    }
+    Py_DECREF(ctx->formatter);
+    ctx->formatter = formatter;
+    pygments_context_assign_options(ctx,&opts->format);
+
+    while (1) {
+        double start;
+        struct render_slot* slot;
+        size_t i = __atomic_fetch_add(&shared->next,1,__ATOMIC_RELAXED);
+
+        if (i >= tree->count) {
+            break;
+        }
+
+        slot = shared->slots + i;
+        if (slot->status != RENDER_PENDING) {
+            continue;
+        }
+
+        start = monotonic_time();
+        render_file(ctx,src,dst,opts,tree->files + i,slot);
+        slot->time = monotonic_time() - start;
+    }
+
+    _exit(0);
+}
+
+int render_options_parse(struct render_options* dst,zval* zfrom,const char* errctx)
+{
+    zval* zv;
+    HashTable* ht;
+
+    memset(dst,0,sizeof(struct render_options));
+    dst->suffix = RENDER_DEFAULT_SUFFIX;
+    dst->manifest = "";
+
+    if (pygments_context_options_parse(&dst->format,zfrom,errctx) == FAILURE) {
+        return FAILURE;
+    }
+
+    ht = Z_ARRVAL_P(zfrom);
+
+    zv = zend_hash_str_find(ht,"workers",sizeof("workers")-1);
+    if (zv != NULL) {
+        if (Z_TYPE_P(zv) != IS_LONG) {
+            zend_throw_error(NULL,"%s: option 'workers' must be an integer",errctx);
+            return FAILURE;
+        }
+        dst->workers = (int)Z_LVAL_P(zv);
+    }
+
+    zv = zend_hash_str_find(ht,"force",sizeof("force")-1);
+    if (zv != NULL) {
+        dst->force = zend_is_true(zv);
+    }
+
+    zv = zend_hash_str_find(ht,"hidden",sizeof("hidden")-1);
+    if (zv != NULL) {
+        dst->hidden = zend_is_true(zv);
+    }
+
+    zv = zend_hash_str_find(ht,"suffix",sizeof("suffix")-1);
+    if (zv != NULL) {
+        if (Z_TYPE_P(zv) != IS_STRING) {
+            zend_throw_error(NULL,"%s: option 'suffix' must be a string",errctx);
+            return FAILURE;
+        }
+        dst->suffix = Z_STRVAL_P(zv);
+    }
+
+    zv = zend_hash_str_find(ht,"manifest",sizeof("manifest")-1);
+    if (zv != NULL) {
+        if (Z_TYPE_P(zv) != IS_STRING) {
+            zend_throw_error(NULL,"%s: option 'manifest' must be a string",errctx);
+            return FAILURE;
+        }
+        dst->manifest = Z_STRVAL_P(zv);
+    }
+
+    return SUCCESS;
+}
+
+int render_tree(struct pygments_context* ctx,const char* src,const char* dst,
+    const struct render_options* opts,struct render_summary* summary)
+{
+    size_t i;
+    int n;
+    int started = 0;
+    long pending = 0;
+    pid_t* pids;
+    char fingerprint[33];
+    char* manifest_path;
+    double start;
+    struct stat st;
+    struct stat src_st;
+    struct tree tree;
+    struct manifest manifest;
+    struct render_shared* shared;
+    size_t shared_size;
+
+    memset(summary,0,sizeof(struct render_summary));
+    memset(&tree,0,sizeof(struct tree));
+    start = monotonic_time();
+
+    if (stat(src,&src_st) == -1 || make_dirs(dst) == -1 || stat(dst,&st) == -1) {
+        return -1;
+    }
+
+    /* The output would be written over the tree being rendered. */
+    if (st.st_dev == src_st.st_dev && st.st_ino == src_st.st_ino) {
+        errno = EINVAL;
+        return -1;
+    }
+    tree.dst_dev = st.st_dev;
+    tree.dst_ino = st.st_ino;
+
+    if (walk_tree(&tree,src,"",opts->hidden) == -1) {
+        tree_free(&tree);
+        return -1;
+    }
+    qsort(tree.files,tree.count,sizeof(struct tree_file),compare_files);
+
+    if (opts->manifest != NULL && *opts->manifest != 0) {
+        manifest_path = strdup(opts->manifest);
+    }
+    else {
+        manifest_path = join_path(dst,RENDER_MANIFEST_NAME,"");
+    }
+    if (manifest_path == NULL) {
+        tree_free(&tree);
+        return -1;
+    }
+
+    render_fingerprint(fingerprint,ctx,opts);
+    manifest_load(&manifest,manifest_path,fingerprint);
+
+    /* The per-file state is shared with the workers. */
+    shared_size = sizeof(struct render_shared) + tree.count * sizeof(struct render_slot);
+    shared = mmap(NULL,shared_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if (shared == MAP_FAILED) {
+        manifest_free(&manifest);
+        free(manifest_path);
+        tree_free(&tree);
+        return -1;
+    }
+
+    /* Skip files whose size and modification time match the manifest. Files
+     * that only differ in modification time are checked by digest in the
+     * workers.
+     */
+    for (i = 0;i < tree.count;++i) {
+        struct render_slot* slot = shared->slots + i;
+        const struct tree_file* file = tree.files + i;
+        const struct manifest_entry* entry = manifest_find(&manifest,file->path);
+
+        if (entry != NULL && !opts->force) {
+            char* outpath = join_path(dst,file->path,opts->suffix);
+
+            if (outpath != NULL && access(outpath,F_OK) == 0) {
+                memcpy(slot->digest,entry->digest,16);
+                slot->known = 1;
+
+                if (entry->size == file->size && entry->mtime_sec == file->mtime_sec
+                    && entry->mtime_nsec == file->mtime_nsec)
+                {
+                    slot->status = RENDER_SKIPPED;
+                    slot->size = file->size;
+                    slot->mtime_sec = file->mtime_sec;
+                    slot->mtime_nsec = file->mtime_nsec;
+                }
+            }
+            free(outpath);
+        }
+
+        if (slot->status == RENDER_PENDING) {
+            pending += 1;
+        }
+    }
+    manifest_free(&manifest);
+
+    /* Start the workers. */
+    n = opts->workers;
+    if (n < 1) {
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        if (n < 1) {
+            n = 1;
+        }
+    }
+    if (n > pending) {
+        n = (int)pending;
+    }
+
+    pids = calloc(n > 0 ? n : 1,sizeof(pid_t));
+    if (pids == NULL) {
+        munmap(shared,shared_size);
+        free(manifest_path);
+        tree_free(&tree);
+        return -1;
+    }
+
+    for (started = 0;started < n;++started) {
+        pids[started] = pygments_fork();
+        if (pids[started] == 0) {
+            render_worker(ctx,src,dst,opts,&tree,shared);
+        }
+        if (pids[started] < 0) {
+            break;
+        }
+    }
+
+    /* Let other threads run Python code while waiting for the workers. */
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0;i < (size_t)started;++i) {
+        while (waitpid(pids[i],NULL,0) == -1 && errno == EINTR);
+    }
+    Py_END_ALLOW_THREADS
+    free(pids);
+
+    if (started == 0 && pending > 0) {
+        munmap(shared,shared_size);
+        free(manifest_path);
+        tree_free(&tree);
+        return -1;
+    }
+
+    /* Files left pending were claimed by a worker that exited unexpectedly. */
+    for (i = 0;i < tree.count;++i) {
+        if (shared->slots[i].status == RENDER_PENDING) {
+            render_fail(shared->slots + i,"worker exited unexpectedly");
+        }
+    }
+
+    /* A manifest that cannot be written only means that the next run renders
+     * everything again.
+     */
+    manifest_save(manifest_path,fingerprint,&tree,shared);
+    free(manifest_path);
+
+    /* Build the summary. The file paths are moved from the tree. */
+    summary->files = calloc(tree.count > 0 ? tree.count : 1,sizeof(struct render_file));
+    if (summary->files == NULL) {
+        munmap(shared,shared_size);
+        tree_free(&tree);
+        return -1;
+    }
+
+    for (i = 0;i < tree.count;++i) {
+        const struct render_slot* slot = shared->slots + i;
+        struct render_file* file = summary->files + i;
+
+        file->path = tree.files[i].path;
+        tree.files[i].path = NULL;
+        file->status = slot->status;
+        file->time = slot->time;
+        memcpy(file->error,slot->error,RENDER_ERROR_SIZE);
+
+        if (slot->status == RENDER_RENDERED) {
+            summary->rendered += 1;
+        }
+        else if (slot->status == RENDER_SKIPPED) {
+            summary->skipped += 1;
+        }
+        else {
+            summary->failed += 1;
+        }
+    }
+    summary->count = tree.count;
+    summary->workers = started;
+
+    munmap(shared,shared_size);
+    tree_free(&tree);
+
+    summary->time = monotonic_time() - start;
+
+    return 0;
+}
+
+void render_summary_free(struct render_summary* summary)
+{
+    size_t i;
+
+    for (i = 0;i < summary->count;++i) {
+        free(summary->files[i].path);
+    }
+    free(summary->files);
+    memset(summary,0,sizeof(struct render_summary));
+}
@@ -0,0 +1,131 @@
+/*
+ * render.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "highlight.h"
+
+#define RENDER_DEFAULT_SUFFIX ".html"
+#define RENDER_MANIFEST_NAME ".pygments-manifest"
+#define RENDER_ERROR_SIZE 128
+
+/*
+ * render_options
+ *
+ * Options for rendering a directory tree with render_tree().
+ */
+
+struct render_options
+{
+    /* The number of worker processes. If less than 1, then one worker is used
+     * per online CPU.
+     */
+    int workers;
+
+    /* If non-zero, then every file is rendered regardless of the manifest. */
+    int force;
+
+    /* If non-zero, then hidden files and directories (those whose names begin
+     * with a '.') are rendered. Otherwise they are ignored.
+     */
+    int hidden;
+
+    /* The suffix appended to each file's path to form its output path. */
+    const char* suffix;
+
+    /* The path to the manifest file. If empty, then RENDER_MANIFEST_NAME is
+     * used in the destination directory.
+     */
+    const char* manifest;
+
+    /* The formatter options used to highlight each file. */
+    struct context_options format;
+};
+
+enum render_status
+{
+    RENDER_PENDING,
+    RENDER_RENDERED,
+    RENDER_SKIPPED,
+    RENDER_FAILED
+};
+
+/*
+ * render_file
+ *
+ * Describes the outcome of rendering a single file.
+ */
+
+struct render_file
+{
+    /* The path of the file relative to the source directory. */
+    char* path;
+
+    enum render_status status;
+
+    /* The time (in seconds) spent rendering the file. */
+    double time;
+
+    /* A description of the failure if the status is RENDER_FAILED. */
+    char error[RENDER_ERROR_SIZE];
+};
+
+/*
+ * render_summary
+ *
+ * Describes the outcome of a call to render_tree().
+ */
+
+struct render_summary
+{
+    struct render_file* files;
+    size_t count;
+
+    long rendered;
+    long skipped;
+    long failed;
+
+    /* The number of worker processes used. */
+    int workers;
+
+    /* The total time (in seconds) spent rendering the tree. */
+    double time;
+};
+
+/* Parse the render options from the specified zval. An error is thrown if
+ * parsing fails.
+ */
+int render_options_parse(struct render_options* dst,zval* zfrom,const char* errctx);
+
+/*
+ * Highlights every regular file under 'src', writing the output for each to the
+ * same relative path under 'dst' (with the suffix appended). Lexers are chosen
+ * by filename. The files are divided among forked worker processes that each
+ * highlight files until none are left. Each output file is written to a
+ * temporary file and renamed into place so that it is never seen partially
+ * written.
+ *
+ * A manifest records the size, modification time and MD5 digest of each file
+ * that was rendered successfully. A file is skipped if its size and
+ * modification time (or failing that, its digest) match the manifest and its
+ * output exists. The manifest is invalidated if the formatter options, suffix
+ * or pygments version change.
+ *
+ * The context is only modified in the worker processes. Returns 0 on success
+ * and -1 if the tree could not be rendered at all (including when 'dst' is the
+ * same directory as 'src'); failures of individual files are recorded in the
+ * summary.
+ */
+int render_tree(struct pygments_context* ctx,const char* src,const char* dst,
+    const struct render_options* opts,struct render_summary* summary);
+
+/* Frees the members of the summary. */
+void render_summary_free(struct render_summary* summary);
+
+#endif
@@ -0,0 +1,668 @@
+/*
+ * snapshot.c
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "snapshot.h"
+#include <marshal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Key used to invalidate a snapshot. The compiled pattern format depends on
+ * the Python version and the token tables depend on the pygments version.
+ */
+static PyObject* snapshot_version(const struct pygments_context* ctx)
+{
+    PyObject* sys_module;
+    PyObject* sre_module;
+    PyObject* hexversion;
+    PyObject* magic;
+    PyObject* version;
+    PyObject* result;
+
+    sys_module = PyImport_ImportModule("sys");
+    if (sys_module == NULL) {
+        return NULL;
+    }
+
+    hexversion = PyObject_GetAttrString(sys_module,"hexversion");
+    Py_DECREF(sys_module);
+    if (hexversion == NULL) {
+        return NULL;
+    }
+
+    sre_module = PyImport_ImportModule("_sre");
+    if (sre_module == NULL) {
+        Py_DECREF(hexversion);
+        return NULL;
+    }
+
+    magic = PyObject_GetAttrString(sre_module,"MAGIC");
+    Py_DECREF(sre_module);
+    if (magic == NULL) {
+        Py_DECREF(hexversion);
+        return NULL;
+    }
+
+    version = PyObject_GetAttrString(ctx->module_pygments,"__version__");
+    if (version == NULL) {
+        Py_DECREF(hexversion);
+        Py_DECREF(magic);
+        return NULL;
+    }
+
+    result = PyTuple_Pack(3,hexversion,magic,version);
+    Py_DECREF(hexversion);
+    Py_DECREF(magic);
+    Py_DECREF(version);
+
+    return result;
+}
+
+/* Seeds the regex cache with the precompiled patterns for a single snapshot
+ * entry and instantiates the lexer class so that its token table is built
+ * from the cached patterns.
+ */
+static int warm_lexer(PyObject* entry,PyObject* cache,PyObject* sre_compile,
+    PyObject* lexers)
+{
+    Py_ssize_t i;
+    long flags;
+    PyObject* modname;
+    PyObject* clsname;
+    PyObject* patterns;
+    PyObject* module;
+    PyObject* cls;
+    PyObject* keys;
+    PyObject* inst;
+
+    if (!PyArg_ParseTuple(entry,"UUlO!",&modname,&clsname,&flags,&PyList_Type,&patterns)) {
+        return -1;
+    }
+
+    module = PyImport_Import(modname);
+    if (module == NULL) {
+        return -1;
+    }
+
+    cls = PyObject_GetAttr(module,clsname);
+    Py_DECREF(module);
+    if (cls == NULL) {
+        return -1;
+    }
+
+    keys = PyList_New(0);
+    if (keys == NULL) {
+        Py_DECREF(cls);
+        return -1;
+    }
+
+    for (i = 0;i < PyList_GET_SIZE(patterns);++i) {
+        int result;
+        PyObject* args = PyList_GET_ITEM(patterns,i);
+        PyObject* pattern;
+        PyObject* key;
+
+        if (!PyTuple_Check(args) || PyTuple_GET_SIZE(args) < 1) {
+            continue;
+        }
+
+        pattern = PyObject_CallObject(sre_compile,args);
+        if (pattern == NULL) {
+            /* Leave the pattern to be compiled normally. */
+            PyErr_Clear();
+            continue;
+        }
+
+        key = Py_BuildValue("(OOl)",(PyObject*)&PyUnicode_Type,PyTuple_GET_ITEM(args,0),flags);
+        if (key == NULL) {
+            Py_DECREF(pattern);
+            Py_DECREF(keys);
+            Py_DECREF(cls);
+            return -1;
+        }
+
+        result = PyDict_SetItem(cache,key,pattern);
+        Py_DECREF(pattern);
+        if (result == 0) {
+            result = PyList_Append(keys,key);
+        }
+        Py_DECREF(key);
+        if (result == -1) {
+            Py_DECREF(keys);
+            Py_DECREF(cls);
+            return -1;
+        }
+    }
+
+    /* Instantiating a RegexLexer builds its token table on first use. */
+    inst = PyObject_CallObject(cls,NULL);
+    Py_XDECREF(inst);
+    if (inst == NULL) {
+        PyErr_Clear();
+    }
+
+    /* Remove the seeded patterns so they do not crowd out the cache. */
+    for (i = 0;i < PyList_GET_SIZE(keys);++i) {
+        if (PyDict_DelItem(cache,PyList_GET_ITEM(keys,i)) == -1) {
+            PyErr_Clear();
+        }
+    }
+    Py_DECREF(keys);
+
+    if (inst != NULL && PySet_Add(lexers,cls) == -1) {
+        Py_DECREF(cls);
+        return -1;
+    }
+
+    Py_DECREF(cls);
+    return 0;
+}
+
+int pygments_snapshot_load(struct pygments_context* ctx,const char* path)
+{
+    Py_ssize_t i;
+    int result;
+    FILE* fp;
+    PyObject* data;
+    PyObject* stored;
+    PyObject* version;
+    PyObject* entries;
+    PyObject* re_module;
+    PyObject* cache;
+    PyObject* sre_module;
+    PyObject* sre_compile;
+
+    if (ctx->snapshot_lexers == NULL) {
+        ctx->snapshot_lexers = PySet_New(NULL);
+        if (ctx->snapshot_lexers == NULL) {
+            PyErr_Clear();
+            return -1;
+        }
+    }
+
+    fp = fopen(path,"rb");
+    if (fp == NULL) {
+        return 0;
+    }
+
+    data = PyMarshal_ReadObjectFromFile(fp);
+    fclose(fp);
+    if (data == NULL || !PyDict_Check(data)) {
+        PyErr_Clear();
+        Py_XDECREF(data);
+        return -1;
+    }
+
+    version = snapshot_version(ctx);
+    if (version == NULL) {
+        PyErr_Clear();
+        Py_DECREF(data);
+        return -1;
+    }
+
+    /* A stale snapshot is ignored. It is rewritten on shutdown. */
+    stored = PyDict_GetItemString(data,"version");
+    result = stored != NULL ? PyObject_RichCompareBool(stored,version,Py_EQ) : 0;
+    Py_DECREF(version);
+    if (result != 1) {
+        PyErr_Clear();
+        Py_DECREF(data);
+        return 0;
+    }
+
+    entries = PyDict_GetItemString(data,"lexers");
+    if (entries == NULL || !PyList_Check(entries)) {
+        Py_DECREF(data);
+        return -1;
+    }
+
+    re_module = PyImport_ImportModule("re");
+    if (re_module == NULL) {
+        PyErr_Clear();
+        Py_DECREF(data);
+        return -1;
+    }
+
+    cache = PyObject_GetAttrString(re_module,"_cache");
+    Py_DECREF(re_module);
+    if (cache == NULL || !PyDict_Check(cache)) {
+        PyErr_Clear();
+        Py_XDECREF(cache);
+        Py_DECREF(data);
+        return -1;
+    }
+
+    sre_module = PyImport_ImportModule("_sre");
+    if (sre_module == NULL) {
+        PyErr_Clear();
+        Py_DECREF(cache);
+        Py_DECREF(data);
+        return -1;
+    }
+
+    sre_compile = PyObject_GetAttrString(sre_module,"compile");
+    Py_DECREF(sre_module);
+    if (sre_compile == NULL) {
+        PyErr_Clear();
+        Py_DECREF(cache);
+        Py_DECREF(data);
+        return -1;
+    }
+
+    for (i = 0;i < PyList_GET_SIZE(entries);++i) {
+        if (warm_lexer(PyList_GET_ITEM(entries,i),cache,sre_compile,ctx->snapshot_lexers) == -1) {
+            PyErr_Clear();
+        }
+    }
+
+    Py_DECREF(sre_compile);
+    Py_DECREF(cache);
+    Py_DECREF(data);
+
+    ctx->snapshot_loaded = PySet_GET_SIZE(ctx->snapshot_lexers);
+
+    return 0;
+}
+
+/* Converts the items of the specified list to plain integers. The compiler
+ * emits named integer constants which cannot be marshaled.
+ */
+static int plain_int_list(PyObject* list)
+{
+    Py_ssize_t i;
+
+    for (i = 0;i < PyList_GET_SIZE(list);++i) {
+        PyObject* item = PyList_GET_ITEM(list,i);
+        long value;
+
+        if (PyLong_CheckExact(item)) {
+            continue;
+        }
+
+        value = PyLong_AsLong(item);
+        if (value == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+
+        item = PyLong_FromLong(value);
+        if (item == NULL) {
+            return -1;
+        }
+
+        /* NOTE: PyList_SetItem() steals the reference. */
+        PyList_SetItem(list,i,item);
+    }
+
+    return 0;
+}
+
+/* Produces the arguments to _sre.compile() for the specified pattern. This
+ * mirrors the implementation of re's internal compile() function.
+ */
+static PyObject* pattern_args(PyObject* parser,PyObject* compiler,PyObject* src,
+    PyObject* flags)
+{
+    Py_ssize_t groups;
+    Py_ssize_t index;
+    PyObject* parsed;
+    PyObject* state;
+    PyObject* code;
+    PyObject* groupdict;
+    PyObject* stateflags;
+    PyObject* allflags;
+    PyObject* indexgroup;
+    PyObject* key;
+    PyObject* value;
+    PyObject* obj;
+    PyObject* result;
+
+    parsed = PyObject_CallMethod(parser,"parse","OO",src,flags);
+    if (parsed == NULL) {
+        return NULL;
+    }
+
+    code = PyObject_CallMethod(compiler,"_code","OO",parsed,flags);
+    if (code == NULL || !PyList_Check(code) || plain_int_list(code) == -1) {
+        Py_XDECREF(code);
+        Py_DECREF(parsed);
+        return NULL;
+    }
+
+    /* NOTE: The parser state was named 'pattern' before Python 3.8. */
+    state = PyObject_GetAttrString(parsed,"state");
+    if (state == NULL) {
+        PyErr_Clear();
+        state = PyObject_GetAttrString(parsed,"pattern");
+    }
+    Py_DECREF(parsed);
+    if (state == NULL) {
+        Py_DECREF(code);
+        return NULL;
+    }
+
+    obj = PyObject_GetAttrString(state,"groups");
+    groupdict = PyObject_GetAttrString(state,"groupdict");
+    stateflags = PyObject_GetAttrString(state,"flags");
+    Py_DECREF(state);
+    if (obj == NULL || groupdict == NULL || stateflags == NULL || !PyDict_Check(groupdict)) {
+        Py_XDECREF(obj);
+        Py_XDECREF(groupdict);
+        Py_XDECREF(stateflags);
+        Py_DECREF(code);
+        return NULL;
+    }
+
+    groups = PyLong_AsSsize_t(obj);
+    Py_DECREF(obj);
+    allflags = PyLong_FromLong(PyLong_AsLong(flags) | PyLong_AsLong(stateflags));
+    Py_DECREF(stateflags);
+    if (groups < 1 || allflags == NULL) {
+        PyErr_Clear();
+        PyErr_SetString(PyExc_ValueError,"bad pattern state");
+        Py_XDECREF(allflags);
+        Py_DECREF(groupdict);
+        Py_DECREF(code);
+        return NULL;
+    }
+
+    indexgroup = PyTuple_New(groups);
+    if (indexgroup == NULL) {
+        Py_DECREF(allflags);
+        Py_DECREF(groupdict);
+        Py_DECREF(code);
+        return NULL;
+    }
+
+    for (index = 0;index < groups;++index) {
+        Py_INCREF(Py_None);
+        PyTuple_SET_ITEM(indexgroup,index,Py_None);
+    }
+
+    index = 0;
+    while (PyDict_Next(groupdict,&index,&key,&value)) {
+        Py_ssize_t i = PyLong_AsSsize_t(value);
+        if (i >= 0 && i < groups) {
+            Py_INCREF(key);
+            Py_DECREF(PyTuple_GET_ITEM(indexgroup,i));
+            PyTuple_SET_ITEM(indexgroup,i,key);
+        }
+    }
+    PyErr_Clear();
+
+    result = Py_BuildValue("(ONNnNN)",src,allflags,code,groups-1,groupdict,indexgroup);
+
+    return result;
+}
+
+/* Creates the snapshot entry for a single lexer class. */
+static PyObject* snapshot_entry(PyObject* cls,PyObject* parser,PyObject* compiler)
+{
+    Py_ssize_t index;
+    PyObject* dict;
+    PyObject* tokens;
+    PyObject* modname;
+    PyObject* clsname;
+    PyObject* flags;
+    PyObject* patterns;
+    PyObject* seen;
+    PyObject* state;
+    PyObject* rules;
+    PyObject* result;
+
+    /* Only consider token tables built by the class itself. Lexers without a
+     * token table are still recorded so that their modules are preloaded.
+     */
+    dict = PyObject_GetAttrString(cls,"__dict__");
+    if (dict == NULL) {
+        return NULL;
+    }
+
+    tokens = PyMapping_GetItemString(dict,"_tokens");
+    Py_DECREF(dict);
+    if (tokens == NULL || !PyDict_Check(tokens)) {
+        PyErr_Clear();
+        Py_XDECREF(tokens);
+        tokens = PyDict_New();
+        if (tokens == NULL) {
+            return NULL;
+        }
+    }
+
+    modname = PyObject_GetAttrString(cls,"__module__");
+    clsname = PyObject_GetAttrString(cls,"__name__");
+    result = PyObject_GetAttrString(cls,"flags");
+    if (result == NULL) {
+        PyErr_Clear();
+        flags = PyLong_FromLong(0);
+    }
+    else {
+        /* NOTE: The flags may be an re.RegexFlag which cannot be marshaled. */
+        flags = PyLong_FromLong(PyLong_AsLong(result));
+        Py_DECREF(result);
+    }
+    patterns = PyList_New(0);
+    seen = PySet_New(NULL);
+    if (modname == NULL || clsname == NULL || flags == NULL || patterns == NULL || seen == NULL) {
+        Py_XDECREF(modname);
+        Py_XDECREF(clsname);
+        Py_XDECREF(flags);
+        Py_XDECREF(patterns);
+        Py_XDECREF(seen);
+        Py_DECREF(tokens);
+        return NULL;
+    }
+
+    index = 0;
+    while (PyDict_Next(tokens,&index,&state,&rules)) {
+        Py_ssize_t i;
+
+        if (!PyList_Check(rules)) {
+            continue;
+        }
+
+        for (i = 0;i < PyList_GET_SIZE(rules);++i) {
+            PyObject* rule = PyList_GET_ITEM(rules,i);
+            PyObject* pattern;
+            PyObject* src;
+            PyObject* args;
+
+            if (!PyTuple_Check(rule) || PyTuple_GET_SIZE(rule) < 1) {
+                continue;
+            }
+
+            /* The rule stores the bound match() method of the pattern. */
+            pattern = PyObject_GetAttrString(PyTuple_GET_ITEM(rule,0),"__self__");
+            if (pattern == NULL) {
+                PyErr_Clear();
+                continue;
+            }
+
+            src = PyObject_GetAttrString(pattern,"pattern");
+            Py_DECREF(pattern);
+            if (src == NULL || !PyUnicode_Check(src) || PySet_Contains(seen,src) != 0) {
+                PyErr_Clear();
+                Py_XDECREF(src);
+                continue;
+            }
+
+            args = pattern_args(parser,compiler,src,flags);
+            if (args == NULL) {
+                PyErr_Clear();
+                Py_DECREF(src);
+                continue;
+            }
+
+            if (PySet_Add(seen,src) == -1 || PyList_Append(patterns,args) == -1) {
+                PyErr_Clear();
+            }
+            Py_DECREF(args);
+            Py_DECREF(src);
+        }
+    }
+
+    result = Py_BuildValue("(NNNN)",modname,clsname,flags,patterns);
+    Py_DECREF(seen);
+    Py_DECREF(tokens);
+
+    return result;
+}
+
+static PyObject* import_first(const char* name,const char* fallback)
+{
+    PyObject* module = PyImport_ImportModule(name);
+
+    if (module == NULL) {
+        PyErr_Clear();
+        module = PyImport_ImportModule(fallback);
+    }
+
+    return module;
+}
+
+static int write_snapshot(const char* path,PyObject* data)
+{
+    int result;
+    size_t n;
+    FILE* fp;
+    char* tmppath;
+    size_t tmppath_len;
+    PyObject* bytes;
+
+    bytes = PyMarshal_WriteObjectToString(data,Py_MARSHAL_VERSION);
+    if (bytes == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    /* Write to a temporary file first so that concurrent processes never see
+     * a partially written snapshot.
+     */
+    tmppath_len = strlen(path) + 32;
+    tmppath = malloc(tmppath_len);
+    if (tmppath == NULL) {
+        Py_DECREF(bytes);
+        return -1;
+    }
+    snprintf(tmppath,tmppath_len,"%s.%ld.tmp",path,(long)getpid());
+
+    fp = fopen(tmppath,"wb");
+    if (fp == NULL) {
+        free(tmppath);
+        Py_DECREF(bytes);
+        return -1;
+    }
+
+    n = fwrite(PyBytes_AS_STRING(bytes),1,PyBytes_GET_SIZE(bytes),fp);
+    result = fclose(fp);
+    if (n != (size_t)PyBytes_GET_SIZE(bytes) || result != 0 || rename(tmppath,path) != 0) {
+        unlink(tmppath);
+        free(tmppath);
+        Py_DECREF(bytes);
+        return -1;
+    }
+
+    free(tmppath);
+    Py_DECREF(bytes);
+
+    return 0;
+}
+
+int pygments_snapshot_save(struct pygments_context* ctx,const char* path)
+{
+    int result;
+    PyObject* parser;
+    PyObject* compiler;
+    PyObject* entries;
+    PyObject* iter;
+    PyObject* cls;
+    PyObject* version;
+    PyObject* data;
+
+    if (ctx->snapshot_lexers == NULL
+        || PySet_GET_SIZE(ctx->snapshot_lexers) <= ctx->snapshot_loaded)
+    {
+        return 0;
+    }
+
+    parser = import_first("re._parser","sre_parse");
+    if (parser == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    compiler = import_first("re._compiler","sre_compile");
+    if (compiler == NULL) {
+        PyErr_Clear();
+        Py_DECREF(parser);
+        return -1;
+    }
+
+    entries = PyList_New(0);
+    iter = PyObject_GetIter(ctx->snapshot_lexers);
+    if (entries == NULL || iter == NULL) {
+        PyErr_Clear();
+        Py_XDECREF(entries);
+        Py_XDECREF(iter);
+        Py_DECREF(parser);
+        Py_DECREF(compiler);
+        return -1;
+    }
+
+    while ((cls = PyIter_Next(iter)) != NULL) {
+        PyObject* entry = snapshot_entry(cls,parser,compiler);
+        Py_DECREF(cls);
+
+        if (entry == NULL) {
+            PyErr_Clear();
+            continue;
+        }
+
+        if (PyList_Append(entries,entry) == -1) {
+            PyErr_Clear();
+        }
+        Py_DECREF(entry);
+    }
+    PyErr_Clear();
+
+    Py_DECREF(iter);
+    Py_DECREF(parser);
+    Py_DECREF(compiler);
+
+    version = snapshot_version(ctx);
+    if (version == NULL) {
+        PyErr_Clear();
+        Py_DECREF(entries);
+        return -1;
+    }
+
+    data = Py_BuildValue("{sNsN}","version",version,"lexers",entries);
+    if (data == NULL) {
+        PyErr_Clear();
+        return -1;
+    }
+
+    result = write_snapshot(path,data);
+    Py_DECREF(data);
+    if (result == 0) {
+        ctx->snapshot_loaded = PySet_GET_SIZE(ctx->snapshot_lexers);
+    }
+
+    return result;
+}
+
+void pygments_snapshot_track(const struct pygments_context* ctx,PyObject* lexer)
+{
+    if (ctx->snapshot_lexers == NULL) {
+        return;
+    }
+
+    if (PySet_Add(ctx->snapshot_lexers,(PyObject*)Py_TYPE(lexer)) == -1) {
+        PyErr_Clear();
+    }
+}
@@ -0,0 +1,41 @@
+/*
+ * snapshot.h
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "highlight.h"
+
+/*
+ * A lexer snapshot is a file that records the lexer classes used by a process
+ * along with the compiled form of every regular expression in their token
+ * tables. Loading a snapshot imports the lexer modules and seeds Python's
+ * regular expression cache with the precompiled patterns before instantiating
+ * each lexer, which avoids having to parse and compile the token tables from
+ * scratch. A snapshot is only valid for the Python and pygments versions that
+ * wrote it; a stale snapshot is ignored and rewritten.
+ */
+
+/* Loads the snapshot stored at the specified path and warms up the lexers it
+ * describes. This also enables lexer tracking on the context. A missing or
+ * stale snapshot is not considered an error.
+ */
+int pygments_snapshot_load(struct pygments_context* ctx,const char* path);
+
+/* Writes a snapshot for all lexers loaded or tracked on the context to the
+ * specified path. The file is only written if lexers have been used that were
+ * not part of the loaded snapshot.
+ */
+int pygments_snapshot_save(struct pygments_context* ctx,const char* path);
+
+/* Records the class of the specified lexer so that it is included in the next
+ * snapshot. This does nothing if snapshots are not enabled on the context.
+ */
+void pygments_snapshot_track(const struct pygments_context* ctx,PyObject* lexer);
+
+#endif
@@ -0,0 +1,96 @@
+<?php
+
+/*
+ * tests/bench_threads.php
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ *
+ * Measures how pygments_highlight() throughput scales with the number of
+ * threads. This requires a thread-safe (ZTS) build of PHP with the parallel
+ * extension. Each thread highlights the same code with its own context for a
+ * fixed time, and the total number of calls per second is reported for each
+ * thread count. With a regular build of Python, the GIL keeps the throughput
+ * roughly flat; with a free-threaded build, it should grow with the threads.
+ *
+ * Usage: php -d extension=pygments.so tests/bench_threads.php [--threads=N]
+ *     [--seconds=S] [--file=PATH] [--lexer=NAME]
+ */
+
+if (!extension_loaded("parallel")) {
+    fprintf(STDERR,"The parallel extension (which requires a ZTS build of PHP) is not loaded\n");
+    exit(2);
+}
+
+$args = getopt("",["threads:","seconds:","file:","lexer:"]);
+$threads = max(1,(int)($args["threads"] ?? 8));
+$seconds = (float)($args["seconds"] ?? 3);
+$file = $args["file"] ?? __DIR__ . "/corpus/sample.c";
+$lexer = $args["lexer"] ?? "";
+$code = file_get_contents($file);
+if ($code === false) {
+    exit(2);
+}
+
+$expected = md5(pygments_highlight($code,$lexer ?: null,$lexer ? null : basename($file)));
+
+/* Highlights the code until the deadline. Returns the number of calls and
+ * whether every output matched.
+ */
+$task = function(string $code,string $lexer,string $filename,string $expected,int $deadline) : array {
+    $calls = 0;
+    $ok = true;
+    while (hrtime(true) < $deadline) {
+        $html = pygments_highlight($code,$lexer ?: null,$lexer ? null : $filename);
+        $ok = $ok && md5($html) === $expected;
+        $calls += 1;
+    }
+    return [$calls,$ok];
+};
+
+$runtimes = [];
+for ($i = 0;$i < $threads;++$i) {
+    $runtimes[$i] = new \parallel\Runtime();
+
+    /* Warm up each thread's context so that loading the lexer is not timed. */
+    $runtimes[$i]->run(function(string $code,string $lexer,string $filename) {
+        pygments_highlight($code,$lexer ?: null,$lexer ? null : $filename);
+    },[$code,$lexer,basename($file)])->value();
+}
+
+printf("%8s %12s %8s %10s\n","threads","calls/s","speedup","efficiency");
+
+$base = 0;
+$status = 0;
+for ($n = 1;$n <= $threads;++$n) {
+    $deadline = hrtime(true) + (int)($seconds * 1e9);
+    $futures = [];
+    for ($i = 0;$i < $n;++$i) {
+        $futures[] = $runtimes[$i]->run($task,[$code,$lexer,basename($file),$expected,$deadline]);
+    }
+
+    $calls = 0;
+    foreach ($futures as $future) {
+        [$count,$ok] = $future->value();
+        $calls += $count;
+        if (!$ok) {
+            $status = 1;
+        }
+    }
+
+    $rate = $calls / $seconds;
+    if ($n == 1) {
+        $base = $rate;
+    }
+    printf("%8d %12.1f %8.2f %9.0f%%\n",$n,$rate,$rate / $base,100 * $rate / $base / $n);
+}
+
+foreach ($runtimes as $runtime) {
+    $runtime->close();
+}
+
+if ($status != 0) {
+    fprintf(STDERR,"FAIL: a thread produced different output\n");
+}
+exit($status);
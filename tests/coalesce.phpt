@@ -0,0 +1,53 @@
+--TEST--
+Identical pygments_highlight() calls in forked processes share one result
+--SKIPIF--
+<?php
+if (!extension_loaded("pygments")) die("skip pygments extension not loaded");
+if (!extension_loaded("pcntl")) die("skip pcntl extension not loaded");
+?>
+--INI--
+pygments.coalesce_size=8388608
+pygments.coalesce_slots=8
+--FILE--
+<?php
+$code = str_repeat("def f(x):\n    return [y * 2 for y in x if y]  # comment\n",2000);
+$expected = md5(pygments_highlight($code,"python"));
+$dir = sys_get_temp_dir();
+
+$stats = pygments_coalesce_stats();
+var_dump($stats["enabled"],$stats["calls"]);
+
+$pids = [];
+for ($i = 0;$i < 6;++$i) {
+    $pid = pcntl_fork();
+    if ($pid == 0) {
+        file_put_contents("$dir/pygments-coalesce-$i",md5(pygments_highlight($code,"python")));
+        exit(0);
+    }
+    $pids[] = $pid;
+}
+foreach ($pids as $pid) {
+    pcntl_waitpid($pid,$status);
+}
+
+$same = 0;
+for ($i = 0;$i < 6;++$i) {
+    $same += (file_get_contents("$dir/pygments-coalesce-$i") === $expected);
+    unlink("$dir/pygments-coalesce-$i");
+}
+var_dump($same);
+
+/* Every call either computed, received or gave up on a result. */
+$stats = pygments_coalesce_stats();
+var_dump($stats["calls"]);
+var_dump($stats["computed"] + $stats["coalesced"] + $stats["timeouts"] + $stats["bypassed"]);
+var_dump($stats["computed"] >= 2,$stats["in_flight"]);
+?>
+--EXPECT--
+bool(true)
+int(1)
+int(6)
+int(7)
+int(7)
+bool(true)
+int(0)
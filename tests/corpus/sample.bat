@@ -0,0 +1,9 @@
+@echo off
+rem A batch file
+set name=world
+for %%i in (a b c) do echo %%i
+call :greet
+if exist out.txt (del out.txt) else echo none
+goto :eof
+:greet
+echo Hello %name%
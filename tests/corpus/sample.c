@@ -0,0 +1,32 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+/* A small program with the usual constructs. */
+#define SQUARE(x) ((x) * (x))
+
+struct point {
+    int x, y;
+};
+
+static const char* names[] = { "zero", "one", "two" };
+
+int main(int argc,char** argv)
+{
+    int i;
+    unsigned long total = 0x1fUL;
+    double ratio = 1.5e-3;
+    char c = '\n';
+
+    for (i = 0;i < argc;++i) {
+        total += SQUARE(i);
+        printf("%s: %lu\t%f\n",argv[i],total,ratio);
+    }
+
+    // line comment
+    if (argc > 1 && names[argc % 3] != NULL) {
+        goto done;
+    }
+
+done:
+    return c == '\n' ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,6 @@
+function greet --argument name
+    echo "hi $name" 42
+    math 1 + 2
+    set -l x (count $argv) 7
+end
+greet fish 100
\ No newline at end of file
@@ -0,0 +1,27 @@
+'use strict';
+
+const re = /^[a-z]+\d{2,}$/gi;
+let count = 0;
+
+class Widget extends Base {
+    #secret = 42;
+
+    constructor(name, ...rest) {
+        super(name);
+        this.name = `widget-${name}`;
+    }
+
+    async load(url) {
+        const res = await fetch(url, { method: 'GET' });
+        return res.ok ? res.json() : null;
+    }
+}
+
+function* ids() {
+    while (true) yield count++;
+}
+
+export default (a, b = 0x1f) => a ?? b;
+// comment
+/* block
+   comment */
@@ -0,0 +1,14 @@
+-- ODIN data with ISO 8601 durations
+items = <
+    ["first"] = <
+        duration = <PT1H30M>
+        interval = <|P1Y2M3D..P2Y|>
+        period = <P1DT2H3M4S>
+        count = <42>
+        name = <"one">
+    >
+    ["second"] = <
+        duration = <P3W>
+        times = <PT5S, PT10M>
+    >
+>
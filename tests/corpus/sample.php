@@ -0,0 +1,34 @@
+<?php
+
+namespace App\Models;
+
+use InvalidArgumentException;
+
+/**
+ * A user record.
+ */
+final class User extends Model implements \JsonSerializable
+{
+    private const TABLE = 'users';
+
+    public function __construct(private int $id,protected ?string $name = null) {}
+
+    public function jsonSerialize() : mixed
+    {
+        $data = ['id' => $this->id,"name" => "{$this->name}"];
+        return array_map(fn($v) => $v ?? '', $data);
+    }
+
+    public static function find(int|string $id) : static
+    {
+        if (!is_numeric($id)) {
+            throw new InvalidArgumentException("bad id: $id");
+        }
+        return new static((int)$id);
+    }
+}
+
+$heredoc = <<<EOT
+Hello {$user->name}
+EOT;
+echo User::find(42)?->jsonSerialize()['id'] . PHP_EOL;
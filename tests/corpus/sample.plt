@@ -0,0 +1,4 @@
+set xrange [0:10]	set yrange [-1:1]
+# comment
+plot sin(x) with lines title "sine", \
+     cos(x)
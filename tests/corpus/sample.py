@@ -0,0 +1,32 @@
+#!/usr/bin/env python3
+"""Module docstring."""
+
+import os
+from collections import defaultdict
+
+
+class Counter(object):
+    '''Counts things.'''
+
+    def __init__(self, start=0, *args, **kwargs):
+        self.counts = defaultdict(int)
+        self.start = start
+
+    @property
+    def total(self):
+        return sum(self.counts.values()) + self.start
+
+    async def wait(self):
+        await something(b'bytes', r'raw\d+', f'{self.start!r:>10}')
+
+
+def main():
+    c = Counter(0x10)
+    for name in os.listdir('.'):
+        c.counts[name[:3]] += 1
+    print(c.total, 1_000_000, 3.14j, None, True)
+    return [x ** 2 for x in range(10) if x % 2]
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,14 @@
+#!/bin/bash
+set -euo pipefail
+
+name="${1:-world}"
+for f in *.txt; do
+    if [[ -f "$f" && $f != skip* ]]; then
+        echo "Hello, $name: $(wc -l < "$f") lines" >> out.log
+    fi
+done
+
+case "$name" in
+    a*) exit 1 ;;
+    *) printf '%s\n' "$name" ;;
+esac
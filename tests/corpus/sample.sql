@@ -0,0 +1,15 @@
+-- Find the most active users.
+CREATE TABLE users (
+    id INTEGER PRIMARY KEY,
+    name VARCHAR(255) NOT NULL,
+    created TIMESTAMP DEFAULT CURRENT_TIMESTAMP
+);
+
+SELECT u.id, u.name, COUNT(p.id) AS posts
+FROM users u
+LEFT JOIN posts p ON p.user_id = u.id
+WHERE u.name LIKE 'a%' AND u.created > '2024-01-01'
+GROUP BY u.id, u.name
+HAVING COUNT(p.id) > 10
+ORDER BY posts DESC
+LIMIT 20; /* done */
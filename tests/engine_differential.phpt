@@ -0,0 +1,49 @@
+--TEST--
+pygments.engine=pcre produces the same tokens as pygments.engine=python
+--SKIPIF--
+<?php
+if (!extension_loaded("pygments")) die("skip pygments extension not loaded");
+if (!function_exists("proc_open")) die("skip proc_open() not available");
+?>
+--FILE--
+<?php
+/* The engine can only be selected at startup, so the corpus is lexed by a
+ * separate process for each engine (and for PCRE2 with and without JIT).
+ */
+function lex(string $settings) : array {
+    $php = getenv("TEST_PHP_EXECUTABLE") ?: PHP_BINARY;
+    $args = getenv("TEST_PHP_EXTRA_ARGS");
+    if ($args === false || $args === "") {
+        $args = "-n -d extension_dir=" . escapeshellarg(ini_get("extension_dir")) . " -d extension=pygments";
+    }
+
+    $cmd = escapeshellarg($php) . " $args $settings " . escapeshellarg(__DIR__ . "/engine_render.inc");
+    $output = shell_exec($cmd);
+    $results = is_string($output) ? @unserialize($output) : false;
+    if (!is_array($results)) {
+        die("failed to run: $cmd\n");
+    }
+
+    return $results;
+}
+
+$expected = lex("-d pygments.engine=python");
+$lexed = count(array_filter($expected,"is_array"));
+printf("python: %d of %d token lists\n",$lexed,count($expected));
+
+foreach (["-d pygments.engine=pcre -d pcre.jit=1","-d pygments.engine=pcre -d pcre.jit=0"] as $settings) {
+    $actual = lex($settings);
+    $mismatches = 0;
+    foreach ($expected as $key => $tokens) {
+        if (!is_array($tokens) || !array_key_exists($key,$actual) || $actual[$key] !== $tokens) {
+            echo "$settings: $key differs\n";
+            $mismatches += 1;
+        }
+    }
+    printf("%s: %d of %d token lists match\n",$settings,count($expected) - $mismatches,count($expected));
+}
+?>
+--EXPECT--
+python: 231 of 231 token lists
+-d pygments.engine=pcre -d pcre.jit=1: 231 of 231 token lists match
+-d pygments.engine=pcre -d pcre.jit=0: 231 of 231 token lists match
@@ -0,0 +1,86 @@
+--TEST--
+pygments_highlight_document() highlights the code blocks in Markdown and HTML
+--SKIPIF--
+<?php if (!extension_loaded("pygments")) die("skip pygments extension not loaded"); ?>
+--FILE--
+<?php
+$markdown = <<<'MD'
+# Title
+
+Some text with `inline code`.
+
+```c
+int a;
+
+int b;
+```
+
+~~~ {.python}
+x = 1
+~~~
+
+```no-such-language
+left alone
+```
+
+    indented code is not a fence
+MD;
+
+$out = pygments_highlight_document($markdown,"markdown",$info);
+var_dump($info);
+var_dump(str_starts_with($out,"# Title\n\nSome text with `inline code`.\n\n<div"));
+var_dump(str_contains($out,"```no-such-language\nleft alone\n```"));
+var_dump(str_contains($out,"    indented code is not a fence"));
+var_dump(str_contains($out,"```c"),str_contains($out,"~~~"));
+
+/* Blank lines in a block must not end the HTML block in Markdown. */
+var_dump(str_contains($out,"\n<span></span>\n"));
+
+$html = '<p>x</p><pre><code class="language-php">$a = &quot;&lt;b&gt;&quot;;</code></pre>'
+    . '<pre><code class="language-c"><b>markup</b></code></pre>';
+$out = pygments_highlight_document($html,"html",$info);
+var_dump($info);
+var_dump(str_starts_with($out,"<p>x</p><div"));
+var_dump(str_contains($out,'<pre><code class="language-c"><b>markup</b></code></pre>'));
+var_dump(str_contains($out,"&lt;b&gt;"));
+
+/* The preview limits apply to each block. */
+pygments_set_options(["max_lines" => 1]);
+pygments_highlight_document($markdown,"markdown",$info);
+var_dump($info["highlighted"],$info["truncated"]);
+
+try {
+    pygments_highlight_document($markdown,"rst");
+} catch (ValueError $e) {
+    echo $e->getMessage(),"\n";
+}
+?>
+--EXPECT--
+array(3) {
+  ["blocks"]=>
+  int(3)
+  ["highlighted"]=>
+  int(2)
+  ["truncated"]=>
+  int(0)
+}
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+bool(false)
+bool(true)
+array(3) {
+  ["blocks"]=>
+  int(1)
+  ["highlighted"]=>
+  int(1)
+  ["truncated"]=>
+  int(0)
+}
+bool(true)
+bool(true)
+bool(true)
+int(2)
+int(1)
+pygments_highlight_document(): Argument #2 ($format) must be either "markdown" or "html"
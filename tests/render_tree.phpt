@@ -0,0 +1,65 @@
+--TEST--
+pygments_render_tree() renders a directory tree and skips unchanged files
+--SKIPIF--
+<?php if (!extension_loaded("pygments")) die("skip pygments extension not loaded"); ?>
+--FILE--
+<?php
+$root = sys_get_temp_dir() . "/pygments-render-tree";
+exec("rm -rf " . escapeshellarg($root));
+$src = "$root/src";
+$dst = "$root/dst";
+mkdir("$src/lib",0777,true);
+file_put_contents("$src/main.c","int main(void) { return 0; }\n");
+file_put_contents("$src/lib/util.py","def f():\n    return 1\n");
+file_put_contents("$src/2024","int x;\n");
+file_put_contents("$src/.hidden.c","int hidden;\n");
+
+/* Warm up the context's formatter with the default options first. */
+pygments_highlight("int y;","c");
+
+$summary = pygments_render_tree($src,$dst,["workers" => 2,"noclasses" => true]);
+var_dump($summary["rendered"],$summary["skipped"],$summary["failed"]);
+var_dump(count($summary["files"]));
+var_dump(isset($summary["files"]["main.c"]),isset($summary["files"]["lib/util.py"]));
+var_dump(isset($summary["files"]["2024"]),isset($summary["files"][2024]));
+var_dump(isset($summary["files"][".hidden.c"]));
+
+$html = file_get_contents("$dst/main.c.html");
+var_dump(str_contains($html,'style="'),str_contains($html,'class="k"'));
+
+/* Nothing changed, so everything is skipped. */
+$summary = pygments_render_tree($src,$dst,["workers" => 2,"noclasses" => true]);
+var_dump($summary["rendered"],$summary["skipped"]);
+
+/* Changing the options invalidates the manifest. */
+$summary = pygments_render_tree($src,$dst,["workers" => 2]);
+var_dump($summary["rendered"]);
+var_dump(str_contains(file_get_contents("$dst/main.c.html"),'class="k"'));
+
+/* The output cannot be written over the source tree. */
+var_dump(pygments_render_tree($src,$src));
+var_dump(file_exists("$src/main.c.html"));
+?>
+--CLEAN--
+<?php
+$root = sys_get_temp_dir() . "/pygments-render-tree";
+exec("rm -rf " . escapeshellarg($root));
+?>
+--EXPECT--
+int(3)
+int(0)
+int(0)
+int(3)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
+bool(false)
+bool(true)
+bool(false)
+int(0)
+int(3)
+int(3)
+bool(true)
+bool(false)
+bool(false)
@@ -0,0 +1,45 @@
+--TEST--
+pygments_set_options() takes effect on the next call, including span options
+--SKIPIF--
+<?php if (!extension_loaded("pygments")) die("skip pygments extension not loaded"); ?>
+--INI--
+pygments.token_cache_size=1048576
+--FILE--
+<?php
+$code = "int main(void) { return 0; }";
+
+function spans(string $html) : string {
+    if (str_contains($html,'style="')) {
+        return "inline";
+    }
+    return preg_match('/<span class="([a-z-]*)kt">/',$html,$m) ? "class:$m[1]" : "none";
+}
+
+$sets = [
+    [],
+    ["noclasses" => true],
+    [],
+    ["classprefix" => "x-"],
+    ["classprefix" => "x-","noclasses" => true],
+    ["classprefix" => "y-"],
+    [],
+];
+foreach ($sets as $options) {
+    pygments_set_options($options);
+    echo spans(pygments_highlight($code,"c")),"\n";
+}
+
+/* The tokens were lexed once and reused for every option set. */
+$stats = pygments_token_cache_stats();
+var_dump($stats["entries"],$stats["hits"]);
+?>
+--EXPECT--
+class:
+inline
+class:
+class:x-
+inline
+class:y-
+class:
+int(1)
+int(6)
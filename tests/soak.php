@@ -0,0 +1,190 @@
+<?php
+
+/*
+ * tests/soak.php
+ *
+ * php-pygments
+ *
+ * Copyright (C) Roger P. Gee
+ *
+ * Drives pygments_highlight() and pygments_set_options() with a mix of inputs
+ * for a long time in a single process and checks that the memory held by the
+ * process and the interpreter, and the per-call latency, stay flat after the
+ * warm-up. Exits with a non-zero status if any of them drifts past its limit.
+ *
+ * Usage: php -d extension=pygments.so tests/soak.php [--calls=N] [--warmup=N]
+ *     [--interval=N] [--max-rss=KiB] [--max-blocks=N] [--max-refcount=N]
+ *     [--max-traced=BYTES] [--max-drift=RATIO] [--seed=N] [--quiet]
+ *
+ * A limit of 0 disables the corresponding check. The interpreter's traced
+ * memory is only checked when tracemalloc is enabled (PYTHONTRACEMALLOC=1), and
+ * its total reference count only when Python is a debug build.
+ */
+
+$args = getopt("",[
+    "calls:",
+    "warmup:",
+    "interval:",
+    "max-rss:",
+    "max-blocks:",
+    "max-refcount:",
+    "max-traced:",
+    "max-drift:",
+    "seed:",
+    "quiet",
+]);
+
+$calls = (int)($args["calls"] ?? 2000000);
+$warmup = (int)($args["warmup"] ?? 50000);
+$interval = max(1,(int)($args["interval"] ?? 10000));
+$limits = [
+    "rss" => (int)($args["max-rss"] ?? 16384),
+    "blocks" => (int)($args["max-blocks"] ?? 20000),
+    "refcount" => (int)($args["max-refcount"] ?? 20000),
+    "traced" => (int)($args["max-traced"] ?? 4194304),
+    "drift" => (float)($args["max-drift"] ?? 1.5),
+];
+$quiet = isset($args["quiet"]);
+
+mt_srand((int)($args["seed"] ?? 1));
+
+/* Each input is (code,preferred_lexer,filename). */
+$inputs = [
+    ["int main(int argc,char** argv)\n{\n    return argc > 1 ? 0 : 1;\n}\n","c",null],
+    ["<?php\nfunction f(array \$a) : int { return count(\$a); }\n",null,"index.php"],
+    ["def f(x):\n    return [y * 2 for y in x if y]\n","python",null],
+    ["const f = (a,b) => `\${a}-\${b}`;\n",null,"app.js"],
+    ["SELECT id,name FROM users WHERE id IN (1,2,3);\n","sql",null],
+    ["<html><body class=\"x\">&amp; text</body></html>\n",null,"page.html"],
+    ["--- a/f\n+++ b/f\n@@ -1 +1 @@\n-old\n+new\n","diff",null],
+    ["","c",null],
+    /* Invalid UTF-8 */
+    ["int x = 1; /* \xff\xfe\xc3\x28 */\n","c",null],
+    ["\x80\x81\x82\xc0\xaf","python",null],
+    /* Unknown lexers and filenames */
+    ["int x;\n","no-such-lexer",null],
+    ["int x;\n",null,"file.no-such-extension"],
+    /* Guessing with little to go on */
+    ["@@@ ~~~ ###\n",null,null],
+    ["\x01\x02\x03\x04",null,null],
+    [str_repeat("x = 1\n",2000),"python",null],
+];
+
+/* Option sets, including ones that change the formatter's spans. */
+$optionSets = [
+    [],
+    ["linenos" => true,"linenostart" => 10],
+    ["noclasses" => true],
+    ["classprefix" => "p-"],
+    ["cssclass" => "code","cssstyles" => "margin: 0","prestyles" => "color: red"],
+    ["lineanchors" => "L","linenos" => true],
+    ["compact" => true],
+    ["max_lines" => 3],
+    ["max_bytes" => 40,"compact" => true],
+];
+
+function rss_kib() : int {
+    $status = @file_get_contents("/proc/self/status");
+    if ($status !== false && preg_match('/^VmRSS:\s+(\d+)/m',$status,$m)) {
+        return (int)$m[1];
+    }
+    return 0;
+}
+
+function sample(int $calls,float $latency) : array {
+    $mem = pygments_memory_stats();
+    return [
+        "calls" => $calls,
+        "rss" => rss_kib(),
+        "blocks" => $mem["allocated_blocks"],
+        "refcount" => $mem["total_refcount"],
+        "traced" => $mem["traced_memory"],
+        "latency" => $latency,
+    ];
+}
+
+function median(array $values) : float {
+    sort($values);
+    $n = count($values);
+    if ($n == 0) {
+        return 0;
+    }
+    return ($n % 2) ? $values[intdiv($n,2)] : ($values[$n / 2 - 1] + $values[$n / 2]) / 2;
+}
+
+if (!$quiet) {
+    printf("%10s %10s %10s %10s %12s %10s\n","calls","rss KiB","blocks","refcount","traced","usec/call");
+}
+
+$samples = [];
+$elapsed = 0.0;
+$failures = 0;
+for ($i = 1;$i <= $calls;++$i) {
+    if (mt_rand(0,9) == 0) {
+        pygments_set_options($optionSets[mt_rand(0,count($optionSets) - 1)]);
+    }
+
+    [$code,$lexer,$filename] = $inputs[mt_rand(0,count($inputs) - 1)];
+
+    $start = hrtime(true);
+    $html = pygments_highlight($code,$lexer,$filename,$truncated);
+    $elapsed += hrtime(true) - $start;
+    if ($html === false) {
+        $failures += 1;
+    }
+
+    if ($i % $interval == 0) {
+        $s = sample($i,$elapsed / $interval / 1000);
+        $elapsed = 0.0;
+        if ($i > $warmup) {
+            $samples[] = $s;
+        }
+
+        if (!$quiet) {
+            printf("%10d %10d %10d %10s %12s %10.1f\n",$s["calls"],$s["rss"],$s["blocks"],
+                $s["refcount"] ?? "-",$s["traced"] ?? "-",$s["latency"]);
+        }
+    }
+}
+
+printf("%d calls, %d returned false\n",$calls,$failures);
+
+if (count($samples) < 2) {
+    fprintf(STDERR,"FAIL: too few samples after the warm-up (increase --calls)\n");
+    exit(2);
+}
+
+/* Compare the first sample after the warm-up against the smallest of the last
+ * few samples, so that a transient peak at the end is not reported as growth.
+ * Latency is compared between the medians of the first and last few intervals.
+ */
+$window = max(1,min(5,intdiv(count($samples),4)));
+$first = array_slice($samples,0,$window);
+$last = array_slice($samples,-$window);
+$status = 0;
+
+foreach (["rss","blocks","refcount","traced"] as $key) {
+    if ($limits[$key] <= 0 || $samples[0][$key] === null) {
+        continue;
+    }
+
+    $growth = min(array_column($last,$key)) - $samples[0][$key];
+    printf("%s growth: %d (limit %d)\n",$key,$growth,$limits[$key]);
+    if ($growth > $limits[$key]) {
+        fprintf(STDERR,"FAIL: %s grew by %d\n",$key,$growth);
+        $status = 1;
+    }
+}
+
+if ($limits["drift"] > 0) {
+    $before = median(array_column($first,"latency"));
+    $after = median(array_column($last,"latency"));
+    $drift = ($before > 0) ? $after / $before : 0;
+    printf("latency drift: %.2f (limit %.2f)\n",$drift,$limits["drift"]);
+    if ($drift > $limits["drift"]) {
+        fprintf(STDERR,"FAIL: latency went from %.1f to %.1f usec/call\n",$before,$after);
+        $status = 1;
+    }
+}
+
+exit($status);